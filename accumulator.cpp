@@ -0,0 +1,134 @@
+////////////////////////////////////////////////////////////////////////
+//
+// accumulator.cpp: Sum up weighted pixels of an ID-rendered image
+// per poly.
+//
+// This is the CPU-side inner loop of the hemicube calculations, so
+// it's worth a bit of effort. Indices are decoded four pixels at a
+// time with SSE2 where available, and since polys tend to cover runs
+// of adjacent pixels, we sum up each run before adding it to its
+// poly's total.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+
+#include "accumulator.h"
+
+// We're not using that many polys, so skip the low bits of each
+// channel. This means we can see what's going on better if we do a
+// test render.
+void encodePolyIndex(int index, unsigned char *rgba)
+{
+    rgba[0] = (index << 2) & 0xFC;
+    rgba[1] = (index >> 4) & 0xFC;
+    rgba[2] = (index >> 10) & 0xFC;
+    rgba[3] = 0xFF;
+}
+
+int decodePolyIndex(unsigned char const *rgba)
+{
+    return (rgba[0] >> 2) | ((rgba[1] & 0xFC) << 4) | ((rgba[2] & 0xFC) << 10);
+}
+
+// Decode the poly indices of "count" pixels into "ids".
+static void decodeIndices(unsigned char const *pixels, int count, int *ids)
+{
+    int i = 0;
+#ifdef __SSE2__
+    // Pixels are RGBA bytes, so little-endian 32-bit words.
+    __m128i const mask = _mm_set1_epi32(0xFC);
+    for (; i + 4 <= count; i += 4) {
+        __m128i p = _mm_loadu_si128(
+            reinterpret_cast<__m128i const *>(pixels + NUM_CHANS * i));
+        __m128i r = _mm_and_si128(p, mask);
+        __m128i g = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+        __m128i b = _mm_and_si128(_mm_srli_epi32(p, 16), mask);
+        __m128i id = _mm_or_si128(_mm_srli_epi32(r, 2),
+                                  _mm_or_si128(_mm_slli_epi32(g, 4),
+                                               _mm_slli_epi32(b, 10)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(ids + i), id);
+    }
+#endif
+    for (; i < count; ++i) {
+        ids[i] = decodePolyIndex(pixels + NUM_CHANS * i);
+    }
+}
+
+WeightAccumulator::WeightAccumulator(int numPolys)
+    : m_sums(numPolys),
+      m_stamps(numPolys),
+      m_generation(1)
+{
+}
+
+void WeightAccumulator::addToPoly(int index, double weight)
+{
+    // Index 0 is the background.
+    if (index == 0) {
+        return;
+    }
+    --index;
+    if (m_stamps[index] != m_generation) {
+        m_stamps[index] = m_generation;
+        m_touched.push_back(index);
+    }
+    m_sums[index] += weight;
+}
+
+void WeightAccumulator::add(unsigned char const *pixels,
+                            float const *weights,
+                            int count)
+{
+    // Decode in chunks, to keep the scratch space in cache.
+    int const CHUNK = 1024;
+    m_ids.resize(CHUNK);
+    int *ids = &m_ids[0];
+
+    // The current run, with a compensated (Kahan) sum of its weights,
+    // so that long runs of small float weights stay accurate.
+    int runId = 0;
+    float runSum = 0.0f;
+    float runErr = 0.0f;
+
+    for (int start = 0; start < count; start += CHUNK) {
+        int const n = std::min(CHUNK, count - start);
+        decodeIndices(pixels + NUM_CHANS * start, n, ids);
+        float const *ws = weights + start;
+
+        for (int i = 0; i < n; ++i) {
+            if (ids[i] != runId) {
+                addToPoly(runId, runSum);
+                runId = ids[i];
+                runSum = 0.0f;
+                runErr = 0.0f;
+            }
+            float y = ws[i] - runErr;
+            float t = runSum + y;
+            runErr = (t - runSum) - y;
+            runSum = t;
+        }
+    }
+    addToPoly(runId, runSum);
+}
+
+void WeightAccumulator::take(double *row)
+{
+    for (int i = 0, n = m_touched.size(); i < n; ++i) {
+        int const index = m_touched[i];
+        row[index] = m_sums[index];
+        m_sums[index] = 0.0;
+    }
+    m_touched.clear();
+
+    // Start a new generation, dealing with wrap-around.
+    if (++m_generation == 0) {
+        std::fill(m_stamps.begin(), m_stamps.end(), 0);
+        m_generation = 1;
+    }
+}
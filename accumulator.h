@@ -0,0 +1,55 @@
+////////////////////////////////////////////////////////////////////////
+//
+// accumulator.h: Sum up weighted pixels of an ID-rendered image
+// per poly.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#ifndef RADIOSITY_ACCUMULATOR_H
+#define RADIOSITY_ACCUMULATOR_H
+
+#include <vector>
+
+// Number of bytes per RGBA pixel.
+static int const NUM_CHANS = 4;
+
+// Encode poly index "index" as an RGBA colour. Index 0 is reserved
+// for the background.
+void encodePolyIndex(int index, unsigned char *rgba);
+
+// Decode a poly index from an RGBA colour.
+int decodePolyIndex(unsigned char const *rgba);
+
+// Accumulates weighted pixel counts per poly, only doing work for
+// the polys actually seen.
+class WeightAccumulator
+{
+public:
+    explicit WeightAccumulator(int numPolys);
+
+    // For each of the "count" RGBA pixels, add the matching weight
+    // to the sum for the pixel's poly.
+    void add(unsigned char const *pixels, float const *weights, int count);
+
+    // Add a weight directly to the poly with encoded index "index".
+    void addToPoly(int index, double weight);
+
+    // Store the sums for polys seen since the last call into "row",
+    // which has an entry per poly, and reset them. Entries for polys
+    // not seen are left untouched.
+    void take(double *row);
+
+private:
+    // Sums being calculated, one per poly. Zero between takes.
+    std::vector<double> m_sums;
+    // Polys with non-zero sums. m_stamps records the generation each
+    // poly was last added in, so we can check membership cheaply.
+    std::vector<int> m_touched;
+    std::vector<unsigned> m_stamps;
+    unsigned m_generation;
+    // Scratch space for decoded indices.
+    std::vector<int> m_ids;
+};
+
+#endif // RADIOSITY_ACCUMULATOR_H
@@ -0,0 +1,150 @@
+////////////////////////////////////////////////////////////////////////
+//
+// accumulator_test.cpp: Tests for accumulator.cpp.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include <cstdlib>
+#include <vector>
+
+#include <cppunit/TestCase.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "accumulator.h"
+
+class AccumulatorTestCase : public CppUnit::TestCase
+{
+private:
+    CPPUNIT_TEST_SUITE(AccumulatorTestCase);
+    CPPUNIT_TEST(testEncodeDecode);
+    CPPUNIT_TEST(testMatchesSimpleSum);
+    CPPUNIT_TEST(testOddCounts);
+    CPPUNIT_TEST(testTakeResets);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testEncodeDecode();
+    void testMatchesSimpleSum();
+    void testOddCounts();
+    void testTakeResets();
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(AccumulatorTestCase,
+                                      "AccumulatorTestCase");
+
+// Build an image with runs of random polys (or background), like a
+// real render, along with random weights.
+static void makeImage(int numPolys,
+                      int count,
+                      std::vector<unsigned char> &pixels,
+                      std::vector<float> &weights)
+{
+    pixels.resize(NUM_CHANS * count);
+    weights.resize(count);
+    int index = 0;
+    for (int i = 0; i < count; ++i) {
+        if (rand() % 8 == 0) {
+            index = rand() % (numPolys + 1);
+        }
+        encodePolyIndex(index, &pixels[NUM_CHANS * i]);
+        weights[i] = rand() / static_cast<float>(RAND_MAX) / count;
+    }
+}
+
+// Straightforward double-precision version to compare against.
+static void simpleSum(int numPolys,
+                      std::vector<unsigned char> const &pixels,
+                      std::vector<float> const &weights,
+                      std::vector<double> &sums)
+{
+    sums.assign(numPolys, 0.0);
+    for (int i = 0, n = weights.size(); i < n; ++i) {
+        int index = decodePolyIndex(&pixels[NUM_CHANS * i]);
+        if (index > 0) {
+            sums[index - 1] += weights[i];
+        }
+    }
+}
+
+void AccumulatorTestCase::testEncodeDecode()
+{
+    int const indices[] = { 0, 1, 63, 64, 4095, 4096, 100000, (1 << 18) - 1 };
+    for (int i = 0, n = sizeof(indices) / sizeof(*indices); i < n; ++i) {
+        unsigned char rgba[NUM_CHANS];
+        encodePolyIndex(indices[i], rgba);
+        CPPUNIT_ASSERT_EQUAL(0xFF, static_cast<int>(rgba[3]));
+        CPPUNIT_ASSERT_EQUAL(indices[i], decodePolyIndex(rgba));
+    }
+}
+
+void AccumulatorTestCase::testMatchesSimpleSum()
+{
+    int const numPolys = 5000;
+    int const count = 256 * 256 * 3;
+    std::vector<unsigned char> pixels;
+    std::vector<float> weights;
+    makeImage(numPolys, count, pixels, weights);
+
+    std::vector<double> expected;
+    simpleSum(numPolys, pixels, weights, expected);
+
+    WeightAccumulator acc(numPolys);
+    acc.add(&pixels[0], &weights[0], count);
+    std::vector<double> actual(numPolys);
+    acc.take(&actual[0]);
+
+    for (int i = 0; i < numPolys; ++i) {
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(expected[i], actual[i], 1.0e-9);
+    }
+}
+
+// Counts that aren't a multiple of the vector width or chunk size
+// need the scalar tail.
+void AccumulatorTestCase::testOddCounts()
+{
+    int const numPolys = 50;
+    int const counts[] = { 1, 3, 5, 1023, 1025, 3001 };
+    for (int c = 0, nc = sizeof(counts) / sizeof(*counts); c < nc; ++c) {
+        std::vector<unsigned char> pixels;
+        std::vector<float> weights;
+        makeImage(numPolys, counts[c], pixels, weights);
+
+        std::vector<double> expected;
+        simpleSum(numPolys, pixels, weights, expected);
+
+        WeightAccumulator acc(numPolys);
+        acc.add(&pixels[0], &weights[0], counts[c]);
+        std::vector<double> actual(numPolys);
+        acc.take(&actual[0]);
+
+        for (int i = 0; i < numPolys; ++i) {
+            CPPUNIT_ASSERT_DOUBLES_EQUAL(expected[i], actual[i], 1.0e-9);
+        }
+    }
+}
+
+// take should only write polys seen, and start afresh afterwards.
+void AccumulatorTestCase::testTakeResets()
+{
+    int const numPolys = 4;
+    unsigned char pixels[3 * NUM_CHANS];
+    encodePolyIndex(2, pixels);
+    encodePolyIndex(2, pixels + NUM_CHANS);
+    encodePolyIndex(0, pixels + 2 * NUM_CHANS);
+    float const weights[] = { 0.25f, 0.5f, 1.0f };
+
+    WeightAccumulator acc(numPolys);
+    acc.add(pixels, weights, 3);
+    acc.add(pixels, weights, 1);
+    std::vector<double> row(numPolys, -1.0);
+    acc.take(&row[0]);
+    CPPUNIT_ASSERT_EQUAL(-1.0, row[0]);
+    CPPUNIT_ASSERT_EQUAL(1.0, row[1]);
+    CPPUNIT_ASSERT_EQUAL(-1.0, row[2]);
+    CPPUNIT_ASSERT_EQUAL(-1.0, row[3]);
+
+    std::vector<double> row2(numPolys, -1.0);
+    acc.add(pixels + NUM_CHANS, weights, 1);
+    acc.take(&row2[0]);
+    CPPUNIT_ASSERT_EQUAL(0.25, row2[1]);
+}
@@ -0,0 +1,430 @@
+////////////////////////////////////////////////////////////////////////
+//
+// bench.cpp: Microbenchmarks for the hot parts of the radiosity
+// calculation, printed as a table and optionally saved as JSON.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "geom.h"
+#include "glut_wrap.h"
+#include "item_buffer.h"
+#include "solver.h"
+#include "transfers.h"
+#include "weighting.h"
+
+// Each benchmark is timed in this many samples, each of enough
+// iterations to take at least the sample time.
+static int const NUM_SAMPLES = 5;
+static double sampleSeconds = 0.2;
+
+// Hemicube resolution for the transfer benchmarks.
+static int const TRANSFER_RESOLUTION = 128;
+
+static int numThreads = 1;
+
+// Benchmarks whose name contains one of these are run. All are run
+// if there are none.
+static std::vector<std::string> filters;
+
+// Results are stored here, so the optimiser can't drop the work.
+static volatile double sink;
+
+struct BenchResult
+{
+    std::string name;
+    long iterations;
+    // Median and fastest of the samples.
+    double nsPerOp;
+    double minNsPerOp;
+    // What an op works through, for throughput. "bytesPerOp" is 0 if
+    // it's not meaningful.
+    double itemsPerOp;
+    std::string itemUnit;
+    double bytesPerOp;
+};
+
+static std::vector<BenchResult> results;
+
+static bool selected(std::string const &name)
+{
+    if (filters.empty()) {
+        return true;
+    }
+    for (int i = 0, n = filters.size(); i < n; ++i) {
+        if (name.find(filters[i]) != std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template<typename Fn>
+static double timeBatch(Fn &fn, long iterations)
+{
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; ++i) {
+        fn();
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count() / iterations;
+}
+
+// Time "fn", after one untimed run to warm up and size the batches.
+template<typename Fn>
+static void bench(std::string const &name,
+                  double itemsPerOp,
+                  char const *itemUnit,
+                  double bytesPerOp,
+                  Fn fn)
+{
+    double once = timeBatch(fn, 1);
+    long iterations = std::max(1L, static_cast<long>(sampleSeconds * 1e9 /
+                                                     std::max(once, 1.0)));
+    std::vector<double> samples;
+    for (int i = 0; i < NUM_SAMPLES; ++i) {
+        samples.push_back(timeBatch(fn, iterations));
+    }
+    std::sort(samples.begin(), samples.end());
+
+    BenchResult r;
+    r.name = name;
+    r.iterations = iterations * NUM_SAMPLES;
+    r.nsPerOp = samples[NUM_SAMPLES / 2];
+    r.minNsPerOp = samples[0];
+    r.itemsPerOp = itemsPerOp;
+    r.itemUnit = itemUnit;
+    r.bytesPerOp = bytesPerOp;
+    results.push_back(r);
+
+    std::cout << std::left << std::setw(44) << r.name << std::right
+              << std::setw(10) << r.iterations
+              << std::setw(16) << std::fixed << std::setprecision(0)
+              << r.nsPerOp
+              << std::setw(14) << std::scientific << std::setprecision(3)
+              << r.itemsPerOp * 1e9 / r.nsPerOp << " " << std::left
+              << std::setw(8) << r.itemUnit << std::right;
+    if (r.bytesPerOp > 0.0) {
+        std::cout << std::setw(10) << std::fixed << std::setprecision(2)
+                  << r.bytesPerOp / r.nsPerOp;
+    }
+    std::cout << std::endl;
+}
+
+static std::string withParam(std::string const &name,
+                             char const *param, int value)
+{
+    std::ostringstream oss;
+    oss << name << "/" << param << ":" << value;
+    return oss.str();
+}
+
+////////////////////////////////////////////////////////////////////////
+// Test scene
+
+// The unit cube, each face split "split" x "split", with the middle
+// of the top lit.
+struct Scene
+{
+    explicit Scene(int split)
+        : vertices(cubeVertices)
+    {
+        for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+            subdivs.push_back(subdivide(cubeFaces[i], vertices, faces,
+                                        split, split));
+        }
+        for (int i = 0, n = faces.size(); i < n; ++i) {
+            Vertex c = paraCentre(faces[i], vertices);
+            faces[i].screenColour = Colour(0.5, 0.5, 0.5);
+            if (c.y() > 0.9 && fabs(c.x()) < 0.5 && fabs(c.z()) < 0.5) {
+                faces[i].isEmitter = true;
+                faces[i].screenColour = faces[i].materialColour;
+            }
+        }
+    }
+
+    std::vector<Vertex> vertices;
+    std::vector<Quad> faces;
+    std::vector<SubdivInfo> subdivs;
+};
+
+////////////////////////////////////////////////////////////////////////
+// The benchmarks
+
+static void benchWeights()
+{
+    typedef void (*weightFn_t)(int, std::vector<double> &);
+    struct { char const *name; weightFn_t fn; } const generators[] = {
+        { "projSubtendWeights", projSubtendWeights },
+        { "calcSubtendWeights", calcSubtendWeights },
+        { "calcForwardLightWeights", calcForwardLightWeights },
+        { "calcSideLightWeights", calcSideLightWeights },
+        { "calcAtlasLightWeights", calcAtlasLightWeights },
+    };
+    int const resolutions[] = { 64, 256 };
+    for (auto const &gen : generators) {
+        for (int res : resolutions) {
+            std::string name = withParam(gen.name, "res", res);
+            if (!selected(name)) {
+                continue;
+            }
+            std::vector<double> weights;
+            gen.fn(res, weights);
+            double size = weights.size();
+            bench(name, size, "weights", size * sizeof(double), [&]() {
+                gen.fn(res, weights);
+                sink = weights[0];
+            });
+        }
+    }
+}
+
+// Summing a rendered hemicube against the light weights: the front
+// face and the front halves of the four sides.
+static void benchSumLight()
+{
+    int const res = 256;
+    std::string name = withParam("sumLight", "res", res);
+    if (!selected(name)) {
+        return;
+    }
+    Scene scene(8);
+    RenderTransferCalculator calc(scene.vertices, scene.faces, res);
+    ItemBuffer items;
+    calc.renderLightItems(Camera::baseCamera, items, false);
+    std::vector<double> row(scene.faces.size());
+    double pixels = 3.0 * res * res;
+    // An RGBA item and a float weight per pixel.
+    bench(name, pixels, "pixels", pixels * 8, [&]() {
+        calc.sumLight(items, &row[0]);
+        sink = row[0];
+    });
+}
+
+// Render, read back and sum one patch's hemicube.
+static void benchPatchLight()
+{
+    int const splits[] = { 8, 32 };
+    for (int split : splits) {
+        Scene scene(split);
+        std::string name = withParam(
+            withParam("calcLight", "patches", scene.faces.size()),
+            "res", TRANSFER_RESOLUTION);
+        if (!selected(name)) {
+            continue;
+        }
+        RenderTransferCalculator calc(scene.vertices, scene.faces,
+                                      TRANSFER_RESOLUTION);
+        calc.setUseAtlas(true);
+        calc.setBlocks(scene.subdivs);
+        std::vector<double> row(scene.faces.size());
+        bench(name, 1, "patches", 0.0, [&]() {
+            calc.calcLight(Camera::baseCamera, &row[0]);
+            sink = row[0];
+        });
+    }
+}
+
+static void benchAllLights()
+{
+    int const splits[] = { 2, 4, 8 };
+    for (int split : splits) {
+        Scene scene(split);
+        std::string name = withParam(
+            withParam("calcAllLights", "patches", scene.faces.size()),
+            "res", TRANSFER_RESOLUTION);
+        if (!selected(name)) {
+            continue;
+        }
+        RenderTransferCalculator calc(scene.vertices, scene.faces,
+                                      TRANSFER_RESOLUTION, numThreads);
+        calc.setUseAtlas(true);
+        calc.setBlocks(scene.subdivs);
+        // No dots to stderr in the timed region.
+        calc.setProgress(false);
+        std::vector<double> transfers;
+        bench(name, scene.faces.size(), "patches", 0.0, [&]() {
+            calc.calcAllLights(transfers);
+            sink = transfers[0];
+        });
+    }
+}
+
+// One Jacobi step, with made-up transfers. It's bound by reading the
+// transfer matrix.
+static void benchIterate()
+{
+    int const splits[] = { 8, 16 };
+    for (int split : splits) {
+        Scene scene(split);
+        size_t n = scene.faces.size();
+        std::string name = withParam("iterateLighting", "patches", n);
+        if (!selected(name)) {
+            continue;
+        }
+        std::vector<double> transfers(n * n);
+        unsigned seed = 1;
+        for (size_t i = 0; i < n * n; ++i) {
+            seed = seed * 1103515245 + 12345;
+            transfers[i] = (seed >> 16) / 65536.0 / n;
+        }
+        std::vector<Quad> faces(scene.faces);
+        bench(name, n, "patches", n * n * sizeof(double), [&]() {
+            iterateLighting(faces, transfers);
+            sink = faces[0].screenColour.r;
+        });
+    }
+}
+
+// The total light in the scene, once per iteration.
+static void benchTotalLight()
+{
+    Scene scene(32);
+    size_t n = scene.faces.size();
+    std::string name = withParam("totalLight", "patches", n);
+    if (!selected(name)) {
+        return;
+    }
+    bench(name, n, "patches", 0.0, [&]() {
+        sink = ::calcLight(scene.faces, scene.vertices);
+    });
+}
+
+static void benchSubdivide()
+{
+    int const split = 32;
+    std::string name = withParam("subdivide", "split", split);
+    if (!selected(name)) {
+        return;
+    }
+    double patches = cubeFaces.size() * split * split;
+    bench(name, patches, "patches", 0.0, [&]() {
+        std::vector<Vertex> vertices(cubeVertices);
+        std::vector<Quad> faces;
+        std::vector<SubdivInfo> subdivs;
+        for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+            subdivs.push_back(subdivide(cubeFaces[i], vertices, faces,
+                                        split, split));
+        }
+        sink = faces.size();
+    });
+}
+
+static void benchGouraud()
+{
+    Scene scene(64);
+    std::string name = withParam(
+        withParam("generateGouraudMesh", "patches", scene.faces.size()),
+        "threads", numThreads);
+    if (!selected(name)) {
+        return;
+    }
+    GouraudMesh mesh;
+    generateGouraudMesh(scene.subdivs, mesh, numThreads);
+    // Bytes written.
+    double bytes = mesh.positions.size() * sizeof(VertexF) +
+        mesh.colours.size() * sizeof(ColourF) +
+        mesh.indices.size() * sizeof(GLuint);
+    bench(name, scene.faces.size(), "patches", bytes, [&]() {
+        generateGouraudMesh(scene.subdivs, mesh, numThreads);
+        sink = mesh.colours[0].r;
+    });
+}
+
+////////////////////////////////////////////////////////////////////////
+// Output
+
+static void writeJSON(std::ostream &os)
+{
+    os << "{\n  \"context\": { \"threads\": " << numThreads
+       << ", \"sample_seconds\": " << sampleSeconds
+       << ", \"samples\": " << NUM_SAMPLES << " },\n"
+       << "  \"benchmarks\": [";
+    os << std::setprecision(6);
+    for (int i = 0, n = results.size(); i < n; ++i) {
+        BenchResult const &r = results[i];
+        os << (i == 0 ? "\n" : ",\n")
+           << "    { \"name\": \"" << r.name << "\""
+           << ", \"iterations\": " << r.iterations
+           << ", \"ns_per_op\": " << r.nsPerOp
+           << ", \"min_ns_per_op\": " << r.minNsPerOp
+           << ", \"items_per_second\": " << r.itemsPerOp * 1e9 / r.nsPerOp
+           << ", \"item_unit\": \"" << r.itemUnit << "\"";
+        if (r.bytesPerOp > 0.0) {
+            os << ", \"bytes_per_second\": " << r.bytesPerOp * 1e9 / r.nsPerOp;
+        }
+        os << " }";
+    }
+    os << "\n  ]\n}\n";
+}
+
+static void usage(char const *prog)
+{
+    std::cerr << "Usage: " << prog << " [--json <file>] [--time <seconds>]"
+              << " [--threads <n>] [<filter>...]" << std::endl;
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    gwInit(&argc, argv);
+
+    std::string jsonPath;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--json" && hasValue) {
+            jsonPath = argv[++i];
+        } else if (arg == "--time" && hasValue) {
+            sampleSeconds = atof(argv[++i]);
+        } else if (arg == "--threads" && hasValue) {
+            numThreads = std::max(atoi(argv[++i]), 1);
+        } else if (arg.compare(0, 2, "--") == 0) {
+            usage(argv[0]);
+        } else {
+            filters.push_back(arg);
+        }
+    }
+
+    std::cout << std::left << std::setw(44) << "benchmark" << std::right
+              << std::setw(10) << "iters" << std::setw(16) << "ns/op"
+              << std::setw(14) << "items/s" << std::setw(10) << " "
+              << std::setw(9) << "GB/s" << std::endl;
+    try {
+        benchWeights();
+        benchSumLight();
+        benchPatchLight();
+        benchAllLights();
+        benchIterate();
+        benchTotalLight();
+        benchSubdivide();
+        benchGouraud();
+
+        if (!jsonPath.empty()) {
+            std::ofstream os(jsonPath.c_str());
+            writeJSON(os);
+            if (!os) {
+                throw std::runtime_error("Couldn't write " + jsonPath);
+            }
+        }
+    } catch (std::exception const &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -13,16 +13,16 @@
 
 #include <iostream>
 #include <cmath>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "geom.h"
 #include "glut_wrap.h"
 #include "rendering.h"
-#include "transfers.h"
-
-// Relative change in total light in the scene by the point we stop
-// iterating.
-const double CONVERGENCE_TARGET = 0.001;
+#include "scene_file.h"
+#include "solver.h"
+#include "trace.h"
 
 // Break up each base quad into subdivision^2 subquads for radiosity
 // calculations.
@@ -50,109 +50,105 @@ void initLighting(std::vector<Quad> &qs, std::vector<Vertex> const &vs)
     }
 }
 
-void iterateLighting(std::vector<Quad> &qs, std::vector<double> const &transfers)
-{
-    int const n = qs.size();
-    std::vector<Colour> updatedColours(n);
-
-    // Iterate over targets
-    for (int i = 0; i < n; ++i) {
-        Colour incoming;
-        if (qs[i].isEmitter) {
-            // Emission is just like having 1.0 light arrive.
-            incoming = Colour(1.0, 1.0, 1.0);
-        } else {
-            // Iterate over sources
-            for (int j = 0; j < n; ++j) {
-                if (i == j) {
-                    continue;
-                }
-                incoming += qs[j].screenColour * transfers[i * n + j];
-            }
-        }
-        updatedColours[i] = incoming * qs[i].materialColour;
-    }
-
-    for (int i = 0; i < n; ++i) {
-        qs[i].screenColour = updatedColours[i];
-    }
-}
-
-// Calculate the total light in the scene, as area-weight sum of
-// screenColour.
-double calcLight(std::vector<Quad> &qs, std::vector<Vertex> const &vs)
-{
-    double totalLight = 0.0;
-    for (std::vector<Quad>::iterator iter = qs.begin(), end = qs.end();
-         iter != end; ++iter) {
-        totalLight += iter->screenColour.asGrey() * paraArea(*iter, vs);
-    }
-    return totalLight;
-}
-
 ////////////////////////////////////////////////////////////////////////
 // And the main rendering bit...
 
 // Geometry.
 static std::vector<Quad> faces;
 static std::vector<Vertex> vertices;
-// Array of quad-to-quad light transfers.
-static std::vector<double> transfers;
 // And data for generating Gouraud shading.
 static std::vector<SubdivInfo> subdivs;
 
 // Subdivide the faces
 void initGeometry(void)
 {
+    TRACE_SCOPE("geometry");
     vertices = cubeVertices;
-    // Draw the outer 'scene' cube, by subdividing the prototype.
+    // Draw the outer 'scene' cube, by subdividing the prototype. The
+    // faces share vertices along the cube's edges.
+    VertexWelder welder(vertices);
     for (std::vector<Quad>::const_iterator iter = cubeFaces.begin(),
              end = cubeFaces.end(); iter != end; ++iter) {
-        subdivs.push_back(subdivide(*iter, vertices, faces,
+        subdivs.push_back(subdivide(*iter, welder, faces,
                                     SUBDIVISION, SUBDIVISION));
     }
 
-    // Then draw the inner cube: Take the basic scene cube, scale it
-    // down, rotate and move it...
+    // Then draw the inner cube: Take its own copy of the scene cube's
+    // corners, scale it down, rotate and move it...
+    int const innerStart = vertices.size();
+    vertices.insert(vertices.end(), cubeVertices.begin(), cubeVertices.end());
+    int const innerEnd = vertices.size();
     std::vector<Quad> sceneFaces(cubeFaces); // Enclosed cube
-    scale(0.4, sceneFaces, vertices);
+    for (std::vector<Quad>::iterator iter = sceneFaces.begin(),
+             end = sceneFaces.end(); iter != end; ++iter) {
+        for (int i = 0; i < 4; ++i) {
+            iter->indices[i] += innerStart;
+        }
+    }
     flip(sceneFaces, vertices);
-    rotate(Vertex(1.0, 0.0, 0.0), M_PI / 3.0, sceneFaces, vertices);
-    rotate(Vertex(0.0, 0.0, 1.0), M_PI / 6.0, sceneFaces, vertices);
-    translate(Vertex(0.0, -0.25, 0.0), sceneFaces, vertices);
+    Transform()
+        .scale(0.4)
+        .rotate(Vertex(1.0, 0.0, 0.0), M_PI / 3.0)
+        .rotate(Vertex(0.0, 0.0, 1.0), M_PI / 6.0)
+        .translate(Vertex(0.0, -0.25, 0.0))
+        .apply(vertices, innerStart, innerEnd);
     // Copy the subdivided version into 'faces' (lower subdivisions,
     // as smaller).
+    VertexWelder innerWelder(vertices);
     for (std::vector<Quad>::const_iterator iter = sceneFaces.begin(),
              end = sceneFaces.end(); iter != end; ++iter) {
-        subdivs.push_back(subdivide(*iter, vertices, faces,
+        subdivs.push_back(subdivide(*iter, innerWelder, faces,
                                     SUBDIVISION / 2, SUBDIVISION / 2));
     }
 }
 
+// Save the images of the lit faces, and build the mesh to show.
+static void saveResults(bool hdr, GouraudMesh &mesh)
+{
+    if (hdr) {
+        generateGouraudMesh(subdivs, mesh,
+                            std::thread::hardware_concurrency());
+        writeHDR(mesh, "png/scene.pfm");
+    }
+    normaliseBrightness(faces, vertices);
+    generateGouraudMesh(subdivs, mesh, std::thread::hardware_concurrency());
+    saveGouraud(mesh);
+    TRACE_WRITE("png/trace.json");
+}
+
 int main(int argc, char **argv)
 {
-    glutInit(&argc, argv);
+    gwInit(&argc, argv);
 
-    initGeometry();
-    initLighting(faces, vertices);
-    RenderTransferCalculator(vertices, faces, 256).calcAllLights(transfers);
-    double light = 0.0;
-    double relChange;
-    do {
-        iterateLighting(faces, transfers);
-        double newLight = calcLight(faces, vertices);
-        relChange = fabs(light / newLight - 1.0);
-        light = newLight;
-        std::cout << "Total light: " << light << std::endl;
-    } while (relChange > CONVERGENCE_TARGET);
+    // "--hdr" also saves the unnormalised light levels.
+    bool hdr = argc > 1 && std::string(argv[1]) == "--hdr";
+    if (hdr) {
+        --argc;
+        ++argv;
+    }
 
-    normaliseBrightness(faces, vertices);
-    std::vector<Vertex> gVertices;
-    std::vector<GouraudQuad> gourauds;
-    for (std::vector<SubdivInfo>::iterator iter = subdivs.begin(),
-             end = subdivs.end(); iter != end; ++iter) {
-        iter->generateGouraudQuads(gourauds, gVertices);
+    // Either load a scene file, with its own lighting, or use the
+    // built-in scene.
+    if (argc > 1) {
+        loadScene(argv[1], vertices, faces, subdivs);
+    } else {
+        initGeometry();
+        initLighting(faces, vertices);
     }
-    renderGouraud(gourauds, gVertices);
+    Solver solver(vertices, faces, subdivs,
+                  std::thread::hardware_concurrency());
+#if defined(GW_OFFSCREEN) && !defined(GW_HEADLESS)
+    // Solve in the background, showing how it's going.
+    solver.start();
+    watchSolve(solver, faces, vertices, subdivs, [hdr](GouraudMesh &mesh) {
+        saveResults(hdr, mesh);
+    });
+#else
+    solver.run();
+    faces = solver.faces();
+    GouraudMesh mesh;
+    saveResults(hdr, mesh);
+    renderGouraud(mesh);
+#endif
     return 0;
 }
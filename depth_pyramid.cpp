@@ -0,0 +1,83 @@
+////////////////////////////////////////////////////////////////////////
+//
+// depth_pyramid.cpp: A max-depth mip pyramid, for conservative
+// occlusion tests against a rendered depth buffer.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include <algorithm>
+
+#include "depth_pyramid.h"
+
+void DepthPyramid::build(float const *depths, int width, int height)
+{
+    // Reuse the storage from last time where we can.
+    int level = 0;
+    m_widths.clear();
+    m_heights.clear();
+    while (true) {
+        if (level == static_cast<int>(m_levels.size())) {
+            m_levels.push_back(std::vector<float>());
+        }
+        std::vector<float> &curr = m_levels[level];
+        curr.resize(width * height);
+        m_widths.push_back(width);
+        m_heights.push_back(height);
+
+        if (level == 0) {
+            std::copy(depths, depths + width * height, curr.begin());
+        } else {
+            std::vector<float> const &prev = m_levels[level - 1];
+            int const prevWidth = m_widths[level - 1];
+            int const prevHeight = m_heights[level - 1];
+            for (int y = 0; y < height; ++y) {
+                int const y0 = 2 * y;
+                int const y1 = std::min(y0 + 1, prevHeight - 1);
+                for (int x = 0; x < width; ++x) {
+                    int const x0 = 2 * x;
+                    int const x1 = std::min(x0 + 1, prevWidth - 1);
+                    curr[y * width + x] = std::max(
+                        std::max(prev[y0 * prevWidth + x0],
+                                 prev[y0 * prevWidth + x1]),
+                        std::max(prev[y1 * prevWidth + x0],
+                                 prev[y1 * prevWidth + x1]));
+                }
+            }
+        }
+
+        if (width == 1 && height == 1) {
+            break;
+        }
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        ++level;
+    }
+    m_levels.resize(level + 1);
+}
+
+float DepthPyramid::maxDepth(int x0, int y0, int x1, int y1) const
+{
+    // Go up the levels until the (inclusive) range covers at most
+    // two cells each way.
+    int level = 0;
+    --x1;
+    --y1;
+    while (x1 - x0 > 1 || y1 - y0 > 1) {
+        x0 >>= 1;
+        y0 >>= 1;
+        x1 >>= 1;
+        y1 >>= 1;
+        ++level;
+    }
+
+    std::vector<float> const &depths = m_levels[level];
+    int const width = m_widths[level];
+    float result = 0.0f;
+    for (int y = y0; y <= y1; ++y) {
+        for (int x = x0; x <= x1; ++x) {
+            result = std::max(result, depths[y * width + x]);
+        }
+    }
+    return result;
+}
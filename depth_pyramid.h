@@ -0,0 +1,35 @@
+////////////////////////////////////////////////////////////////////////
+//
+// depth_pyramid.h: A max-depth mip pyramid, for conservative
+// occlusion tests against a rendered depth buffer.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#ifndef RADIOSITY_DEPTH_PYRAMID_H
+#define RADIOSITY_DEPTH_PYRAMID_H
+
+#include <vector>
+
+class DepthPyramid
+{
+public:
+    // Build the pyramid from a width x height image of depths, stored
+    // a row at a time.
+    void build(float const *depths, int width, int height);
+
+    // Return an upper bound on the depth of the pixels in
+    // [x0, x1) x [y0, y1), which must be non-empty and inside the
+    // image. Looks at no more than four cells, so may take in some
+    // pixels round the edges.
+    float maxDepth(int x0, int y0, int x1, int y1) const;
+
+private:
+    // Level 0 is the image, and each level after that halves it,
+    // rounding up.
+    std::vector<std::vector<float> > m_levels;
+    std::vector<int> m_widths;
+    std::vector<int> m_heights;
+};
+
+#endif // RADIOSITY_DEPTH_PYRAMID_H
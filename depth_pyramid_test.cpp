@@ -0,0 +1,92 @@
+////////////////////////////////////////////////////////////////////////
+//
+// depth_pyramid_test.cpp: Tests for depth_pyramid.cpp.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+#include <cppunit/TestCase.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "depth_pyramid.h"
+
+class DepthPyramidTestCase : public CppUnit::TestCase
+{
+private:
+    CPPUNIT_TEST_SUITE(DepthPyramidTestCase);
+    CPPUNIT_TEST(testSinglePixels);
+    CPPUNIT_TEST(testIsUpperBound);
+    CPPUNIT_TEST(testWholeImage);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testSinglePixels();
+    void testIsUpperBound();
+    void testWholeImage();
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(DepthPyramidTestCase,
+                                      "DepthPyramidTestCase");
+
+// Odd sizes, to exercise the edges of each level.
+static int const WIDTH = 37;
+static int const HEIGHT = 21;
+
+static std::vector<float> makeDepths()
+{
+    std::vector<float> depths(WIDTH * HEIGHT);
+    for (int i = 0, n = depths.size(); i < n; ++i) {
+        depths[i] = rand() / static_cast<float>(RAND_MAX);
+    }
+    return depths;
+}
+
+void DepthPyramidTestCase::testSinglePixels()
+{
+    std::vector<float> depths = makeDepths();
+    DepthPyramid pyramid;
+    pyramid.build(&depths[0], WIDTH, HEIGHT);
+    for (int y = 0; y < HEIGHT; ++y) {
+        for (int x = 0; x < WIDTH; ++x) {
+            CPPUNIT_ASSERT_EQUAL(depths[y * WIDTH + x],
+                                 pyramid.maxDepth(x, y, x + 1, y + 1));
+        }
+    }
+}
+
+void DepthPyramidTestCase::testIsUpperBound()
+{
+    std::vector<float> depths = makeDepths();
+    DepthPyramid pyramid;
+    pyramid.build(&depths[0], WIDTH, HEIGHT);
+    for (int i = 0; i < 1000; ++i) {
+        int x0 = rand() % WIDTH;
+        int y0 = rand() % HEIGHT;
+        int x1 = x0 + 1 + rand() % (WIDTH - x0);
+        int y1 = y0 + 1 + rand() % (HEIGHT - y0);
+        float expected = 0.0f;
+        for (int y = y0; y < y1; ++y) {
+            for (int x = x0; x < x1; ++x) {
+                expected = std::max(expected, depths[y * WIDTH + x]);
+            }
+        }
+        CPPUNIT_ASSERT(pyramid.maxDepth(x0, y0, x1, y1) >= expected);
+    }
+}
+
+void DepthPyramidTestCase::testWholeImage()
+{
+    std::vector<float> depths(WIDTH * HEIGHT, 0.25f);
+    depths[WIDTH * HEIGHT - 1] = 0.75f;
+    DepthPyramid pyramid;
+    // Build twice, to check old levels don't leak through.
+    pyramid.build(&depths[0], WIDTH, HEIGHT);
+    pyramid.build(&depths[0], 4, 4);
+    CPPUNIT_ASSERT_EQUAL(0.25f, pyramid.maxDepth(0, 0, 4, 4));
+    pyramid.build(&depths[0], WIDTH, HEIGHT);
+    CPPUNIT_ASSERT_EQUAL(0.75f, pyramid.maxDepth(0, 0, WIDTH, HEIGHT));
+    CPPUNIT_ASSERT_EQUAL(0.25f, pyramid.maxDepth(0, 0, 16, 16));
+}
@@ -13,150 +13,13 @@
 
 #include <iostream>
 #include <cmath>
-#include <map>
+#include <cstring>
+#include <unordered_map>
 #include <vector>
 
 #include "geom.h"
-
-////////////////////////////////////////////////////////////////////////
-// Vertex
-
-Vertex::Vertex(double ix, double iy, double iz)
-    : p {ix, iy, iz}
-{
-}
-
-Vertex::Vertex(Vertex const &v)
-    : p {v.x(), v.y(), v.z()}
-{
-}
-
-double Vertex::len() const
-{
-    return std::sqrt(x() * x() + y() * y() + z() * z());
-}
-
-Vertex Vertex::norm() const
-{
-    double l = len();
-    return Vertex(x() / l, y() / l, z() / l);
-}
-
-// Get an arbitrary perpendicular vector.
-Vertex Vertex::perp() const
-{
-    // Choose the axis-aligned vector most orthogonal, and then
-    // properly orthogonalise it.
-    double ax = fabs(x()), ay = fabs(y()), az = fabs(z());
-    if (ax < ay && ax < az) {
-        return orthog(Vertex(1.0, 0.0, 0.0), *this);
-    }
-    if (ay < az) {
-        return orthog(Vertex(0.0, 1.0, 0.0), *this);
-    } else {
-        return orthog(Vertex(0.0, 0.0, 1.0), *this);
-    }
-}
-
-Vertex Vertex::scale(double s) const
-{
-    return Vertex(x() * s, y() * s, z() * s);
-}
-
-Vertex Vertex::operator+(Vertex const &rhs) const
-{
-    return Vertex(x() + rhs.x(), y() + rhs.y(), z() + rhs.z());
-}
-
-Vertex Vertex::operator-(Vertex const &rhs) const
-{
-    return Vertex(x() - rhs.x(), y() - rhs.y(), z() - rhs.z());
-}
-
-double Vertex::x() const { return p[0]; }
-double Vertex::y() const { return p[1]; }
-double Vertex::z() const { return p[2]; }
-
-std::ostream &operator<<(std::ostream &os, Vertex const &v)
-{
-    return os << "(" << v.x() << ", " << v.y() << ", " << v.z() << ")";
-}
-
-// Cross product.
-Vertex cross(Vertex const &v1, Vertex const &v2)
-{
-    return Vertex(v1.y() * v2.z() - v1.z() * v2.y(),
-                  v1.z() * v2.x() - v1.x() * v2.z(),
-                  v1.x() * v2.y() - v1.y() * v2.x());
-}
-
-// Dot product.
-double dot(Vertex const &v1, Vertex const &v2)
-{
-    return v1.x() * v2.x()
-         + v1.y() * v2.y()
-         + v1.z() * v2.z();
-}
-
-// Orthogonalise v1, taking away the v2 component.
-Vertex orthog(Vertex const &v1, Vertex const &v2)
-{
-    double c = dot(v1, v2) / dot(v2, v2);
-    return v1 - v2.scale(c);
-}
-
-// Linear interpolation. 0 returns v1, 1 returns v2.
-Vertex lerp(Vertex const &v1, Vertex const &v2, double i)
-{
-    double j = 1.0 - i;
-    return Vertex(v1.x() * j + v2.x() * i,
-                  v1.y() * j + v2.y() * i,
-                  v1.z() * j + v2.z() * i);
-}
-
-////////////////////////////////////////////////////////////////////////
-// Colour
-
-Colour::Colour(double red, double green, double blue)
-    : r(red), g(green), b(blue)
-{
-}
-
-Colour::Colour(Colour const &c)
-    : r(c.r), g(c.g), b(c.b)
-{
-}
-
-Colour::Colour()
-    : r(0.0), g(0.0), b(0.0)
-{
-}
-
-Colour Colour::operator*(double x) const
-{
-    return Colour(r * x, g * x, b * x);
-}
-
-Colour Colour::operator*(Colour const &c) const
-{
-    return Colour(r * c.r, g * c.g, b * c.b);
-}
-
-Colour Colour::operator+(Colour const &c) const
-{
-    return Colour(r + c.r, g + c.g, b + c.b);
-}
-
-Colour &Colour::operator+=(Colour const &c)
-{
-    r += c.r; g += c.g; b += c.b;
-    return *this;
-}
-
-double Colour::asGrey() const
-{
-    return 0.2126 * r + 0.7152 * g + 0.0722 * b;
-}
+#include "parallel.h"
+#include "trace.h"
 
 ////////////////////////////////////////////////////////////////////////
 // Quad
@@ -183,25 +46,6 @@ void Quad::render(std::vector<Vertex> const &v) const
     glEnd();
 }
 
-void Quad::renderIndex(int index, std::vector<Vertex> const &v) const
-{
-    Vertex const &v0 = v[indices[0]];
-    Vertex const &v1 = v[indices[1]];
-    Vertex const &v2 = v[indices[2]];
-    Vertex const &v3 = v[indices[3]];
-    Vertex n = cross(v3 - v0, v1 - v0).norm();
-    glBegin(GL_QUADS);
-    // We're not using that many polys, so skip the low bits. This
-    // means we can see what's going on better if we do a test render.
-    glColor3ub((index << 2) & 0xFC, (index >> 4) & 0xFC, (index >> 10) & 0xFC);
-    glNormal3dv(n.p);
-    glVertex3dv(v0.p);
-    glVertex3dv(v1.p);
-    glVertex3dv(v2.p);
-    glVertex3dv(v3.p);
-    glEnd();
-}
-
 // Return the centre of the quad. Assumes paralellogram.
 Vertex paraCentre(Quad const &q, std::vector<Vertex> const &vs)
 {
@@ -227,139 +71,146 @@ double paraArea(Quad const &q, std::vector<Vertex> const &vs)
     return paraCross(q, vs).len();
 }
 
-// Applies a transform to the requested vertices, with a cache.
-class VertexTransformer
-{
-private:
-    std::vector<Vertex> &m_vertices;
+////////////////////////////////////////////////////////////////////////
+// Affine transforms
 
-    // Cache of vertices scaled already.
-    std::map<int, int> m_scaledVertices;
+Transform::Transform()
+    : m {{ 1.0, 0.0, 0.0, 0.0 },
+         { 0.0, 1.0, 0.0, 0.0 },
+         { 0.0, 0.0, 1.0, 0.0 }}
+{
+}
 
-    virtual Vertex transform(Vertex const &v) const = 0;
+Transform &Transform::translate(Vertex const &t)
+{
+    for (int i = 0; i < 3; ++i) {
+        m[i][3] += t.p[i];
+    }
+    return *this;
+}
 
-public:
-    VertexTransformer(std::vector<Vertex> &vertices)
-        : m_vertices(vertices)
-    {
+Transform &Transform::scale(double s)
+{
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            m[i][j] *= s;
+        }
     }
+    return *this;
+}
 
-    int operator()(int i)
-    {
-        // Return cached result is present.
-        std::map<int, int>::const_iterator iter = m_scaledVertices.find(i);
-        if (iter != m_scaledVertices.end()) {
-            return iter->second;
+Transform &Transform::rotate(Vertex const &axis, double angle)
+{
+    // Build an orthonormal basis, where plane1 and plane2 are the
+    // plane of rotation, and rotate in it.
+    Vertex a = axis.norm();
+    Vertex plane1 = a.perp().norm();
+    Vertex plane2 = cross(a, plane1);
+    double c = cos(angle);
+    double s = sin(angle);
+    // Where each basis vector ends up.
+    Vertex to1 = plane1.scale(c) - plane2.scale(s);
+    Vertex to2 = plane1.scale(s) + plane2.scale(c);
+
+    Transform r;
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            r.m[i][j] = to1.p[i] * plane1.p[j] +
+                        to2.p[i] * plane2.p[j] +
+                        a.p[i] * a.p[j];
         }
-        // Else add and return.
-        int j = m_vertices.size();
-        m_scaledVertices[i] = j;
-        m_vertices.push_back(transform(m_vertices[i]));
-        return j;
     }
+    return then(r);
+}
 
-    void transformAll(std::vector<Quad> &qs)
-    {
-        for (int i = 0, n = qs.size(); i < n; ++i) {
-            Quad &q = qs[i];
-            for (int j = 0; j < 4; ++j) {
-                q.indices[j] = (*this)(q.indices[j]);
+Transform &Transform::then(Transform const &next)
+{
+    double out[3][4];
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            double sum = j == 3 ? next.m[i][3] : 0.0;
+            for (int k = 0; k < 3; ++k) {
+                sum += next.m[i][k] * m[k][j];
             }
+            out[i][j] = sum;
         }
     }
-};
+    memcpy(m, out, sizeof(m));
+    return *this;
+}
 
-class VertexTranslater : public VertexTransformer
+Vertex Transform::operator()(Vertex const &v) const
 {
-private:
-    Vertex const &m_offset;
+    return Vertex(
+        m[0][0] * v.p[0] + m[0][1] * v.p[1] + m[0][2] * v.p[2] + m[0][3],
+        m[1][0] * v.p[0] + m[1][1] * v.p[1] + m[1][2] * v.p[2] + m[1][3],
+        m[2][0] * v.p[0] + m[2][1] * v.p[1] + m[2][2] * v.p[2] + m[2][3]);
+}
 
-    virtual Vertex transform(Vertex const &v) const
-    {
-        return v + m_offset;
+void Transform::apply(std::vector<Vertex> &vs, int begin, int end) const
+{
+    // Pull the matrix into locals, so the compiler knows the writes
+    // don't alias it, and can keep it in registers.
+    double const m00 = m[0][0], m01 = m[0][1], m02 = m[0][2], m03 = m[0][3];
+    double const m10 = m[1][0], m11 = m[1][1], m12 = m[1][2], m13 = m[1][3];
+    double const m20 = m[2][0], m21 = m[2][1], m22 = m[2][2], m23 = m[2][3];
+    for (int i = begin; i < end; ++i) {
+        double *p = vs[i].p;
+        double x = p[0], y = p[1], z = p[2];
+        p[0] = m00 * x + m01 * y + m02 * z + m03;
+        p[1] = m10 * x + m11 * y + m12 * z + m13;
+        p[2] = m20 * x + m21 * y + m22 * z + m23;
     }
+}
 
-public:
-    VertexTranslater(Vertex const &offset,
-                     std::vector<Vertex> &vertices)
-        : m_offset(offset), VertexTransformer(vertices)
-    {
+void Transform::apply(std::vector<Quad> &qs, std::vector<Vertex> &vs) const
+{
+    // Copy each vertex used once, then transform the copies in one go.
+    int const copyStart = vs.size();
+    std::unordered_map<int, int> copies;
+    for (int i = 0, n = qs.size(); i < n; ++i) {
+        Quad &q = qs[i];
+        for (int j = 0; j < 4; ++j) {
+            std::pair<std::unordered_map<int, int>::iterator, bool> ins =
+                copies.insert(std::make_pair(q.indices[j], vs.size()));
+            if (ins.second) {
+                vs.push_back(Vertex(vs[q.indices[j]]));
+            }
+            q.indices[j] = ins.first->second;
+        }
     }
-};
+    apply(vs, copyStart, vs.size());
+}
 
 // Translate the given quads, in-place.
 void translate(Vertex const &t,
           std::vector<Quad> &qs,
           std::vector<Vertex> &vs)
 {
-    VertexTranslater(t, vs).transformAll(qs);;
+    Transform().translate(t).apply(qs, vs);
 }
 
-class VertexScaler : public VertexTransformer
+void translate(Vertex const &t,
+               std::vector<Vertex> &vs,
+               int begin, int end)
 {
-private:
-    double m_scale;
-
-    virtual Vertex transform(Vertex const &v) const
-    {
-        return v.scale(m_scale);
-    }
-
-public:
-    VertexScaler(double scale,
-                 std::vector<Vertex> &vertices)
-        : m_scale(scale), VertexTransformer(vertices)
-    {
-    }
-};
+    Transform().translate(t).apply(vs, begin, end);
+}
 
 // Scale the given quads, in-place.
 void scale(double s,
            std::vector<Quad> &qs,
            std::vector<Vertex> &vs)
 {
-    VertexScaler(s, vs).transformAll(qs);
+    Transform().scale(s).apply(qs, vs);
 }
 
-class VertexRotater : public VertexTransformer
+void scale(double s,
+           std::vector<Vertex> &vs,
+           int begin, int end)
 {
-private:
-    double m_angle;
-    // m_axis, m_plane1 and m_plane 2 form an orthonormal basis, where
-    // m_plane1 and m_plane2 are the plane of rotation.
-    Vertex m_axis;
-    Vertex m_plane1;
-    Vertex m_plane2;
-
-    virtual Vertex transform(Vertex const &v) const
-    {
-        // Decompase v to our rotation's basis.
-        double x = dot(v, m_plane1);
-        double y = dot(v, m_plane2);
-        double z = dot(v, m_axis);
-        // Perform the rotation in the x-y plane
-        double c = cos(m_angle);
-        double s = sin(m_angle);
-        double x2 =  c * x + s * y;
-        double y2 = -s * x + c * y;
-        // And construct a vector in the original basis.
-        return m_plane1.scale(x2) +
-            m_plane2.scale(y2) +
-            m_axis.scale(z);
-    }
-
-public:
-    VertexRotater(Vertex const &axis,
-                  double angle,
-                  std::vector<Vertex> &vertices)
-        : m_angle(angle),
-          m_axis(axis.norm()),
-          m_plane1(m_axis.perp().norm()),
-          m_plane2(cross(m_axis, m_plane1)),
-          VertexTransformer(vertices)
-    {
-    }
-};
+    Transform().scale(s).apply(vs, begin, end);
+}
 
 // Rotate the given quads, in-place.
 void rotate(Vertex const &axis,
@@ -367,7 +218,15 @@ void rotate(Vertex const &axis,
             std::vector<Quad> &qs,
             std::vector<Vertex> &vs)
 {
-    VertexRotater(axis, angle, vs).transformAll(qs);
+    Transform().rotate(axis, angle).apply(qs, vs);
+}
+
+void rotate(Vertex const &axis,
+            double angle,
+            std::vector<Vertex> &vs,
+            int begin, int end)
+{
+    Transform().rotate(axis, angle).apply(vs, begin, end);
 }
 
 // Flip the facing direction of the quads.
@@ -380,98 +239,235 @@ void flip(std::vector<Quad> &qs,
     }
 }
 
+static uint64_t edgeKey(int from, int to)
+{
+    return (static_cast<uint64_t>(static_cast<uint32_t>(from)) << 32) |
+        static_cast<uint32_t>(to);
+}
+
+std::vector<int> quadNeighbours(std::vector<Quad> const &qs)
+{
+    // Map each directed edge to its quad. A neighbour with the same
+    // winding has the same edge going the other way.
+    std::unordered_map<uint64_t, int> edges;
+    edges.reserve(qs.size() * 4);
+    for (int i = 0, n = qs.size(); i < n; ++i) {
+        Quad const &q = qs[i];
+        for (int j = 0; j < 4; ++j) {
+            edges.insert(std::make_pair(
+                edgeKey(q.indices[j], q.indices[(j + 1) % 4]), i));
+        }
+    }
+
+    std::vector<int> neighbours(qs.size() * 4, -1);
+    for (int i = 0, n = qs.size(); i < n; ++i) {
+        Quad const &q = qs[i];
+        for (int j = 0; j < 4; ++j) {
+            std::unordered_map<uint64_t, int>::const_iterator iter =
+                edges.find(edgeKey(q.indices[(j + 1) % 4], q.indices[j]));
+            if (iter != edges.end()) {
+                neighbours[i * 4 + j] = iter->second;
+            }
+        }
+    }
+    return neighbours;
+}
+
 ////////////////////////////////////////////////////////////////////////
-// Gouraud-shaded quad, used only for final rendering.
+// Vertex welding
 
-GouraudQuad::GouraudQuad(int v1, int v2, int v3, int v4,
-                         Colour c1, Colour c2, Colour c3, Colour c4)
-    : m_indices { v1, v2, v3, v4 },
-      m_colours { c1, c2, c3, c4 }
+VertexWelder::VertexWelder(std::vector<Vertex> &vs, double epsilon)
+    : m_vertices(vs),
+      m_epsilon(epsilon)
 {
+    m_cells.reserve(vs.size());
+    for (int i = 0, n = vs.size(); i < n; ++i) {
+        int64_t cell[3];
+        cellOf(vs[i], cell);
+        m_cells.insert(std::make_pair(hashCell(cell), i));
+    }
 }
 
-void GouraudQuad::render(std::vector<Vertex> const &v) const
+// Cells are bigger than epsilon, so that most lookups only need to
+// check one cell.
+static double const WELD_CELL_SCALE = 16.0;
+
+void VertexWelder::cellOf(Vertex const &v, int64_t cell[3]) const
 {
-    Vertex const &v0 = v[m_indices[0]];
-    Vertex const &v1 = v[m_indices[1]];
-    Vertex const &v2 = v[m_indices[2]];
-    Vertex const &v3 = v[m_indices[3]];
-    Vertex n = cross(v3 - v0, v1 - v0).norm();
-    glBegin(GL_QUADS);
-    glNormal3dv(n.p);
-    glColor3d(m_colours[0].r, m_colours[0].g, m_colours[0].b);
-    glVertex3dv(v0.p);
-    glColor3d(m_colours[1].r, m_colours[1].g, m_colours[1].b);
-    glVertex3dv(v1.p);
-    glColor3d(m_colours[2].r, m_colours[2].g, m_colours[2].b);
-    glVertex3dv(v2.p);
-    glColor3d(m_colours[3].r, m_colours[3].g, m_colours[3].b);
-    glVertex3dv(v3.p);
-    glEnd();
+    double const cellSize = m_epsilon * WELD_CELL_SCALE;
+    for (int i = 0; i < 3; ++i) {
+        cell[i] = static_cast<int64_t>(floor(v.p[i] / cellSize));
+    }
+}
+
+uint64_t VertexWelder::hashCell(int64_t const cell[3])
+{
+    // Large odd multipliers, to spread neighbouring cells about.
+    return static_cast<uint64_t>(cell[0]) * 0x9e3779b97f4a7c15ull ^
+           static_cast<uint64_t>(cell[1]) * 0xc2b2ae3d27d4eb4full ^
+           static_cast<uint64_t>(cell[2]) * 0x165667b19e3779f9ull;
+}
+
+int VertexWelder::add(Vertex const &v)
+{
+    // Check every cell touching the box within epsilon of v.
+    Vertex const e(m_epsilon, m_epsilon, m_epsilon);
+    int64_t lo[3], hi[3];
+    cellOf(v - e, lo);
+    cellOf(v + e, hi);
+    int64_t cell[3];
+    for (cell[2] = lo[2]; cell[2] <= hi[2]; ++cell[2]) {
+        for (cell[1] = lo[1]; cell[1] <= hi[1]; ++cell[1]) {
+            for (cell[0] = lo[0]; cell[0] <= hi[0]; ++cell[0]) {
+                typedef std::unordered_multimap<uint64_t, int>::const_iterator
+                    Iter;
+                std::pair<Iter, Iter> range =
+                    m_cells.equal_range(hashCell(cell));
+                for (Iter iter = range.first; iter != range.second; ++iter) {
+                    if ((m_vertices[iter->second] - v).len() <= m_epsilon) {
+                        return iter->second;
+                    }
+                }
+            }
+        }
+    }
+
+    int i = m_vertices.size();
+    m_vertices.push_back(v);
+    cellOf(v, cell);
+    m_cells.insert(std::make_pair(hashCell(cell), i));
+    return i;
+}
+
+std::vector<Vertex> &VertexWelder::vertices() const
+{
+    return m_vertices;
 }
 
 ////////////////////////////////////////////////////////////////////////
 // Subdivision.
 
-static int buildGrid(int uCount, int vCount, Quad const &quad,
-                     std::vector<Vertex> const &vsIn,
-                     std::vector<Vertex> &vsOut)
+// Calls "fn(u, v, point)" on each point of the grid over the quad, a
+// row at a time.
+template<typename Fn>
+static void forGrid(int uCount, int vCount, Quad const &quad,
+                    std::vector<Vertex> const &vs, Fn fn)
 {
-    int const vertexStart = vsOut.size();
-    Vertex v0 = vsIn[quad.indices[0]];
-    Vertex v1 = vsIn[quad.indices[1]];
-    Vertex v2 = vsIn[quad.indices[2]];
-    Vertex v3 = vsIn[quad.indices[3]];
+    Vertex v0 = vs[quad.indices[0]];
+    Vertex v1 = vs[quad.indices[1]];
+    Vertex v2 = vs[quad.indices[2]];
+    Vertex v3 = vs[quad.indices[3]];
 
-    // Generate the grid of points we will build the quads from.
     for (int v = 0; v < vCount + 1; ++v) {
         for (int u = 0; u < uCount + 1; ++u) {
             Vertex u0 = lerp(v0, v1, static_cast<double>(u) / uCount);
             Vertex u1 = lerp(v3, v2, static_cast<double>(u) / uCount);
-            Vertex pt = lerp(u0, u1, static_cast<double>(v) / vCount);
-            vsOut.push_back(pt);
+            fn(u, v, lerp(u0, u1, static_cast<double>(v) / vCount));
         }
     }
+}
 
+static int buildGrid(int uCount, int vCount, Quad const &quad,
+                     std::vector<Vertex> const &vsIn,
+                     std::vector<Vertex> &vsOut)
+{
+    int const vertexStart = vsOut.size();
+    // Generate the grid of points we will build the quads from.
+    // forGrid copies the corners first, so vsIn may be vsOut.
+    forGrid(uCount, vCount, quad, vsIn,
+            [&](int, int, Vertex const &pt) { vsOut.push_back(pt); });
     return vertexStart;
 }
 
-// Break apart the given quad into a bunch of quads, add them to "qs",
-// and add the new vertices to "vs".
-SubdivInfo subdivide(Quad const &quad,
-                     std::vector<Vertex> &vs,
-                     std::vector<Quad> &qs,
-                     int uCount, int vCount)
+// Build the quads over a grid, where "gridIndex(u, v)" gives the
+// vertex index of the grid point.
+template<typename Fn>
+static int buildGridQuads(Quad const &quad, int uCount, int vCount,
+                          Fn gridIndex, std::vector<Quad> &qs)
 {
-    int const vertexStart = buildGrid(uCount, vCount, quad, vs, vs);
-
-    // Build the corners of the quads.
     int const faceStart = qs.size();
     for (int v = 0; v < vCount; ++v) {
         for (int u = 0; u < uCount; ++u) {
-            int base = vertexStart + v * (uCount + 1) + u;
-            qs.push_back(Quad(base, base + 1,
-                              base + uCount + 2, base + uCount + 1,
+            qs.push_back(Quad(gridIndex(u, v), gridIndex(u + 1, v),
+                              gridIndex(u + 1, v + 1), gridIndex(u, v + 1),
                               quad.materialColour));
             qs.back().isEmitter = quad.isEmitter;
         }
     }
+    return faceStart;
+}
 
-    return SubdivInfo(quad, uCount, vCount, vertexStart, faceStart, vs, qs);
+// Break apart the given quad into a bunch of quads, add them to "qs",
+// and add the new vertices to "vs".
+SubdivInfo subdivide(Quad const &quad,
+                     std::vector<Vertex> &vs,
+                     std::vector<Quad> &qs,
+                     int uCount, int vCount)
+{
+    int const vertexStart = buildGrid(uCount, vCount, quad, vs, vs);
+    int const faceStart = buildGridQuads(quad, uCount, vCount,
+        [=](int u, int v) { return vertexStart + v * (uCount + 1) + u; },
+        qs);
+    return SubdivInfo(quad, uCount, vCount, faceStart, vs, qs);
+}
+
+SubdivInfo subdivide(Quad const &quad,
+                     VertexWelder &welder,
+                     std::vector<Quad> &qs,
+                     int uCount, int vCount)
+{
+    std::vector<Vertex> &vs = welder.vertices();
+    std::vector<int> grid;
+    grid.reserve((uCount + 1) * (vCount + 1));
+    // Only the edges of the grid can meet other quads' vertices,
+    // unless they overlap, so the inside's added straight.
+    forGrid(uCount, vCount, quad, vs,
+            [&](int u, int v, Vertex const &pt) {
+                bool edge = u == 0 || u == uCount || v == 0 || v == vCount;
+                if (edge) {
+                    grid.push_back(welder.add(pt));
+                } else {
+                    grid.push_back(vs.size());
+                    vs.push_back(pt);
+                }
+            });
+    int const faceStart = buildGridQuads(quad, uCount, vCount,
+        [&](int u, int v) { return grid[v * (uCount + 1) + u]; },
+        qs);
+    return SubdivInfo(quad, uCount, vCount, faceStart, vs, qs);
 }
 
 SubdivInfo::SubdivInfo(Quad const &baseQuad,
-                       int uCount, int vCount,
-                       int vertexStart, int faceStart,
+                       int uCount, int vCount, int faceStart,
                        std::vector<Vertex> const &vs,
                        std::vector<Quad> const &qs)
     : m_baseQuad(baseQuad),
       m_uCount(uCount), m_vCount(vCount),
-      m_vertexStart(vertexStart), m_faceStart(faceStart),
+      m_faceStart(faceStart),
       m_vertices(vs), m_faces(qs)
 {
 }
 
+int SubdivInfo::faceStart() const
+{
+    return m_faceStart;
+}
+
+int SubdivInfo::faceCount() const
+{
+    return m_uCount * m_vCount;
+}
+
+int SubdivInfo::uCount() const
+{
+    return m_uCount;
+}
+
+int SubdivInfo::vCount() const
+{
+    return m_vCount;
+}
+
 // Quick helper to tell us if a particular grid square is emitter.
 bool SubdivInfo::emitsAt(int u, int v) const
 {
@@ -520,60 +516,112 @@ Colour SubdivInfo::colourAt(int u, int v, int offU, int offV) const
     return rawColourAt(u + offU, v + offV);
 }
 
-void SubdivInfo::generateGouraudQuads(
-    std::vector<GouraudQuad> &qsOut,
-    std::vector<Vertex> &vsOut) const
-{
-    // Build a grid 2x resolution of original:
-    int const vertexStart = buildGrid(m_uCount * 2, m_vCount * 2,
-                                      m_baseQuad, m_vertices, vsOut);
-
-    // And then fill in a 2x2 "half-unit" grid for each quad in the
-    // original:
-    for (int v = 0; v < m_vCount; ++v) {
-        for (int u = 0; u < m_uCount; ++u) {
-            // We'll arrange the grid like this:
-            // a b c
-            // d e f
-            // g h i
-            int u2 = u * 2, v2 = v * 2;
-            // Find indices into the vertex array for the points we
-            // need.
-            int idxa = vertexStart + v2 * (m_uCount * 2 + 1) + u2;
-            int idxd = idxa + m_uCount * 2 + 1;
-            int idxg = idxd + m_uCount * 2 + 1;
-            int idxb = idxa + 1, idxc = idxa + 2;
-            int idxe = idxd + 1, idxf = idxd + 2;
-            int idxh = idxg + 1, idxi = idxg + 2;
-            // And then look up colours in the quads on the unit grid:
-            Colour ca = colourAt(u, v, -1, -1);
-            Colour cb = colourAt(u, v,  0, -1);
-            Colour cc = colourAt(u, v, +1, -1);
-            Colour cd = colourAt(u, v, -1,  0);
-            Colour ce = colourAt(u, v,  0,  0);
-            Colour cf = colourAt(u, v, +1,  0);
-            Colour cg = colourAt(u, v, -1, +1);
-            Colour ch = colourAt(u, v,  0, +1);
-            Colour ci = colourAt(u, v, +1, +1);
-            // And interpolate horizontally...
-            ca = ca * 0.5 + cb * 0.5; cc = cb * 0.5 + cc * 0.5;
-            cd = cd * 0.5 + ce * 0.5; cf = ce * 0.5 + cf * 0.5;
-            cg = cg * 0.5 + ch * 0.5; ci = ch * 0.5 + ci * 0.5;
-            // And vertically.
-            ca = ca * 0.5 + cd * 0.5; cg = cd * 0.5 + cg * 0.5;
-            cb = cb * 0.5 + ce * 0.5; ch = ce * 0.5 + ch * 0.5;
-            cc = cc * 0.5 + cf * 0.5; ci = cf * 0.5 + ci * 0.5;
-            // And then create the quads
-            qsOut.push_back(GouraudQuad(idxa, idxb, idxe, idxd,
-                                        ca,   cb,   ce,   cd));
-            qsOut.push_back(GouraudQuad(idxb, idxc, idxf, idxe,
-                                        cb,   cc,   cf,   ce));
-            qsOut.push_back(GouraudQuad(idxd, idxe, idxh, idxg,
-                                        cd,   ce,   ch,   cg));
-            qsOut.push_back(GouraudQuad(idxe, idxf, idxi, idxh,
-                                        ce,   cf,   ci,   ch));
+int SubdivInfo::gouraudVertexCount() const
+{
+    return 9 * faceCount();
+}
+
+int SubdivInfo::gouraudIndexCount() const
+{
+    return 16 * faceCount();
+}
+
+void SubdivInfo::fillGouraudRow(int v,
+                                GouraudMesh &mesh,
+                                int vertexStart,
+                                int indexStart) const
+{
+    Vertex const &v0 = m_vertices[m_baseQuad.indices[0]];
+    Vertex const &v1 = m_vertices[m_baseQuad.indices[1]];
+    Vertex const &v2 = m_vertices[m_baseQuad.indices[2]];
+    Vertex const &v3 = m_vertices[m_baseQuad.indices[3]];
+    int const gridU = m_uCount * 2, gridV = m_vCount * 2;
+
+    for (int u = 0; u < m_uCount; ++u) {
+        // Each quad is split 2x2 over a "half-unit" grid, arranged:
+        // a b c
+        // d e f
+        // g h i
+        int const base = vertexStart + (v * m_uCount + u) * 9;
+        VertexF *pos = &mesh.positions[base];
+        for (int j = 0; j < 3; ++j) {
+            for (int i = 0; i < 3; ++i) {
+                double s = static_cast<double>(u * 2 + i) / gridU;
+                double t = static_cast<double>(v * 2 + j) / gridV;
+                Vertex pt = lerp(lerp(v0, v1, s), lerp(v3, v2, s), t);
+                *pos++ = VertexF(pt.x(), pt.y(), pt.z());
+            }
+        }
+
+        // Look up colours in the quads on the unit grid:
+        Colour ca = colourAt(u, v, -1, -1);
+        Colour cb = colourAt(u, v,  0, -1);
+        Colour cc = colourAt(u, v, +1, -1);
+        Colour cd = colourAt(u, v, -1,  0);
+        Colour ce = colourAt(u, v,  0,  0);
+        Colour cf = colourAt(u, v, +1,  0);
+        Colour cg = colourAt(u, v, -1, +1);
+        Colour ch = colourAt(u, v,  0, +1);
+        Colour ci = colourAt(u, v, +1, +1);
+        // And interpolate horizontally...
+        ca = ca * 0.5 + cb * 0.5; cc = cb * 0.5 + cc * 0.5;
+        cd = cd * 0.5 + ce * 0.5; cf = ce * 0.5 + cf * 0.5;
+        cg = cg * 0.5 + ch * 0.5; ci = ch * 0.5 + ci * 0.5;
+        // And vertically.
+        ca = ca * 0.5 + cd * 0.5; cg = cd * 0.5 + cg * 0.5;
+        cb = cb * 0.5 + ce * 0.5; ch = ce * 0.5 + ch * 0.5;
+        cc = cc * 0.5 + cf * 0.5; ci = cf * 0.5 + ci * 0.5;
+        Colour const cs[9] = { ca, cb, cc, cd, ce, cf, cg, ch, ci };
+        for (int k = 0; k < 9; ++k) {
+            mesh.colours[base + k] = ColourF(cs[k].r, cs[k].g, cs[k].b);
+        }
+
+        // And then create the quads.
+        static int const corners[16] = {
+            0, 1, 4, 3,   1, 2, 5, 4,   3, 4, 7, 6,   4, 5, 8, 7
+        };
+        GLuint *idx = &mesh.indices[indexStart + (v * m_uCount + u) * 16];
+        for (int k = 0; k < 16; ++k) {
+            idx[k] = base + corners[k];
+        }
+    }
+}
+
+void generateGouraudMesh(std::vector<SubdivInfo> const &subdivs,
+                         GouraudMesh &mesh,
+                         int numThreads)
+{
+    TRACE_SCOPE("generateGouraudMesh");
+    // Lay out each subdivision's part of the mesh, and list the rows
+    // to fill.
+    struct Row
+    {
+        int subdiv;
+        int v;
+    };
+    std::vector<int> vertexStarts, indexStarts;
+    std::vector<Row> rows;
+    int numVertices = 0, numIndices = 0;
+    for (int i = 0, n = subdivs.size(); i < n; ++i) {
+        vertexStarts.push_back(numVertices);
+        indexStarts.push_back(numIndices);
+        numVertices += subdivs[i].gouraudVertexCount();
+        numIndices += subdivs[i].gouraudIndexCount();
+        for (int v = 0, m = subdivs[i].vCount(); v < m; ++v) {
+            Row row = { i, v };
+            rows.push_back(row);
         }
     }
+    mesh.positions.resize(numVertices);
+    mesh.colours.resize(numVertices);
+    mesh.indices.resize(numIndices);
+
+    // Rows don't overlap, so threads can take them in any order.
+    parallelFor(rows.size(), numThreads, [&](int r) {
+        int i = rows[r].subdiv;
+        subdivs[i].fillGouraudRow(rows[r].v, mesh,
+                                  vertexStarts[i], indexStarts[i]);
+    });
 }
 
 ////////////////////////////////////////////////////////////////////////
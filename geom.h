@@ -14,71 +14,15 @@
 #include <GL/glut.h>
 #endif
 
+#include <cstdint>
 #include <iostream>
+#include <unordered_map>
 #include <vector>
 
-////////////////////////////////////////////////////////////////////////
-// Yet another 3d point class
-
-class Vertex
-{
-public:
-    Vertex(double ix, double iy, double iz);
-    Vertex(Vertex const &v);
-
-    double len() const;
-    Vertex norm() const;
-    Vertex perp() const;
-    Vertex scale(double s) const;
-
-    Vertex operator+(Vertex const &rhs) const;
-    Vertex operator-(Vertex const &rhs) const;
-
-    double x() const;
-    double y() const;
-    double z() const;
-
-    double p[3];
-};
-
-std::ostream &operator<<(std::ostream &os, Vertex const &v);
-
-// Cross product.
-Vertex cross(Vertex const &v1, Vertex const &v2);
-
-// Dot product.
-double dot(Vertex const &v1, Vertex const &v2);
-
-// Orthogonalise v1, taking away the v2 component.
-Vertex orthog(Vertex const &v1, Vertex const &v2);
-
-// Linear interpolation. 0 returns v1, 1 returns v2.
-Vertex lerp(Vertex const &v1, Vertex const &v2, double i);
+#include "vecmath.h"
 
 ////////////////////////////////////////////////////////////////////////
-// Colours
-
-// Simple red, green and blue components aren't particularly
-// realistic, physically, but they'll do for us.
-class Colour
-{
-public:
-    Colour(double red, double green, double blue);
-    Colour(Colour const &c);
-    Colour();
-
-    Colour operator*(double x) const;
-    Colour operator*(Colour const &c) const;
-    Colour operator+(Colour const &c) const;;
-    Colour &operator+=(Colour const &c);
-
-    double asGrey() const;
-
-    double r, g, b;
-};
-
-////////////////////////////////////////////////////////////////////////
-// And a quadrilateral
+// Quadrilaterals, built on the Vertex and Colour from vecmath.h
 
 class Quad
 {
@@ -88,8 +32,6 @@ public:
          Colour const &c);
 
     void render(std::vector<Vertex> const &v) const;
-    // For transfer calculations.
-    void renderIndex(int index, std::vector<Vertex> const &v) const;
 
     int indices[4];
     // Does this quad emit light, or just reflect?
@@ -111,6 +53,38 @@ Vertex paraCross(Quad const &q, std::vector<Vertex> const &vs);
 // Find area of given parallelogram.
 double paraArea(Quad const &q, std::vector<Vertex> const &vs);
 
+////////////////////////////////////////////////////////////////////////
+// Affine transforms
+
+// A 3x4 matrix, built up from a sequence of operations, each applied
+// after the ones before. However many operations there are, applying
+// it is one pass over the vertices.
+class Transform
+{
+public:
+    // The identity.
+    Transform();
+
+    Transform &translate(Vertex const &t);
+    Transform &scale(double s);
+    Transform &rotate(Vertex const &axis, double angle);
+    // Follow this transform with "next".
+    Transform &then(Transform const &next);
+
+    Vertex operator()(Vertex const &v) const;
+
+    // Transform the vertices in [begin, end) in-place. Only safe if
+    // nothing else uses those vertices.
+    void apply(std::vector<Vertex> &vs, int begin, int end) const;
+
+    // Transform the given quads, adding one transformed copy of each
+    // vertex they use, and pointing the quads at the copies.
+    void apply(std::vector<Quad> &qs, std::vector<Vertex> &vs) const;
+
+    // Rows of the rotation/scale part, then the translation.
+    double m[3][4];
+};
+
 // Translate the given quads, in-place
 void translate(Vertex const &t,
            std::vector<Quad> &qs,
@@ -131,20 +105,69 @@ void rotate(Vertex const &axis,
 void flip(std::vector<Quad> &qs,
           std::vector<Vertex> &vs);
 
+// Versions of the above that move the vertices in [begin, end)
+// directly, rather than copying the vertices the quads use. Only
+// safe if nothing else uses those vertices.
+void translate(Vertex const &t,
+               std::vector<Vertex> &vs,
+               int begin, int end);
+
+void scale(double s,
+           std::vector<Vertex> &vs,
+           int begin, int end);
+
+void rotate(Vertex const &axis,
+            double angle,
+            std::vector<Vertex> &vs,
+            int begin, int end);
+
+// For each quad, the quad on the other side of each edge, where edge
+// i runs from corner i to corner i + 1, or -1 if there isn't one.
+// Neighbours must share vertex indices (so weld them), and wind the
+// same way. Four entries per quad.
+std::vector<int> quadNeighbours(std::vector<Quad> const &qs);
+
 ////////////////////////////////////////////////////////////////////////
-// Gouraud-shaded quad, used only for final rendering.
+// Vertex welding
 
-class GouraudQuad
+// Adds vertices to a vector, reusing any existing vertex within
+// "epsilon" rather than adding a duplicate. Coincident vertices are
+// found with a spatial hash of "epsilon"-sized cells.
+class VertexWelder
 {
 public:
-    GouraudQuad(int v1, int v2, int v3, int v4,
-                Colour c1, Colour c2, Colour c3, Colour c4);
+    // Vertices already in "vs" are indexed, so they can be reused.
+    VertexWelder(std::vector<Vertex> &vs, double epsilon = 1e-9);
 
-    void render(std::vector<Vertex> const &v) const;
+    // Return the index of a vertex at "v", adding one if needed.
+    int add(Vertex const &v);
+
+    std::vector<Vertex> &vertices() const;
 
 private:
-    int m_indices[4];
-    Colour m_colours[4];
+    void cellOf(Vertex const &v, int64_t cell[3]) const;
+    static uint64_t hashCell(int64_t const cell[3]);
+
+    std::vector<Vertex> &m_vertices;
+    double m_epsilon;
+    // Cell hash to vertex index. Different cells may share a hash,
+    // which is harmless as we check the distance anyway.
+    std::unordered_multimap<uint64_t, int> m_cells;
+};
+
+////////////////////////////////////////////////////////////////////////
+// Gouraud-shaded mesh, used only for final rendering.
+
+// Arrays ready for glDrawElements, with GL_QUADS. Each subdivided
+// quad becomes a 3x3 block of vertices, shared by the 2x2 quads it's
+// drawn as. Neighbouring blocks don't share vertices, as their
+// colours can differ along emitter boundaries.
+struct GouraudMesh
+{
+    std::vector<VertexF> positions;
+    std::vector<ColourF> colours;
+    // Four per quad.
+    std::vector<GLuint> indices;
 };
 
 ////////////////////////////////////////////////////////////////////////
@@ -157,13 +180,26 @@ class SubdivInfo
 {
 public:
     SubdivInfo(Quad const &baseQuad,
-               int uCount, int vCount,
-               int vertexStart, int faceStart,
+               int uCount, int vCount, int faceStart,
                std::vector<Vertex> const &vs,
                std::vector<Quad> const &qs);
 
-    void generateGouraudQuads(std::vector<GouraudQuad> &qsOut,
-                              std::vector<Vertex> &vsOut) const;
+    // Space needed in a GouraudMesh.
+    int gouraudVertexCount() const;
+    int gouraudIndexCount() const;
+    // Fill in row "v" of our part of the mesh, which starts at the
+    // given offsets.
+    void fillGouraudRow(int v,
+                        GouraudMesh &mesh,
+                        int vertexStart,
+                        int indexStart) const;
+
+    // The range of subdivided quads in the face vector, stored a row
+    // of uCount quads at a time.
+    int faceStart() const;
+    int faceCount() const;
+    int uCount() const;
+    int vCount() const;
 
 private:
     bool emitsAt(int u, int v) const;
@@ -175,7 +211,6 @@ private:
     Quad m_baseQuad;
     int m_uCount;
     int m_vCount;
-    int m_vertexStart;
     int m_faceStart;
     std::vector<Vertex> const &m_vertices;
     std::vector<Quad> const &m_faces;
@@ -189,6 +224,20 @@ SubdivInfo subdivide(Quad const &quad,
                      std::vector<Quad> &qs,
                      int uCount, int vCount);
 
+// As above, but welding the vertices along the quad's edges to any
+// already in the welder, so that subdivided quads sharing an edge
+// share its vertices.
+SubdivInfo subdivide(Quad const &quad,
+                     VertexWelder &welder,
+                     std::vector<Quad> &qs,
+                     int uCount, int vCount);
+
+// Build the Gouraud mesh for the subdivided quads, a row at a time
+// on "numThreads" threads.
+void generateGouraudMesh(std::vector<SubdivInfo> const &subdivs,
+                         GouraudMesh &mesh,
+                         int numThreads);
+
 ////////////////////////////////////////////////////////////////////////
 // Basic shapes.
 
@@ -55,6 +55,16 @@ private:
     CPPUNIT_TEST(testRotation);
     CPPUNIT_TEST(testTranslation);
     CPPUNIT_TEST(testFlip);
+    CPPUNIT_TEST(testRangeTransforms);
+    CPPUNIT_TEST(testComposedTransform);
+    CPPUNIT_TEST(testTransformSharesCopies);
+    // Welding cases
+    CPPUNIT_TEST(testWelder);
+    CPPUNIT_TEST(testWeldedSubdivision);
+    CPPUNIT_TEST(testQuadNeighbours);
+    // Gouraud cases
+    CPPUNIT_TEST(testGouraudMesh);
+    CPPUNIT_TEST(testGouraudMeshThreads);
     // Cube case
     CPPUNIT_TEST(testCubeProperties);
     CPPUNIT_TEST_SUITE_END();
@@ -95,6 +105,16 @@ private:
     void testRotation();
     void testTranslation();
     void testFlip();
+    void testRangeTransforms();
+    void testComposedTransform();
+    void testTransformSharesCopies();
+    // Welding cases
+    void testWelder();
+    void testWeldedSubdivision();
+    void testQuadNeighbours();
+    // Gouraud cases
+    void testGouraudMesh();
+    void testGouraudMeshThreads();
     // Cube case
     void testCubeProperties();
     // Helpers
@@ -413,7 +433,6 @@ void GeomTestCase::testQuadTrivialSubdivision()
 
     CPPUNIT_ASSERT_EQUAL(1, info.m_uCount);
     CPPUNIT_ASSERT_EQUAL(1, info.m_vCount);
-    CPPUNIT_ASSERT_EQUAL(4, info.m_vertexStart); // After the 4 created already.
     CPPUNIT_ASSERT_EQUAL(0, info.m_faceStart);   // First entry in fresh vector.
 }
 
@@ -448,7 +467,6 @@ void GeomTestCase::testQuadSubdivision()
 
     CPPUNIT_ASSERT_EQUAL(10, info.m_uCount);
     CPPUNIT_ASSERT_EQUAL(20, info.m_vCount);
-    CPPUNIT_ASSERT_EQUAL(4, info.m_vertexStart); // After the 4 created already.
     CPPUNIT_ASSERT_EQUAL(0, info.m_faceStart);   // First entry in fresh vector.
 }
 
@@ -525,6 +543,241 @@ void GeomTestCase::testTranslation()
     assertVectorsEqual(Vertex(2.0, 2.0, 0.0), vs[q.indices[3]]);
 }
 
+void GeomTestCase::testRangeTransforms()
+{
+    // Should match the quad-based versions, without adding vertices.
+    std::vector<Vertex> vs(cubeVertices);
+    std::vector<Quad> qs(cubeFaces);
+    scale(0.5, qs, vs);
+    rotate(Vertex(1.0, 2.0, 3.0), 0.3, qs, vs);
+    translate(Vertex(1.0, 0.0, -1.0), qs, vs);
+
+    std::vector<Vertex> vs2(cubeVertices);
+    scale(0.5, vs2, 0, vs2.size());
+    rotate(Vertex(1.0, 2.0, 3.0), 0.3, vs2, 0, vs2.size());
+    translate(Vertex(1.0, 0.0, -1.0), vs2, 0, vs2.size());
+
+    CPPUNIT_ASSERT_EQUAL(cubeVertices.size(), vs2.size());
+    for (int i = 0, n = qs.size(); i < n; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            assertVectorsEqual(vs[qs[i].indices[j]],
+                               vs2[cubeFaces[i].indices[j]]);
+        }
+    }
+
+    // Outside the range is untouched.
+    std::vector<Vertex> vs3(cubeVertices);
+    translate(Vertex(1.0, 1.0, 1.0), vs3, 2, 4);
+    assertVectorsEqual(cubeVertices[1], vs3[1]);
+    assertVectorsEqual(cubeVertices[2] + Vertex(1.0, 1.0, 1.0), vs3[2]);
+    assertVectorsEqual(cubeVertices[4], vs3[4]);
+}
+
+void GeomTestCase::testComposedTransform()
+{
+    // One composed transform should match the steps done one by one.
+    Transform t;
+    t.scale(0.4)
+        .rotate(Vertex(1.0, 0.0, 0.0), M_PI / 3.0)
+        .translate(Vertex(0.5, -0.25, 0.0))
+        .rotate(Vertex(1.0, 2.0, -1.0), 0.7);
+
+    std::vector<Vertex> vs(cubeVertices);
+    std::vector<Quad> qs(cubeFaces);
+    scale(0.4, qs, vs);
+    rotate(Vertex(1.0, 0.0, 0.0), M_PI / 3.0, qs, vs);
+    translate(Vertex(0.5, -0.25, 0.0), qs, vs);
+    rotate(Vertex(1.0, 2.0, -1.0), 0.7, qs, vs);
+
+    std::vector<Vertex> vs2(cubeVertices);
+    t.apply(vs2, 0, vs2.size());
+    for (int i = 0, n = qs.size(); i < n; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            int orig = cubeFaces[i].indices[j];
+            assertVectorsEqual(vs[qs[i].indices[j]], vs2[orig]);
+            assertVectorsEqual(vs2[orig], t(cubeVertices[orig]));
+        }
+    }
+
+    // And "then" chains whole transforms.
+    Transform t1, t2;
+    t1.scale(2.0);
+    t2.translate(Vertex(1.0, 0.0, 0.0));
+    assertVectorsEqual(Vertex(3.0, 2.0, 2.0),
+                       t1.then(t2)(Vertex(1.0, 1.0, 1.0)));
+}
+
+void GeomTestCase::testTransformSharesCopies()
+{
+    // Quads sharing a vertex share the transformed copy, and the
+    // originals are left alone.
+    std::vector<Vertex> vs(cubeVertices);
+    std::vector<Quad> qs(cubeFaces.begin(), cubeFaces.begin() + 2);
+    Transform().translate(Vertex(1.0, 0.0, 0.0)).apply(qs, vs);
+    // The first two cube faces have 6 distinct corners.
+    CPPUNIT_ASSERT_EQUAL(cubeVertices.size() + 6, vs.size());
+    CPPUNIT_ASSERT_EQUAL(qs[0].indices[2], qs[1].indices[1]);
+    for (int i = 0, n = cubeVertices.size(); i < n; ++i) {
+        assertVectorsEqual(cubeVertices[i], vs[i]);
+    }
+    assertVectorsEqual(cubeVertices[cubeFaces[0].indices[0]] +
+                       Vertex(1.0, 0.0, 0.0),
+                       vs[qs[0].indices[0]]);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Welding test cases
+
+void GeomTestCase::testWelder()
+{
+    std::vector<Vertex> vs = { Vertex(0.0, 0.0, 0.0) };
+    VertexWelder welder(vs, 1e-6);
+
+    // Existing vertices are found, including across cell boundaries.
+    CPPUNIT_ASSERT_EQUAL(0, welder.add(Vertex(0.0, 0.0, 0.0)));
+    CPPUNIT_ASSERT_EQUAL(0, welder.add(Vertex(-1e-7, 1e-7, -1e-7)));
+    // New ones are added.
+    CPPUNIT_ASSERT_EQUAL(1, welder.add(Vertex(1.0, 0.0, 0.0)));
+    CPPUNIT_ASSERT_EQUAL(2, welder.add(Vertex(0.0, 2e-6, 0.0)));
+    CPPUNIT_ASSERT_EQUAL(1, welder.add(Vertex(1.0 + 5e-7, 0.0, 0.0)));
+    CPPUNIT_ASSERT_EQUAL(3ul, vs.size());
+}
+
+void GeomTestCase::testWeldedSubdivision()
+{
+    // Subdivide the cube, welded and not.
+    std::vector<Vertex> vs(cubeVertices);
+    std::vector<Quad> qs;
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        subdivide(cubeFaces[i], vs, qs, 3, 3);
+    }
+
+    std::vector<Vertex> weldedVs(cubeVertices);
+    std::vector<Quad> weldedQs;
+    VertexWelder welder(weldedVs);
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        SubdivInfo info = subdivide(cubeFaces[i], welder, weldedQs, 3, 3);
+        CPPUNIT_ASSERT_EQUAL(i * 9, info.faceStart());
+    }
+
+    // Same quads in the same places...
+    CPPUNIT_ASSERT_EQUAL(qs.size(), weldedQs.size());
+    for (int i = 0, n = qs.size(); i < n; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            assertVectorsEqual(vs[qs[i].indices[j]],
+                               weldedVs[weldedQs[i].indices[j]]);
+        }
+    }
+
+    // ...with each point on the cube's surface stored once: the
+    // corners, two points inside each edge, and four inside each
+    // face. Unwelded, each face has its own 4x4 grid.
+    CPPUNIT_ASSERT_EQUAL(8ul + 6 * 16, vs.size());
+    CPPUNIT_ASSERT_EQUAL(8ul + 12 * 2 + 6 * 4, weldedVs.size());
+}
+
+void GeomTestCase::testQuadNeighbours()
+{
+    // Welded, everything on a closed surface has four neighbours.
+    std::vector<Vertex> vs(cubeVertices);
+    std::vector<Quad> qs;
+    VertexWelder welder(vs);
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        subdivide(cubeFaces[i], welder, qs, 3, 3);
+    }
+    std::vector<int> neighbours = quadNeighbours(qs);
+    CPPUNIT_ASSERT_EQUAL(qs.size() * 4, neighbours.size());
+    for (int i = 0, n = qs.size(); i < n; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            int other = neighbours[i * 4 + j];
+            CPPUNIT_ASSERT(other >= 0 && other != i);
+            // And they agree.
+            bool found = false;
+            for (int k = 0; k < 4; ++k) {
+                found = found || neighbours[other * 4 + k] == i;
+            }
+            CPPUNIT_ASSERT(found);
+        }
+    }
+    // Within a face, edge 1 leads to the next quad along the row.
+    CPPUNIT_ASSERT_EQUAL(1, neighbours[0 * 4 + 1]);
+    CPPUNIT_ASSERT_EQUAL(3, neighbours[0 * 4 + 2]);
+
+    // A lone quad has none.
+    std::vector<Quad> lone(1, cubeFaces[0]);
+    std::vector<int> none = quadNeighbours(lone);
+    for (int j = 0; j < 4; ++j) {
+        CPPUNIT_ASSERT_EQUAL(-1, none[j]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+// Gouraud test cases
+
+void GeomTestCase::testGouraudMesh()
+{
+    std::vector<Vertex> vs(cubeVertices);
+    std::vector<Quad> qs;
+    std::vector<SubdivInfo> subdivs;
+    subdivs.push_back(subdivide(cubeFaces[0], vs, qs, 3, 2));
+    for (int i = 0, n = qs.size(); i < n; ++i) {
+        qs[i].screenColour = TEST_COLOUR;
+    }
+    // Make one corner brighter.
+    qs[0].screenColour = Colour(1.0, 1.0, 1.0);
+
+    GouraudMesh mesh;
+    generateGouraudMesh(subdivs, mesh, 1);
+    CPPUNIT_ASSERT_EQUAL(6ul * 9, mesh.positions.size());
+    CPPUNIT_ASSERT_EQUAL(6ul * 9, mesh.colours.size());
+    CPPUNIT_ASSERT_EQUAL(6ul * 16, mesh.indices.size());
+
+    // The quads cover the original, with the same facing.
+    double area = 0.0;
+    Vertex normal = paraCross(cubeFaces[0], cubeVertices);
+    for (int i = 0, n = mesh.indices.size(); i < n; i += 4) {
+        std::vector<Vertex> corners;
+        for (int j = 0; j < 4; ++j) {
+            VertexF const &p = mesh.positions[mesh.indices[i + j]];
+            corners.push_back(Vertex(p.x(), p.y(), p.z()));
+        }
+        Quad q(0, 1, 2, 3, TEST_COLOUR);
+        area += paraArea(q, corners);
+        CPPUNIT_ASSERT(dot(paraCross(q, corners), normal) > 0.0);
+    }
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(4.0, area, 1e-5);
+
+    // The bright quad's own corner is fully bright, and the far
+    // corner of the far quad isn't affected.
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(1.0, mesh.colours[0].r, 1e-6);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(TEST_COLOUR.g, mesh.colours.back().g, 1e-6);
+    // And the colour's continuous between neighbouring quads.
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(mesh.colours[2].r, mesh.colours[9].r, 1e-6);
+}
+
+void GeomTestCase::testGouraudMeshThreads()
+{
+    std::vector<Vertex> vs(cubeVertices);
+    std::vector<Quad> qs;
+    std::vector<SubdivInfo> subdivs;
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        subdivs.push_back(subdivide(cubeFaces[i], vs, qs, 5, 7));
+    }
+    for (int i = 0, n = qs.size(); i < n; ++i) {
+        qs[i].screenColour = Colour(i, 0.5 * i, 2.0);
+        qs[i].isEmitter = i % 11 == 0;
+    }
+
+    GouraudMesh mesh1, mesh4;
+    generateGouraudMesh(subdivs, mesh1, 1);
+    generateGouraudMesh(subdivs, mesh4, 4);
+    CPPUNIT_ASSERT(mesh1.indices == mesh4.indices);
+    for (int i = 0, n = mesh1.colours.size(); i < n; ++i) {
+        CPPUNIT_ASSERT_EQUAL(mesh1.colours[i].r, mesh4.colours[i].r);
+        CPPUNIT_ASSERT_EQUAL(mesh1.positions[i].z(), mesh4.positions[i].z());
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////
 // Miscellaneous.
 
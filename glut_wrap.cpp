@@ -7,36 +7,281 @@
 
 #ifdef __APPLE__
 #include <GLUT/glut.h>
+#include <OpenGL/glext.h>
 #else
+#define GL_GLEXT_PROTOTYPES
 #include <GL/glut.h>
 #endif
 
+#ifdef GW_OFFSCREEN_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#ifdef GW_OFFSCREEN_OSMESA
+#include <GL/osmesa.h>
+#endif
+
 #include <cstdlib>
 #include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
 
 #include "glut_wrap.h"
 
+#ifdef GW_OFFSCREEN
+
+////////////////////////////////////////////////////////////////////////
+// Offscreen contexts
+
+namespace {
+
+struct OffscreenContext
+{
+#ifdef GW_OFFSCREEN_EGL
+    EGLContext context;
+#else
+    OSMesaContext context;
+    // OSMesa needs a buffer to make the context current with, even
+    // though we only draw to the framebuffer object.
+    GLubyte dummy[4];
+#endif
+    GLuint framebuffer;
+    GLuint renderbuffers[2];
+};
+
+}
+
+// Contexts may be made current from any thread, so guard the list.
+static std::mutex contextsMutex;
+// Indexed by id - 1, to match GLUT's numbering. NULL once destroyed.
+static std::vector<OffscreenContext *> contexts;
+
+static OffscreenContext *getContext(int id)
+{
+    std::lock_guard<std::mutex> lock(contextsMutex);
+    if (id < 1 || id > static_cast<int>(contexts.size()) ||
+        contexts[id - 1] == NULL) {
+        throw std::runtime_error("Bad context id");
+    }
+    return contexts[id - 1];
+}
+
+#ifdef GW_OFFSCREEN_EGL
+
+// Call with contextsMutex held.
+static EGLDisplay getDisplay()
+{
+    static EGLDisplay display = EGL_NO_DISPLAY;
+    if (display != EGL_NO_DISPLAY) {
+        return display;
+    }
+
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    // Mesa's surfaceless platform needs neither an X server nor
+    // access to a render node, so it works in bare containers.
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+            eglGetProcAddress("eglGetPlatformDisplayEXT"));
+    if (getPlatformDisplay != NULL) {
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                                     EGL_DEFAULT_DISPLAY, NULL);
+    }
+#endif
+    if (display == EGL_NO_DISPLAY) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+        throw std::runtime_error("Couldn't initialise EGL");
+    }
+    return display;
+}
+
+static void makeCurrent(OffscreenContext *ctx)
+{
+    EGLDisplay display;
+    {
+        std::lock_guard<std::mutex> lock(contextsMutex);
+        display = getDisplay();
+    }
+    // The bound API is per-thread.
+    eglBindAPI(EGL_OPENGL_API);
+    EGLContext context = ctx != NULL ? ctx->context : EGL_NO_CONTEXT;
+    if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+        throw std::runtime_error("eglMakeCurrent failed");
+    }
+}
+
+static void createContext(OffscreenContext *ctx)
+{
+    EGLDisplay display;
+    {
+        std::lock_guard<std::mutex> lock(contextsMutex);
+        display = getDisplay();
+    }
+    eglBindAPI(EGL_OPENGL_API);
+    EGLint const attribs[] = { EGL_NONE };
+    ctx->context = eglCreateContext(display, EGL_NO_CONFIG_KHR,
+                                    EGL_NO_CONTEXT, attribs);
+    if (ctx->context == EGL_NO_CONTEXT) {
+        throw std::runtime_error("eglCreateContext failed");
+    }
+}
+
+static void destroyContext(OffscreenContext *ctx)
+{
+    std::lock_guard<std::mutex> lock(contextsMutex);
+    eglDestroyContext(getDisplay(), ctx->context);
+}
+
+#else // GW_OFFSCREEN_OSMESA
+
+static void makeCurrent(OffscreenContext *ctx)
+{
+    if (ctx == NULL) {
+        OSMesaMakeCurrent(NULL, NULL, GL_UNSIGNED_BYTE, 0, 0);
+        return;
+    }
+    if (!OSMesaMakeCurrent(ctx->context, ctx->dummy, GL_UNSIGNED_BYTE,
+                           1, 1)) {
+        throw std::runtime_error("OSMesaMakeCurrent failed");
+    }
+}
+
+static void createContext(OffscreenContext *ctx)
+{
+    ctx->context = OSMesaCreateContextExt(OSMESA_RGBA, 0, 0, 0, NULL);
+    if (ctx->context == NULL) {
+        throw std::runtime_error("OSMesaCreateContextExt failed");
+    }
+}
+
+static void destroyContext(OffscreenContext *ctx)
+{
+    OSMesaDestroyContext(ctx->context);
+}
+
+#endif // GW_OFFSCREEN_OSMESA
+
+void gwInit(int *argc, char **argv)
+{
+#ifndef GW_HEADLESS
+    glutInit(argc, argv);
+#endif
+}
+
+int gwContextSetup(int width, int height)
+{
+    OffscreenContext *ctx = new OffscreenContext();
+    createContext(ctx);
+    makeCurrent(ctx);
+
+    // There's no window-system framebuffer, so make our own.
+    glGenFramebuffers(1, &ctx->framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx->framebuffer);
+    glGenRenderbuffers(2, ctx->renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, ctx->renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER, ctx->renderbuffers[0]);
+    glBindRenderbuffer(GL_RENDERBUFFER, ctx->renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8,
+                          width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
+                              GL_RENDERBUFFER, ctx->renderbuffers[1]);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        throw std::runtime_error("Couldn't create offscreen framebuffer");
+    }
+    glDrawBuffer(GL_COLOR_ATTACHMENT0);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glViewport(0, 0, width, height);
+
+    std::lock_guard<std::mutex> lock(contextsMutex);
+    contexts.push_back(ctx);
+    return contexts.size();
+}
+
+void gwMakeCurrent(int id)
+{
+    makeCurrent(getContext(id));
+}
+
+void gwReleaseCurrent()
+{
+    makeCurrent(NULL);
+}
+
+void gwContextTeardown(int id)
+{
+    OffscreenContext *ctx = getContext(id);
+    makeCurrent(ctx);
+    glDeleteRenderbuffers(2, ctx->renderbuffers);
+    glDeleteFramebuffers(1, &ctx->framebuffer);
+    makeCurrent(NULL);
+    destroyContext(ctx);
+    delete ctx;
+
+    std::lock_guard<std::mutex> lock(contextsMutex);
+    contexts[id - 1] = NULL;
+}
+
+#else // !GW_OFFSCREEN
+
+////////////////////////////////////////////////////////////////////////
+// GLUT windows
+
 static void doNothing()
 {
 }
 
-int gwTransferSetup(int size)
+void gwInit(int *argc, char **argv)
 {
-    // Configure window
-    glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGBA | GLUT_DEPTH);
-    glutInitWindowSize(size, size);
+    glutInit(argc, argv);
+}
+
+int gwContextSetup(int width, int height)
+{
+    glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGBA | GLUT_DEPTH | GLUT_STENCIL);
+    glutInitWindowSize(width, height);
     int win = glutCreateWindow("Transfer calculator");
     // This is needed as otherwise any glutMainLoop called gets
     // unhappy, even if we've already destroyed the window.
     glutDisplayFunc(doNothing);
+    // To read from the scene...
+    glReadBuffer(GL_BACK);
+    return win;
+}
+
+void gwMakeCurrent(int id)
+{
+    glutSetWindow(id);
+}
+
+void gwReleaseCurrent()
+{
+    // GLUT contexts stay with the main thread.
+}
+
+void gwContextTeardown(int id)
+{
+    glutDestroyWindow(id);
+}
+
+#endif // !GW_OFFSCREEN
+
+////////////////////////////////////////////////////////////////////////
+// Common code
+
+int gwTransferSetup(int size)
+{
+    int id = gwContextSetup(size, size);
     // Flat shading.
     glEnable(GL_COLOR_MATERIAL);
     // Use depth buffering for hidden surface elimination.
     glEnable(GL_DEPTH_TEST);
     // Back-face culling.
     glEnable(GL_CULL_FACE);
-    // To read from the scene...
-    glReadBuffer(GL_BACK);
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 
     // Set up the view to be one face of the cube-map.
@@ -47,9 +292,10 @@ int gwTransferSetup(int size)
                    0.001, // Z near
                    10.0); // Z far
 
-    return win;
+    return id;
 }
 
+#if defined(VANILLA_GLUT) && !defined(GW_HEADLESS)
 // Not re-entrant but I don't think GLUT is.
 static void (*dispFn)() = NULL;
 
@@ -70,10 +316,11 @@ static void dispFnWrapper()
         dispFn = NULL;
     }
 }
+#endif
 
 void gwRenderOnce(void (*f)())
 {
-#ifdef VANILLA_GLUT
+#if defined(VANILLA_GLUT) && !defined(GW_HEADLESS)
     // Reading the definition of 'glutMainLoop', unwinding the stack
     // from the idle function shouldn't break anything. Horrible way
     // to escape, but... meh.
@@ -16,7 +16,39 @@
 
 #include "geom.h"
 
-// Set the flags etc. up for rendering a cube map. Returns window id.
+// Contexts can either be GLUT windows, or offscreen contexts, built
+// with GW_OFFSCREEN_EGL or GW_OFFSCREEN_OSMESA. Offscreen contexts
+// render into a framebuffer object of the requested size, don't need
+// a display, and can be used from threads other than the main one.
+//
+// GW_HEADLESS builds don't use GLUT at all, and so need an offscreen
+// back-end.
+#if defined(GW_OFFSCREEN_EGL) || defined(GW_OFFSCREEN_OSMESA)
+#define GW_OFFSCREEN
+#endif
+
+#if defined(GW_HEADLESS) && !defined(GW_OFFSCREEN)
+#error "GW_HEADLESS needs GW_OFFSCREEN_EGL or GW_OFFSCREEN_OSMESA"
+#endif
+
+// Initialise the windowing system, if any.
+void gwInit(int *argc, char **argv);
+
+// Create a context to render a width x height image in, and make it
+// current. Returns context id.
+int gwContextSetup(int width, int height);
+
+// Make the given context current on this thread.
+void gwMakeCurrent(int id);
+
+// Detach whatever context is current from this thread, so that
+// another thread may use it.
+void gwReleaseCurrent();
+
+// Destroy a context created with gwContextSetup.
+void gwContextTeardown(int id);
+
+// Set the flags etc. up for rendering a cube map. Returns context id.
 int gwTransferSetup(int size);
 
 // Run the display function a single time, entering and leaving the
@@ -0,0 +1,289 @@
+////////////////////////////////////////////////////////////////////////
+//
+// image_io.cpp: Writing out the final images.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "image_io.h"
+#include "parallel.h"
+#include "trace.h"
+
+// Rows are grouped into strips of about this many bytes, each
+// compressed separately. The strips don't depend on the thread count,
+// so neither does the file.
+static size_t const STRIP_BYTES = 256 * 1024;
+
+// The deflate window. Each strip is primed with this much of the data
+// before it, so strips compress nearly as well as one long stream.
+static size_t const WINDOW_SIZE = 32 * 1024;
+
+static void writeAll(FILE *f, void const *data, size_t size,
+                     std::string const &path)
+{
+    if (size != 0 && fwrite(data, 1, size, f) != size) {
+        fclose(f);
+        throw std::runtime_error("Couldn't write image " + path);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+// PNG
+
+static int paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// The PNG filters: 0 none, 1 sub, 2 up, 3 average, 4 Paeth. "a" is
+// the byte to the left, "b" above, "c" above-left.
+static int predict(int filter, int a, int b, int c)
+{
+    switch (filter) {
+    case 1: return a;
+    case 2: return b;
+    case 3: return (a + b) / 2;
+    case 4: return paeth(a, b, c);
+    default: return 0;
+    }
+}
+
+// Size of a filtered byte, taken as signed.
+static int absByte(int x)
+{
+    return abs(static_cast<signed char>(x));
+}
+
+// Filter one row into "out", which starts with the filter type byte.
+// Like libpng, use the filter with the smallest sum of absolute
+// (signed) differences. All the sums are made in a single pass, and
+// only the winner is written. "prev" is all zeros for the top row.
+static void filterRow(unsigned char const *row,
+                      unsigned char const *prev,
+                      size_t rowBytes,
+                      unsigned char *out)
+{
+    static size_t const BPP = 4;
+    long sums[5] = { 0, 0, 0, 0, 0 };
+    for (size_t i = 0; i < rowBytes; ++i) {
+        int a = i >= BPP ? row[i - BPP] : 0;
+        int b = prev[i];
+        int c = i >= BPP ? prev[i - BPP] : 0;
+        int x = row[i];
+        sums[0] += absByte(x);
+        sums[1] += absByte(x - a);
+        sums[2] += absByte(x - b);
+        sums[3] += absByte(x - (a + b) / 2);
+        sums[4] += absByte(x - paeth(a, b, c));
+    }
+    int best = 0;
+    for (int filter = 1; filter < 5; ++filter) {
+        if (sums[filter] < sums[best]) {
+            best = filter;
+        }
+    }
+
+    out[0] = best;
+    for (size_t i = 0; i < rowBytes; ++i) {
+        int a = i >= BPP ? row[i - BPP] : 0;
+        int c = i >= BPP ? prev[i - BPP] : 0;
+        out[i + 1] = row[i] - predict(best, a, prev[i], c);
+    }
+}
+
+static void putBE32(unsigned char *p, uint32_t x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+// Wrap "data" as a chunk: length, type, data, then CRC of type and data.
+static void makeChunk(char const *type,
+                      unsigned char const *data, size_t size,
+                      std::vector<unsigned char> &chunk)
+{
+    chunk.resize(size + 12);
+    putBE32(&chunk[0], size);
+    memcpy(&chunk[4], type, 4);
+    if (size != 0) {
+        memcpy(&chunk[8], data, size);
+    }
+    uLong crc = crc32(0L, &chunk[4], size + 4);
+    putBE32(&chunk[size + 8], crc);
+}
+
+// One strip's worth of the zlib stream, already wrapped as an IDAT.
+struct Strip
+{
+    size_t begin, end;
+    uLong adler;
+    std::vector<unsigned char> deflated;
+    std::vector<unsigned char> chunk;
+};
+
+// Raw-deflate filtered[begin, end), primed with the window before it.
+// All but the last strip end with a sync flush, which leaves the
+// stream byte-aligned and unfinished, so the strips can be joined.
+// Returns false on failure, as it runs on a worker thread.
+static bool deflateStrip(std::vector<unsigned char> const &filtered,
+                         Strip &strip, int level, bool last)
+{
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if (deflateInit2(&z, level, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    if (strip.begin != 0) {
+        size_t dictStart = strip.begin - std::min(strip.begin, WINDOW_SIZE);
+        deflateSetDictionary(&z, &filtered[dictStart],
+                             strip.begin - dictStart);
+    }
+
+    size_t size = strip.end - strip.begin;
+    // Room for the flush marker on top of the bound.
+    strip.deflated.resize(deflateBound(&z, size) + 16);
+    z.next_in = const_cast<unsigned char *>(&filtered[strip.begin]);
+    z.avail_in = size;
+    z.next_out = &strip.deflated[0];
+    z.avail_out = strip.deflated.size();
+    int err = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+    bool ok = last ? err == Z_STREAM_END :
+        err == Z_OK && z.avail_in == 0 && z.avail_out != 0;
+    strip.deflated.resize(z.total_out);
+    deflateEnd(&z);
+
+    strip.adler = adler32(1L, &filtered[strip.begin], size);
+    return ok;
+}
+
+void writePNG(std::string const &path,
+              int width, int height,
+              unsigned char const *rgba,
+              int numThreads,
+              int level)
+{
+    TRACE_SCOPE("writePNG");
+    numThreads = std::max(numThreads, 1);
+    size_t const rowBytes = static_cast<size_t>(width) * 4;
+    size_t const filteredRow = rowBytes + 1;
+    int const stripRows =
+        std::max<int>(1, STRIP_BYTES / filteredRow);
+    int const numStrips = std::max(1, (height + stripRows - 1) / stripRows);
+
+    // Filter every row first, so each strip can see the data before
+    // it for its dictionary.
+    std::vector<unsigned char> filtered(filteredRow * height);
+    std::vector<unsigned char> const zeros(rowBytes, 0);
+    parallelFor(numStrips, numThreads, [&](int s) {
+        TRACE_SCOPE("filter strip");
+        int end = std::min((s + 1) * stripRows, height);
+        for (int y = s * stripRows; y < end; ++y) {
+            filterRow(rgba + y * rowBytes,
+                      y == 0 ? &zeros[0] : rgba + (y - 1) * rowBytes,
+                      rowBytes, &filtered[y * filteredRow]);
+        }
+    });
+
+    std::vector<Strip> strips(numStrips);
+    std::atomic<bool> ok(true);
+    parallelFor(numStrips, numThreads, [&](int s) {
+        TRACE_SCOPE("deflate strip");
+        Strip &strip = strips[s];
+        strip.begin = std::min(s * stripRows, height) * filteredRow;
+        strip.end = std::min((s + 1) * stripRows, height) * filteredRow;
+        if (!deflateStrip(filtered, strip, level, s == numStrips - 1)) {
+            ok = false;
+        }
+        makeChunk("IDAT", strip.deflated.data(), strip.deflated.size(),
+                  strip.chunk);
+    });
+    if (!ok) {
+        throw std::runtime_error("Couldn't compress image " + path);
+    }
+
+    // The zlib header and the checksum of all the data get IDATs of
+    // their own, either side of the strips.
+    static unsigned char const ZLIB_HEADER[2] = { 0x78, 0x9c };
+    uLong adler = strips[0].adler;
+    for (int s = 1; s < numStrips; ++s) {
+        adler = adler32_combine(adler, strips[s].adler,
+                                strips[s].end - strips[s].begin);
+    }
+    std::vector<unsigned char> head(ZLIB_HEADER, ZLIB_HEADER + 2);
+    std::vector<unsigned char> tail(4);
+    putBE32(&tail[0], adler);
+    std::vector<unsigned char> headChunk, tailChunk;
+    makeChunk("IDAT", head.data(), head.size(), headChunk);
+    makeChunk("IDAT", tail.data(), tail.size(), tailChunk);
+
+    static unsigned char const SIGNATURE[8] = {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+    };
+    // Width, height, 8 bits, RGBA, deflate, adaptive filters, no
+    // interlace.
+    unsigned char ihdr[13] = { 0, 0, 0, 0, 0, 0, 0, 0, 8, 6, 0, 0, 0 };
+    putBE32(&ihdr[0], width);
+    putBE32(&ihdr[4], height);
+    std::vector<unsigned char> ihdrChunk, iendChunk;
+    makeChunk("IHDR", ihdr, sizeof(ihdr), ihdrChunk);
+    makeChunk("IEND", NULL, 0, iendChunk);
+
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == NULL) {
+        throw std::runtime_error("Couldn't open image " + path);
+    }
+    writeAll(f, SIGNATURE, sizeof(SIGNATURE), path);
+    writeAll(f, ihdrChunk.data(), ihdrChunk.size(), path);
+    writeAll(f, headChunk.data(), headChunk.size(), path);
+    for (int s = 0; s < numStrips; ++s) {
+        writeAll(f, strips[s].chunk.data(), strips[s].chunk.size(), path);
+    }
+    writeAll(f, tailChunk.data(), tailChunk.size(), path);
+    writeAll(f, iendChunk.data(), iendChunk.size(), path);
+    if (fclose(f) != 0) {
+        throw std::runtime_error("Couldn't write image " + path);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+// PFM
+
+void writePFM(std::string const &path,
+              int width, int height,
+              float const *rgb)
+{
+    // The sign of the scale gives the byte order of the floats.
+    uint16_t const one = 1;
+    bool const littleEndian = *reinterpret_cast<char const *>(&one) == 1;
+
+    FILE *f = fopen(path.c_str(), "wb");
+    if (f == NULL) {
+        throw std::runtime_error("Couldn't open image " + path);
+    }
+    if (fprintf(f, "PF\n%d %d\n%s\n", width, height,
+                littleEndian ? "-1.0" : "1.0") < 0) {
+        fclose(f);
+        throw std::runtime_error("Couldn't write image " + path);
+    }
+    size_t const rowFloats = static_cast<size_t>(width) * 3;
+    for (int y = height - 1; y >= 0; --y) {
+        writeAll(f, rgb + y * rowFloats, rowFloats * sizeof(float), path);
+    }
+    if (fclose(f) != 0) {
+        throw std::runtime_error("Couldn't write image " + path);
+    }
+}
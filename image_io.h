@@ -0,0 +1,35 @@
+////////////////////////////////////////////////////////////////////////
+//
+// image_io.h: Writing out the final images.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#ifndef RADIOSITY_IMAGE_IO_H
+#define RADIOSITY_IMAGE_IO_H
+
+#include <string>
+
+#include <zlib.h>
+
+// Write an 8-bit RGBA image, top row first, as a PNG. The image is
+// split into strips of rows, which are filtered and compressed on
+// "numThreads" threads, and then stitched into a single zlib stream.
+// "level" is the zlib compression level, where 0 stores the data
+// uncompressed, which is fastest. Throws std::runtime_error if the
+// file can't be written.
+void writePNG(std::string const &path,
+              int width, int height,
+              unsigned char const *rgba,
+              int numThreads,
+              int level = Z_DEFAULT_COMPRESSION);
+
+// Write a floating-point RGB image, top row first, as a PFM, with no
+// clamping or normalisation. PFM is the simplest HDR format: a text
+// header, then little-endian floats, bottom row first. Throws
+// std::runtime_error if the file can't be written.
+void writePFM(std::string const &path,
+              int width, int height,
+              float const *rgb);
+
+#endif // RADIOSITY_IMAGE_IO_H
@@ -0,0 +1,155 @@
+////////////////////////////////////////////////////////////////////////
+//
+// image_io_test.cpp: Tests for image_io.cpp.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include <png.h>
+
+#include <cppunit/TestCase.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "image_io.h"
+
+class ImageIOTestCase : public CppUnit::TestCase
+{
+private:
+    CPPUNIT_TEST_SUITE(ImageIOTestCase);
+    CPPUNIT_TEST(testPNGRoundTrip);
+    CPPUNIT_TEST(testPNGStored);
+    CPPUNIT_TEST(testPNGThreadsMatch);
+    CPPUNIT_TEST(testPFM);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testPNGRoundTrip();
+    void testPNGStored();
+    void testPNGThreadsMatch();
+    void testPFM();
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(ImageIOTestCase, "ImageIOTestCase");
+
+static char const *const TEST_FILE = "/tmp/image_io_test.img";
+
+// Tall enough to be split into several strips, with smooth areas,
+// edges and noise, so every filter gets used.
+static int const WIDTH = 300;
+static int const HEIGHT = 700;
+
+static std::vector<unsigned char> testImage()
+{
+    std::vector<unsigned char> pixels(WIDTH * HEIGHT * 4);
+    unsigned seed = 1;
+    for (int y = 0; y < HEIGHT; ++y) {
+        for (int x = 0; x < WIDTH; ++x) {
+            unsigned char *p = &pixels[(y * WIDTH + x) * 4];
+            seed = seed * 1103515245 + 12345;
+            p[0] = x;
+            p[1] = y;
+            p[2] = (x / 50 + y / 50) % 2 ? 255 : 0;
+            p[3] = y > HEIGHT / 2 ? seed >> 24 : 255;
+        }
+    }
+    return pixels;
+}
+
+// Decode with libpng, to check the file is valid.
+static std::vector<unsigned char> readPNG(char const *path,
+                                          int &width, int &height)
+{
+    png_image image;
+    memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+    std::vector<unsigned char> pixels;
+    if (png_image_begin_read_from_file(&image, path)) {
+        image.format = PNG_FORMAT_RGBA;
+        pixels.resize(PNG_IMAGE_SIZE(image));
+        if (!png_image_finish_read(&image, NULL, &pixels[0], 0, NULL)) {
+            pixels.clear();
+        }
+    }
+    width = image.width;
+    height = image.height;
+    png_image_free(&image);
+    return pixels;
+}
+
+static std::vector<char> readFile(char const *path)
+{
+    std::ifstream is(path, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(is),
+                             std::istreambuf_iterator<char>());
+}
+
+void ImageIOTestCase::testPNGRoundTrip()
+{
+    std::vector<unsigned char> pixels = testImage();
+    writePNG(TEST_FILE, WIDTH, HEIGHT, &pixels[0], 4);
+    int width, height;
+    std::vector<unsigned char> decoded = readPNG(TEST_FILE, width, height);
+    CPPUNIT_ASSERT_EQUAL(WIDTH, width);
+    CPPUNIT_ASSERT_EQUAL(HEIGHT, height);
+    CPPUNIT_ASSERT(decoded == pixels);
+    // And it actually compressed.
+    CPPUNIT_ASSERT(readFile(TEST_FILE).size() < pixels.size() / 2);
+    remove(TEST_FILE);
+}
+
+void ImageIOTestCase::testPNGStored()
+{
+    std::vector<unsigned char> pixels = testImage();
+    writePNG(TEST_FILE, WIDTH, HEIGHT, &pixels[0], 4, 0);
+    int width, height;
+    std::vector<unsigned char> decoded = readPNG(TEST_FILE, width, height);
+    CPPUNIT_ASSERT(decoded == pixels);
+    remove(TEST_FILE);
+}
+
+void ImageIOTestCase::testPNGThreadsMatch()
+{
+    // The strips are fixed, so the bytes don't depend on the threads.
+    std::vector<unsigned char> pixels = testImage();
+    writePNG(TEST_FILE, WIDTH, HEIGHT, &pixels[0], 1);
+    std::vector<char> single = readFile(TEST_FILE);
+    writePNG(TEST_FILE, WIDTH, HEIGHT, &pixels[0], 3);
+    CPPUNIT_ASSERT(readFile(TEST_FILE) == single);
+    remove(TEST_FILE);
+}
+
+void ImageIOTestCase::testPFM()
+{
+    int const w = 3, h = 2;
+    float const rgb[w * h * 3] = {
+        0.0f, 0.5f, 1.0f,  2.0f, 3.0f, 4.0f,  -1.0f, 100.0f, 0.25f,
+        5.0f, 6.0f, 7.0f,  8.0f, 9.0f, 10.0f,  11.0f, 12.0f, 13.0f
+    };
+    writePFM(TEST_FILE, w, h, rgb);
+
+    std::ifstream is(TEST_FILE, std::ios::binary);
+    std::string magic;
+    int width, height;
+    double scale;
+    is >> magic >> width >> height >> scale;
+    is.get();
+    CPPUNIT_ASSERT_EQUAL(std::string("PF"), magic);
+    CPPUNIT_ASSERT_EQUAL(w, width);
+    CPPUNIT_ASSERT_EQUAL(h, height);
+    // Negative for little-endian, which is all we're likely to see.
+    CPPUNIT_ASSERT_EQUAL(1.0, std::fabs(scale));
+
+    // Bottom row first, and values outside [0, 1] kept as they are.
+    float data[w * h * 3];
+    is.read(reinterpret_cast<char *>(data), sizeof(data));
+    CPPUNIT_ASSERT(is);
+    CPPUNIT_ASSERT(memcmp(data, rgb + w * 3, w * 3 * sizeof(float)) == 0);
+    CPPUNIT_ASSERT(memcmp(data + w * 3, rgb, w * 3 * sizeof(float)) == 0);
+    remove(TEST_FILE);
+}
@@ -0,0 +1,41 @@
+////////////////////////////////////////////////////////////////////////
+//
+// item_buffer.cpp: The poly IDs (and optionally depths) seen on each
+// face of a cube around a camera, kept so they can be summed against
+// any number of weightings without rendering again.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include <stdexcept>
+
+#include "item_buffer.h"
+
+ItemBuffer::ItemBuffer()
+    : m_resolution(0)
+{
+}
+
+void ItemBuffer::resize(int resolution, bool keepDepths)
+{
+    m_resolution = resolution;
+    int const pixels = resolution * resolution;
+    for (int i = 0; i < NUM_FACES; ++i) {
+        m_pixels[i].resize(NUM_CHANS * pixels);
+        if (keepDepths) {
+            m_depths[i].resize(pixels);
+        } else {
+            m_depths[i].clear();
+        }
+    }
+}
+
+void ItemBuffer::accumulate(int face,
+                            std::vector<float> const &weights,
+                            WeightAccumulator &acc) const
+{
+    if (NUM_CHANS * weights.size() > m_pixels[face].size()) {
+        throw std::runtime_error("Weights larger than item buffer face");
+    }
+    acc.add(&m_pixels[face][0], &weights[0], weights.size());
+}
@@ -0,0 +1,58 @@
+////////////////////////////////////////////////////////////////////////
+//
+// item_buffer.h: The poly IDs (and optionally depths) seen on each
+// face of a cube around a camera, kept so they can be summed against
+// any number of weightings without rendering again.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#ifndef RADIOSITY_ITEM_BUFFER_H
+#define RADIOSITY_ITEM_BUFFER_H
+
+#include <vector>
+
+#include "accumulator.h"
+
+class ItemBuffer
+{
+public:
+    // Faces, in the order they're rendered.
+    enum Face { FRONT, BACK, RIGHT, LEFT, UP, DOWN, NUM_FACES };
+
+    ItemBuffer();
+
+    // Size the buffer for faces "resolution" pixels square. Depths
+    // are only stored if "keepDepths" is set.
+    void resize(int resolution, bool keepDepths);
+
+    int resolution() const { return m_resolution; }
+    bool hasDepths() const { return !m_depths[0].empty(); }
+
+    // RGBA pixels and depths for a face, stored a row at a time from
+    // the bottom, as glReadPixels gives them.
+    unsigned char *pixels(int face) { return &m_pixels[face][0]; }
+    unsigned char const *pixels(int face) const { return &m_pixels[face][0]; }
+    float *depths(int face) { return &m_depths[face][0]; }
+    float const *depths(int face) const { return &m_depths[face][0]; }
+
+    // The clip matrix (projection times modelview) each face was
+    // rendered with, in GL's column-major order.
+    double *clip(int face) { return m_clips[face]; }
+    double const *clip(int face) const { return m_clips[face]; }
+
+    // Add the weighted pixels of the face to "acc". The weights cover
+    // the first weights.size() pixels of the face, so a table for
+    // the bottom half of a face only sums that half.
+    void accumulate(int face,
+                    std::vector<float> const &weights,
+                    WeightAccumulator &acc) const;
+
+private:
+    int m_resolution;
+    std::vector<unsigned char> m_pixels[NUM_FACES];
+    std::vector<float> m_depths[NUM_FACES];
+    double m_clips[NUM_FACES][16];
+};
+
+#endif // RADIOSITY_ITEM_BUFFER_H
@@ -0,0 +1,77 @@
+////////////////////////////////////////////////////////////////////////
+//
+// item_buffer_test.cpp: Tests for item_buffer.cpp.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include <stdexcept>
+#include <vector>
+
+#include <cppunit/TestCase.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "item_buffer.h"
+
+class ItemBufferTestCase : public CppUnit::TestCase
+{
+private:
+    CPPUNIT_TEST_SUITE(ItemBufferTestCase);
+    CPPUNIT_TEST(testResize);
+    CPPUNIT_TEST(testPartialWeights);
+    CPPUNIT_TEST(testOversizedWeights);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testResize();
+    void testPartialWeights();
+    void testOversizedWeights();
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(ItemBufferTestCase,
+                                      "ItemBufferTestCase");
+
+void ItemBufferTestCase::testResize()
+{
+    ItemBuffer items;
+    items.resize(8, true);
+    CPPUNIT_ASSERT_EQUAL(8, items.resolution());
+    CPPUNIT_ASSERT(items.hasDepths());
+    items.resize(4, false);
+    CPPUNIT_ASSERT_EQUAL(4, items.resolution());
+    CPPUNIT_ASSERT(!items.hasDepths());
+}
+
+// A weight table smaller than the face only sums the first rows.
+void ItemBufferTestCase::testPartialWeights()
+{
+    int const res = 4;
+    ItemBuffer items;
+    items.resize(res, false);
+    for (int face = 0; face < ItemBuffer::NUM_FACES; ++face) {
+        for (int i = 0; i < res * res; ++i) {
+            // Bottom half is poly 1, top half poly 2.
+            encodePolyIndex(i < res * res / 2 ? 1 : 2,
+                            items.pixels(face) + NUM_CHANS * i);
+        }
+    }
+
+    std::vector<float> full(res * res, 0.25f);
+    std::vector<float> half(res * res / 2, 0.5f);
+    WeightAccumulator acc(2);
+    items.accumulate(ItemBuffer::FRONT, full, acc);
+    items.accumulate(ItemBuffer::LEFT, half, acc);
+    std::vector<double> row(2);
+    acc.take(&row[0]);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(2.0 + 4.0, row[0], 1.0e-9);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(2.0, row[1], 1.0e-9);
+}
+
+void ItemBufferTestCase::testOversizedWeights()
+{
+    ItemBuffer items;
+    items.resize(4, false);
+    std::vector<float> weights(17, 1.0f);
+    WeightAccumulator acc(1);
+    CPPUNIT_ASSERT_THROW(items.accumulate(ItemBuffer::UP, weights, acc),
+                         std::runtime_error);
+}
@@ -0,0 +1,59 @@
+////////////////////////////////////////////////////////////////////////
+//
+// parallel.h: Header-only helpers for spreading work over threads.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#ifndef RADIOSITY_PARALLEL_H
+#define RADIOSITY_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <vector>
+
+// Run "fn(t)" for t in [0, numThreads), with 0 on this thread and the
+// rest on threads of their own. Once they've all finished, the first
+// exception thrown, if any, is rethrown.
+template<typename Fn>
+void runThreads(int numThreads, Fn fn)
+{
+    std::vector<std::exception_ptr> errors(std::max(numThreads, 1));
+    auto run = [&](int t) {
+        try {
+            fn(t);
+        } catch (...) {
+            errors[t] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < numThreads; ++t) {
+        threads.push_back(std::thread(run, t));
+    }
+    run(0);
+    for (int i = 0, n = threads.size(); i < n; ++i) {
+        threads[i].join();
+    }
+    for (int i = 0, n = errors.size(); i < n; ++i) {
+        if (errors[i]) {
+            std::rethrow_exception(errors[i]);
+        }
+    }
+}
+
+// Run "fn(i)" for i in [0, count), spread over up to "numThreads"
+// threads, each taking the next i as it finishes the last.
+template<typename Fn>
+void parallelFor(int count, int numThreads, Fn fn)
+{
+    std::atomic<int> next(0);
+    runThreads(std::min(numThreads, count), [&](int) {
+        for (int i = next++; i < count; i = next++) {
+            fn(i);
+        }
+    });
+}
+
+#endif // RADIOSITY_PARALLEL_H
@@ -0,0 +1,378 @@
+////////////////////////////////////////////////////////////////////////
+//
+// raster.cpp: Tile-based software rasteriser, for the final render.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "parallel.h"
+#include "raster.h"
+
+// In final pixels. Small enough that a tile's samples stay in cache.
+static int const TILE_SIZE = 32;
+
+// Work items for setting up vertices and triangles are handed out in
+// blocks of this many.
+static int const SETUP_BLOCK = 4096;
+
+struct SoftwareRasteriser::Triangle
+{
+    bool valid;
+    // Window-space positions, in samples, with y going up.
+    double x[3], y[3];
+    // Depth, which is affine in window space.
+    double z[3];
+    // 1/w, and colour/w, for perspective-correct colour.
+    double invW[3];
+    double c[3][3];
+    // Twice the signed area.
+    double area;
+};
+
+SoftwareRasteriser::SoftwareRasteriser(int width, int height,
+                                       int supersample,
+                                       int numThreads)
+    : m_width(width),
+      m_height(height),
+      m_supersample(supersample),
+      m_numThreads(std::max(numThreads, 1)),
+      m_tilesAcross((width + TILE_SIZE - 1) / TILE_SIZE),
+      m_tilesDown((height + TILE_SIZE - 1) / TILE_SIZE),
+      m_matrix { 1.0, 0.0, 0.0, 0.0,
+                 0.0, 1.0, 0.0, 0.0,
+                 0.0, 0.0, 1.0, 0.0,
+                 0.0, 0.0, 0.0, 1.0 }
+{
+}
+
+void SoftwareRasteriser::setCamera(double fovy, double zNear, double zFar,
+                                   Vertex const &eye,
+                                   Vertex const &centre,
+                                   Vertex const &up)
+{
+    // Projection, as gluPerspective.
+    double f = 1.0 / tan(fovy * M_PI / 360.0);
+    double aspect = static_cast<double>(m_width) / m_height;
+    double proj[16] = {
+        f / aspect, 0.0, 0.0, 0.0,
+        0.0, f, 0.0, 0.0,
+        0.0, 0.0, (zFar + zNear) / (zNear - zFar),
+        2.0 * zFar * zNear / (zNear - zFar),
+        0.0, 0.0, -1.0, 0.0
+    };
+
+    // View, as gluLookAt.
+    Vertex fwd = (centre - eye).norm();
+    Vertex side = cross(fwd, up).norm();
+    Vertex up2 = cross(side, fwd);
+    double view[16] = {
+        side.x(), side.y(), side.z(), -dot(side, eye),
+        up2.x(), up2.y(), up2.z(), -dot(up2, eye),
+        -fwd.x(), -fwd.y(), -fwd.z(), dot(fwd, eye),
+        0.0, 0.0, 0.0, 1.0
+    };
+
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            double sum = 0.0;
+            for (int k = 0; k < 4; ++k) {
+                sum += proj[i * 4 + k] * view[k * 4 + j];
+            }
+            m_matrix[i * 4 + j] = sum;
+        }
+    }
+}
+
+void SoftwareRasteriser::render(GouraudMesh const &mesh,
+                                std::vector<unsigned char> &pixels) const
+{
+    std::vector<Triangle> triangles;
+    setUp(mesh, true, triangles);
+    std::vector<std::vector<int> > bins;
+    bin(triangles, bins);
+
+    pixels.assign(m_width * m_height * 4, 0);
+    parallelFor(bins.size(), m_numThreads, [&](int tile) {
+        renderTile(tile, triangles, bins[tile], &pixels[0], NULL);
+    });
+}
+
+void SoftwareRasteriser::renderHDR(GouraudMesh const &mesh,
+                                   std::vector<float> &rgb) const
+{
+    std::vector<Triangle> triangles;
+    setUp(mesh, false, triangles);
+    std::vector<std::vector<int> > bins;
+    bin(triangles, bins);
+
+    rgb.assign(m_width * m_height * 3, 0.0f);
+    parallelFor(bins.size(), m_numThreads, [&](int tile) {
+        renderTile(tile, triangles, bins[tile], NULL, &rgb[0]);
+    });
+}
+
+////////////////////////////////////////////////////////////////////////
+// Set-up and binning
+
+// A vertex transformed into window space.
+struct WindowVertex
+{
+    bool valid;
+    double x, y, z, invW;
+    // Clamped, as GL does, unless rendering HDR, and divided by w.
+    double c[3];
+};
+
+void SoftwareRasteriser::setUp(GouraudMesh const &mesh,
+                               bool clamp,
+                               std::vector<Triangle> &triangles) const
+{
+    int const numVertices = mesh.positions.size();
+    std::vector<WindowVertex> wvs(numVertices);
+    double const sw = m_width * m_supersample;
+    double const sh = m_height * m_supersample;
+    double const *m = m_matrix;
+    int const vertexBlocks = (numVertices + SETUP_BLOCK - 1) / SETUP_BLOCK;
+    parallelFor(vertexBlocks, m_numThreads, [&](int b) {
+        int end = std::min((b + 1) * SETUP_BLOCK, numVertices);
+        for (int i = b * SETUP_BLOCK; i < end; ++i) {
+            VertexF const &p = mesh.positions[i];
+            double clip[4];
+            for (int j = 0; j < 4; ++j) {
+                clip[j] = m[j * 4 + 0] * p.x() + m[j * 4 + 1] * p.y() +
+                          m[j * 4 + 2] * p.z() + m[j * 4 + 3];
+            }
+            WindowVertex &wv = wvs[i];
+            // In front of the near plane?
+            wv.valid = clip[3] > 0.0 && clip[2] >= -clip[3];
+            double invW = 1.0 / clip[3];
+            wv.x = (clip[0] * invW + 1.0) * 0.5 * sw;
+            wv.y = (clip[1] * invW + 1.0) * 0.5 * sh;
+            wv.z = (clip[2] * invW + 1.0) * 0.5;
+            wv.invW = invW;
+            ColourF const &c = mesh.colours[i];
+            double const rgb[3] = { c.r, c.g, c.b };
+            for (int j = 0; j < 3; ++j) {
+                double cj = clamp ? std::min(std::max(rgb[j], 0.0), 1.0)
+                                  : rgb[j];
+                wv.c[j] = cj * invW;
+            }
+        }
+    });
+
+    // Each quad is drawn as two triangles, like GL does.
+    static int const corners[2][3] = { { 0, 1, 2 }, { 0, 2, 3 } };
+    int const numTriangles = mesh.indices.size() / 2;
+    triangles.resize(numTriangles);
+    int const triangleBlocks =
+        (numTriangles + SETUP_BLOCK - 1) / SETUP_BLOCK;
+    parallelFor(triangleBlocks, m_numThreads, [&](int b) {
+        int end = std::min((b + 1) * SETUP_BLOCK, numTriangles);
+        for (int i = b * SETUP_BLOCK; i < end; ++i) {
+            Triangle &t = triangles[i];
+            GLuint const *quad = &mesh.indices[(i / 2) * 4];
+            t.valid = true;
+            for (int j = 0; j < 3; ++j) {
+                WindowVertex const &wv = wvs[quad[corners[i % 2][j]]];
+                t.valid = t.valid && wv.valid;
+                t.x[j] = wv.x;
+                t.y[j] = wv.y;
+                t.z[j] = wv.z;
+                t.invW[j] = wv.invW;
+                for (int k = 0; k < 3; ++k) {
+                    t.c[j][k] = wv.c[k];
+                }
+            }
+            // Counter-clockwise is front-facing, and we cull the back.
+            t.area = (t.x[1] - t.x[0]) * (t.y[2] - t.y[0]) -
+                     (t.y[1] - t.y[0]) * (t.x[2] - t.x[0]);
+            t.valid = t.valid && t.area > 0.0;
+        }
+    });
+}
+
+// Range of samples whose centres the triangle's bounding box may
+// cover, clamped to [0, limit).
+static void sampleRange(double const *coords, int limit, int &lo, int &hi)
+{
+    double mn = std::min(coords[0], std::min(coords[1], coords[2]));
+    double mx = std::max(coords[0], std::max(coords[1], coords[2]));
+    // Clamp before converting, as off-screen coordinates can be huge.
+    lo = static_cast<int>(ceil(std::max(mn - 0.5, 0.0)));
+    hi = static_cast<int>(floor(std::min(mx - 0.5, limit - 1.0)));
+}
+
+void SoftwareRasteriser::bin(std::vector<Triangle> const &triangles,
+                             std::vector<std::vector<int> > &bins) const
+{
+    // Each thread bins a contiguous run of triangles, and the runs
+    // are then joined in order, so triangles reach each tile in the
+    // order they were submitted.
+    int const numTiles = m_tilesAcross * m_tilesDown;
+    int const numTriangles = triangles.size();
+    int const numRuns = m_numThreads;
+    int const tileSamples = TILE_SIZE * m_supersample;
+    std::vector<std::vector<std::vector<int> > > runBins(numRuns);
+    parallelFor(numRuns, m_numThreads, [&](int run) {
+        std::vector<std::vector<int> > &runBin = runBins[run];
+        runBin.resize(numTiles);
+        int begin = static_cast<long>(numTriangles) * run / numRuns;
+        int end = static_cast<long>(numTriangles) * (run + 1) / numRuns;
+        for (int i = begin; i < end; ++i) {
+            Triangle const &t = triangles[i];
+            if (!t.valid) {
+                continue;
+            }
+            int x0, x1, y0, y1;
+            sampleRange(t.x, m_width * m_supersample, x0, x1);
+            sampleRange(t.y, m_height * m_supersample, y0, y1);
+            for (int ty = y0 / tileSamples; ty <= y1 / tileSamples &&
+                     y0 <= y1; ++ty) {
+                for (int tx = x0 / tileSamples; tx <= x1 / tileSamples &&
+                         x0 <= x1; ++tx) {
+                    runBin[ty * m_tilesAcross + tx].push_back(i);
+                }
+            }
+        }
+    });
+
+    bins.resize(numTiles);
+    parallelFor(numTiles, m_numThreads, [&](int tile) {
+        std::vector<int> &b = bins[tile];
+        b.clear();
+        for (int run = 0; run < numRuns; ++run) {
+            std::vector<int> const &r = runBins[run][tile];
+            b.insert(b.end(), r.begin(), r.end());
+        }
+    });
+}
+
+////////////////////////////////////////////////////////////////////////
+// Rasterising
+
+// Include samples exactly on an edge only for top and left edges, so
+// samples on an edge shared by two triangles are drawn once. With y
+// up and counter-clockwise triangles, left edges go down and top
+// edges go left.
+static bool isTopLeft(double dx, double dy)
+{
+    return dy < 0.0 || (dy == 0.0 && dx < 0.0);
+}
+
+void SoftwareRasteriser::renderTile(int tile,
+                                    std::vector<Triangle> const &triangles,
+                                    std::vector<int> const &bin,
+                                    unsigned char *pixels,
+                                    float *hdr) const
+{
+    int const ss = m_supersample;
+    int const tileX = (tile % m_tilesAcross) * TILE_SIZE;
+    int const tileY = (tile / m_tilesAcross) * TILE_SIZE;
+    int const tileW = std::min(TILE_SIZE, m_width - tileX);
+    int const tileH = std::min(TILE_SIZE, m_height - tileY);
+    int const sampW = tileW * ss;
+    int const sampH = tileH * ss;
+    int const sampX = tileX * ss;
+    int const sampY = tileY * ss;
+
+    // Samples not drawn to keep a depth of 1, and are background.
+    std::vector<float> depth(sampW * sampH, 1.0f);
+    std::vector<float> colour(sampW * sampH * 3, 0.0f);
+
+    for (int n = 0, nb = bin.size(); n < nb; ++n) {
+        Triangle const &t = triangles[bin[n]];
+        int x0, x1, y0, y1;
+        sampleRange(t.x, m_width * ss, x0, x1);
+        sampleRange(t.y, m_height * ss, y0, y1);
+        x0 = std::max(x0, sampX) - sampX;
+        y0 = std::max(y0, sampY) - sampY;
+        x1 = std::min(x1, sampX + sampW - 1) - sampX;
+        y1 = std::min(y1, sampY + sampH - 1) - sampY;
+
+        // Edge i runs from vertex i to i + 1, and is positive inside.
+        // Its value is the barycentric weight of the opposite vertex,
+        // times the area.
+        double dx[3], dy[3], rowE[3];
+        bool topLeft[3];
+        double const px = sampX + x0 + 0.5, py = sampY + y0 + 0.5;
+        for (int i = 0; i < 3; ++i) {
+            int j = (i + 1) % 3;
+            dx[i] = t.x[j] - t.x[i];
+            dy[i] = t.y[j] - t.y[i];
+            rowE[i] = dx[i] * (py - t.y[i]) - dy[i] * (px - t.x[i]);
+            topLeft[i] = isTopLeft(dx[i], dy[i]);
+        }
+        double const invArea = 1.0 / t.area;
+
+        for (int sy = y0; sy <= y1; ++sy) {
+            double e[3] = { rowE[0], rowE[1], rowE[2] };
+            for (int sx = x0; sx <= x1; ++sx) {
+                bool inside = true;
+                for (int i = 0; i < 3; ++i) {
+                    inside = inside &&
+                        (e[i] > 0.0 || (e[i] == 0.0 && topLeft[i]));
+                }
+                if (inside) {
+                    // Weights for vertices 0, 1 and 2.
+                    double b0 = e[1] * invArea;
+                    double b1 = e[2] * invArea;
+                    double b2 = e[0] * invArea;
+                    double z = b0 * t.z[0] + b1 * t.z[1] + b2 * t.z[2];
+                    int s = sy * sampW + sx;
+                    if (z < depth[s]) {
+                        depth[s] = z;
+                        double w = 1.0 / (b0 * t.invW[0] + b1 * t.invW[1] +
+                                          b2 * t.invW[2]);
+                        for (int k = 0; k < 3; ++k) {
+                            colour[s * 3 + k] =
+                                (b0 * t.c[0][k] + b1 * t.c[1][k] +
+                                 b2 * t.c[2][k]) * w;
+                        }
+                    }
+                }
+                for (int i = 0; i < 3; ++i) {
+                    e[i] -= dy[i];
+                }
+            }
+            for (int i = 0; i < 3; ++i) {
+                rowE[i] += dx[i];
+            }
+        }
+    }
+
+    // Resolve, averaging the samples in each pixel. Coverage becomes
+    // alpha. Output rows go top to bottom, where window y goes up.
+    double const scale = 255.0 / (ss * ss);
+    for (int py = 0; py < tileH; ++py) {
+        int row = m_height - 1 - (tileY + py);
+        for (int px = 0; px < tileW; ++px) {
+            double sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+            for (int sy = py * ss; sy < (py + 1) * ss; ++sy) {
+                for (int sx = px * ss; sx < (px + 1) * ss; ++sx) {
+                    int s = sy * sampW + sx;
+                    if (depth[s] < 1.0f) {
+                        sum[0] += colour[s * 3 + 0];
+                        sum[1] += colour[s * 3 + 1];
+                        sum[2] += colour[s * 3 + 2];
+                        sum[3] += 1.0;
+                    }
+                }
+            }
+            int pixel = row * m_width + tileX + px;
+            if (hdr != NULL) {
+                for (int k = 0; k < 3; ++k) {
+                    hdr[pixel * 3 + k] = sum[k] / (ss * ss);
+                }
+                continue;
+            }
+            for (int k = 0; k < 4; ++k) {
+                pixels[pixel * 4 + k] = static_cast<unsigned char>(
+                    std::min(sum[k] * scale + 0.5, 255.0));
+            }
+        }
+    }
+}
@@ -0,0 +1,75 @@
+////////////////////////////////////////////////////////////////////////
+//
+// raster.h: Tile-based software rasteriser, for the final render.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#ifndef RADIOSITY_RASTER_H
+#define RADIOSITY_RASTER_H
+
+#include <vector>
+
+#include "geom.h"
+
+// Draws a GouraudMesh the way the GL set-up in rendering.cpp does -
+// perspective camera, back-face culling, depth test, smooth shading
+// - but without needing a display or GL context.
+//
+// The image is split into tiles, and each triangle is binned into the
+// tiles it touches. Threads then take whole tiles, rasterising them
+// at "supersample" x "supersample" samples per pixel, and resolve
+// each tile straight into the output.
+class SoftwareRasteriser
+{
+public:
+    SoftwareRasteriser(int width, int height,
+                       int supersample,
+                       int numThreads);
+
+    // Like gluPerspective followed by gluLookAt. Until it's called,
+    // the view is the identity, looking down -z at the [-1, 1] cube.
+    void setCamera(double fovy, double zNear, double zFar,
+                   Vertex const &eye,
+                   Vertex const &centre,
+                   Vertex const &up);
+
+    // Render into RGBA "pixels", top row first. The background is
+    // transparent black, like a cleared GL framebuffer. Triangles
+    // crossing the near plane are dropped, rather than clipped.
+    void render(GouraudMesh const &mesh,
+                std::vector<unsigned char> &pixels) const;
+
+    // Render into RGB floats, top row first, without clamping the
+    // colours, for HDR output. Edge pixels are blended with the black
+    // background, as above.
+    void renderHDR(GouraudMesh const &mesh,
+                   std::vector<float> &rgb) const;
+
+private:
+    // A triangle in window space, in samples, ready to rasterise.
+    struct Triangle;
+
+    void setUp(GouraudMesh const &mesh,
+               bool clamp,
+               std::vector<Triangle> &triangles) const;
+    void bin(std::vector<Triangle> const &triangles,
+             std::vector<std::vector<int> > &bins) const;
+    // Resolves into exactly one of "pixels" (RGBA) or "hdr" (RGB).
+    void renderTile(int tile,
+                    std::vector<Triangle> const &triangles,
+                    std::vector<int> const &bin,
+                    unsigned char *pixels,
+                    float *hdr) const;
+
+    int m_width;
+    int m_height;
+    int m_supersample;
+    int m_numThreads;
+    int m_tilesAcross;
+    int m_tilesDown;
+    // World to clip space, row-major.
+    double m_matrix[16];
+};
+
+#endif // RADIOSITY_RASTER_H
@@ -0,0 +1,164 @@
+////////////////////////////////////////////////////////////////////////
+//
+// raster_test.cpp: Tests for raster.cpp.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include <cmath>
+#include <vector>
+
+#include <cppunit/TestCase.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "raster.h"
+
+class RasterTestCase : public CppUnit::TestCase
+{
+private:
+    CPPUNIT_TEST_SUITE(RasterTestCase);
+    CPPUNIT_TEST(testQuad);
+    CPPUNIT_TEST(testBackFaceCulled);
+    CPPUNIT_TEST(testDepth);
+    CPPUNIT_TEST(testSupersampledEdge);
+    CPPUNIT_TEST(testThreadsMatch);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testQuad();
+    void testBackFaceCulled();
+    void testDepth();
+    void testSupersampledEdge();
+    void testThreadsMatch();
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(RasterTestCase, "RasterTestCase");
+
+static int const SIZE = 64;
+
+// Add an axis-aligned square at depth z, anticlockwise seen from +z,
+// or clockwise if "flip".
+static void addSquare(GouraudMesh &mesh,
+                      double x0, double y0, double x1, double y1, double z,
+                      ColourF const &c, bool flip = false)
+{
+    GLuint base = mesh.positions.size();
+    mesh.positions.push_back(VertexF(x0, y0, z));
+    mesh.positions.push_back(VertexF(x1, y0, z));
+    mesh.positions.push_back(VertexF(x1, y1, z));
+    mesh.positions.push_back(VertexF(x0, y1, z));
+    for (int i = 0; i < 4; ++i) {
+        mesh.colours.push_back(c);
+        mesh.indices.push_back(base + (flip ? 3 - i : i));
+    }
+}
+
+// Pixel (x, y), counting from the top left.
+static unsigned char const *pixel(std::vector<unsigned char> const &pixels,
+                                  int x, int y)
+{
+    return &pixels[(y * SIZE + x) * 4];
+}
+
+void RasterTestCase::testQuad()
+{
+    GouraudMesh mesh;
+    addSquare(mesh, -0.5, 0.0, 0.5, 1.0, 0.0, ColourF(1.0f, 0.5f, 2.0f));
+    std::vector<unsigned char> pixels;
+    SoftwareRasteriser(SIZE, SIZE, 2, 1).render(mesh, pixels);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(SIZE * SIZE * 4), pixels.size());
+
+    // Inside, with colours clamped to 1.
+    unsigned char const *in = pixel(pixels, SIZE / 2, SIZE / 4);
+    CPPUNIT_ASSERT_EQUAL(255, static_cast<int>(in[0]));
+    CPPUNIT_ASSERT_EQUAL(128, static_cast<int>(in[1]));
+    CPPUNIT_ASSERT_EQUAL(255, static_cast<int>(in[2]));
+    CPPUNIT_ASSERT_EQUAL(255, static_cast<int>(in[3]));
+    // The square's in the top half, as y goes up.
+    unsigned char const *out = pixel(pixels, SIZE / 2, SIZE * 3 / 4);
+    for (int i = 0; i < 4; ++i) {
+        CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(out[i]));
+    }
+    // Edges are pixel-aligned, so fully in or out.
+    CPPUNIT_ASSERT_EQUAL(255, static_cast<int>(pixel(pixels, 16, 0)[3]));
+    CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(pixel(pixels, 15, 0)[3]));
+}
+
+void RasterTestCase::testBackFaceCulled()
+{
+    GouraudMesh mesh;
+    addSquare(mesh, -0.5, -0.5, 0.5, 0.5, 0.0, ColourF(1.0f, 1.0f, 1.0f),
+              true);
+    std::vector<unsigned char> pixels;
+    SoftwareRasteriser(SIZE, SIZE, 2, 1).render(mesh, pixels);
+    for (int i = 0, n = pixels.size(); i < n; ++i) {
+        CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(pixels[i]));
+    }
+}
+
+void RasterTestCase::testDepth()
+{
+    // Smaller z is nearer, whichever order they're drawn in.
+    ColourF const red(1.0f, 0.0f, 0.0f), green(0.0f, 1.0f, 0.0f);
+    for (int order = 0; order < 2; ++order) {
+        GouraudMesh mesh;
+        addSquare(mesh, -0.5, -0.5, 0.5, 0.5, order ? 0.5 : -0.5, red);
+        addSquare(mesh, -0.5, -0.5, 0.5, 0.5, order ? -0.5 : 0.5, green);
+        std::vector<unsigned char> pixels;
+        SoftwareRasteriser(SIZE, SIZE, 2, 1).render(mesh, pixels);
+        unsigned char const *p = pixel(pixels, SIZE / 2, SIZE / 2);
+        CPPUNIT_ASSERT_EQUAL(order ? 0 : 255, static_cast<int>(p[0]));
+        CPPUNIT_ASSERT_EQUAL(order ? 255 : 0, static_cast<int>(p[1]));
+    }
+}
+
+void RasterTestCase::testSupersampledEdge()
+{
+    // An edge through the middle of pixel column 15 covers half its
+    // samples.
+    double const halfPixel = 1.0 / SIZE;
+    GouraudMesh mesh;
+    addSquare(mesh, -0.5 - halfPixel, -0.5, 0.5, 0.5, 0.0,
+              ColourF(1.0f, 1.0f, 1.0f));
+    std::vector<unsigned char> pixels;
+    SoftwareRasteriser(SIZE, SIZE, 2, 1).render(mesh, pixels);
+    unsigned char const *p = pixel(pixels, 15, SIZE / 2);
+    CPPUNIT_ASSERT_EQUAL(128, static_cast<int>(p[0]));
+    CPPUNIT_ASSERT_EQUAL(128, static_cast<int>(p[3]));
+
+    // And without supersampling it's all or nothing.
+    SoftwareRasteriser(SIZE, SIZE, 1, 1).render(mesh, pixels);
+    p = pixel(pixels, 15, SIZE / 2);
+    CPPUNIT_ASSERT(p[3] == 0 || p[3] == 255);
+}
+
+void RasterTestCase::testThreadsMatch()
+{
+    // A subdivided, shaded cube, seen in perspective from inside.
+    std::vector<Vertex> vs(cubeVertices);
+    std::vector<Quad> qs;
+    std::vector<SubdivInfo> subdivs;
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        subdivs.push_back(subdivide(cubeFaces[i], vs, qs, 7, 5));
+    }
+    for (int i = 0, n = qs.size(); i < n; ++i) {
+        qs[i].screenColour = Colour(sin(i) * 0.5 + 0.5, (i % 3) * 0.4, 0.2);
+    }
+    GouraudMesh mesh;
+    generateGouraudMesh(subdivs, mesh, 1);
+
+    std::vector<unsigned char> pixels1, pixels4;
+    SoftwareRasteriser raster1(SIZE * 2, SIZE, 2, 1);
+    SoftwareRasteriser raster4(SIZE * 2, SIZE, 2, 4);
+    raster1.setCamera(60.0, 0.1, 10.0, Vertex(0.2, 0.1, 0.3),
+                      Vertex(1.0, 0.0, -1.0), Vertex(0.0, 1.0, 0.0));
+    raster4.setCamera(60.0, 0.1, 10.0, Vertex(0.2, 0.1, 0.3),
+                      Vertex(1.0, 0.0, -1.0), Vertex(0.0, 1.0, 0.0));
+    raster1.render(mesh, pixels1);
+    raster4.render(mesh, pixels4);
+    CPPUNIT_ASSERT(pixels1 == pixels4);
+
+    // From inside the cube, everything is covered.
+    for (int i = 3, n = pixels1.size(); i < n; i += 4) {
+        CPPUNIT_ASSERT_EQUAL(255, static_cast<int>(pixels1[i]));
+    }
+}
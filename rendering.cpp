@@ -7,89 +7,213 @@
 
 #ifdef __APPLE__
 #include <GLUT/glut.h>
+#include <OpenGL/glext.h>
 #else
+#define GL_GLEXT_PROTOTYPES
 #include <GL/glut.h>
 #endif
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <sstream>
+#include <thread>
 #include <vector>
 
-#include <png.h>
-
 #include "geom.h"
+#include "glut_wrap.h"
+#include "image_io.h"
+#include "raster.h"
+#include "rendering.h"
+#include "solver.h"
 
 static const int WIDTH = 2048;
 static const int HEIGHT = 2048;
 
+// Samples per pixel along each axis, for the software renderer.
+static const int SUPERSAMPLE = 2;
+
 static const Vertex EYE_POS = Vertex(0.0, 0.0, -3.0);
 
+static const char WINDOW_TITLE[] = "Radiosity demo";
+
+// How long to wait between checks for a new solver snapshot.
+static const std::chrono::milliseconds IDLE_WAIT(20);
+
+// Radians of orbit per pixel dragged, and the furthest up or down the
+// camera goes, short of the poles where "up" breaks down.
+static const double ORBIT_SPEED = 0.01;
+static const double MAX_PITCH = 1.5;
+
 static std::vector<Quad> flatFaces;
-static std::vector<GouraudQuad> gouraudFaces;
+static GouraudMesh gouraudMesh;
 static std::vector<Vertex> vertices;
+// Save the first frame drawn, unless the image is already saved.
+static bool needScreenshot = true;
+
+// The Gouraud mesh, once uploaded: positions then packed RGBA8
+// colours in one buffer, and the quad indices in another.
+static GLuint meshVbo = 0;
+static GLuint meshIbo = 0;
+static GLsizei meshIndexCount = 0;
+static GLsizeiptr meshColourOffset = 0;
+
+// Camera orbit about the origin, in radians, and the last mouse
+// position while dragging.
+static double orbitYaw = 0.0;
+static double orbitPitch = 0.0;
+#ifndef GW_HEADLESS
+static int dragX;
+static int dragY;
+
+// A background solve being watched, and what to do when it's done.
+static Solver *watchedSolver = NULL;
+static std::vector<Quad> *watchedFaces = NULL;
+static std::vector<Vertex> const *watchedVertices = NULL;
+static std::vector<SubdivInfo> const *watchedSubdivs = NULL;
+static std::function<void(GouraudMesh &)> solveFinished;
+#endif
 
 static void screenshotPNG(const char *filename)
 {
-    const size_t format_nchannels = 4;
-    size_t nvals = format_nchannels * WIDTH * HEIGHT;
-
-    // Assuming a GLubyte is a png_byte...
-    std::vector<png_byte> pixels(nvals);
+    std::vector<GLubyte> pixels(4 * WIDTH * HEIGHT);
     glReadPixels(0, 0, WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+    // GL reads bottom row first.
+    for (int y = 0; y < HEIGHT / 2; ++y) {
+        std::swap_ranges(&pixels[y * WIDTH * 4],
+                         &pixels[(y + 1) * WIDTH * 4],
+                         &pixels[(HEIGHT - 1 - y) * WIDTH * 4]);
+    }
+    writePNG(filename, WIDTH, HEIGHT, &pixels[0],
+             std::thread::hardware_concurrency());
+}
 
-    std::vector<png_byte *> png_rows(HEIGHT);
-    for (size_t i = 0; i < HEIGHT; i++) {
-        png_rows[HEIGHT - i - 1] = &pixels[i * WIDTH * format_nchannels];
+static void drawScene(void)
+{
+    for (std::vector<Quad>::const_iterator iter = flatFaces.begin(),
+             end = flatFaces.end(); iter != end; ++iter) {
+        iter->render(vertices);
     }
+    if (meshIndexCount > 0) {
+        glBindBuffer(GL_ARRAY_BUFFER, meshVbo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshIbo);
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_COLOR_ARRAY);
+        glVertexPointer(3, GL_FLOAT, 0, 0);
+        glColorPointer(4, GL_UNSIGNED_BYTE, 0,
+                       reinterpret_cast<GLvoid const *>(meshColourOffset));
+        glDrawElements(GL_QUADS, meshIndexCount, GL_UNSIGNED_INT, 0);
+        glDisableClientState(GL_COLOR_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+}
 
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-                                              NULL, NULL, NULL);
-    if (png == NULL) {
-        throw std::runtime_error("png_create_write_struct failed");
+// Colours are packed to bytes, clamped as GL would.
+static void packColours(GouraudMesh const &mesh,
+                        std::vector<GLubyte> &colours)
+{
+    int const numVertices = mesh.colours.size();
+    colours.resize(numVertices * 4);
+    for (int i = 0; i < numVertices; ++i) {
+        ColourF const &c = mesh.colours[i];
+        float const rgb[3] = { c.r, c.g, c.b };
+        for (int j = 0; j < 3; ++j) {
+            colours[i * 4 + j] = static_cast<GLubyte>(
+                std::min(std::max(rgb[j], 0.0f), 1.0f) * 255.0f + 0.5f);
+        }
+        colours[i * 4 + 3] = 255;
     }
+}
 
-    png_infop info = png_create_info_struct(png);
-    if (info == NULL) {
-        throw std::runtime_error("png_create_info_struct failed");
+// Copy the Gouraud mesh into buffers, so that each frame is a single
+// draw call with nothing sent from the CPU.
+static void uploadMesh(void)
+{
+    int const numVertices = gouraudMesh.positions.size();
+    std::vector<GLfloat> positions(numVertices * 3);
+    for (int i = 0; i < numVertices; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            positions[i * 3 + j] = gouraudMesh.positions[i].p[j];
+        }
     }
+    std::vector<GLubyte> colours;
+    packColours(gouraudMesh, colours);
 
-    if (setjmp(png_jmpbuf(png))) {
-        throw std::runtime_error("Something failed in libpng");
+    GLsizeiptr const positionSize = positions.size() * sizeof(GLfloat);
+    GLsizeiptr const colourSize = colours.size() * sizeof(GLubyte);
+    glGenBuffers(1, &meshVbo);
+    glBindBuffer(GL_ARRAY_BUFFER, meshVbo);
+    glBufferData(GL_ARRAY_BUFFER, positionSize + colourSize, NULL,
+                 GL_STATIC_DRAW);
+    if (numVertices > 0) {
+        glBufferSubData(GL_ARRAY_BUFFER, 0, positionSize, &positions[0]);
+        glBufferSubData(GL_ARRAY_BUFFER, positionSize, colourSize,
+                        &colours[0]);
     }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    meshColourOffset = positionSize;
+
+    std::vector<GLuint> const &indices = gouraudMesh.indices;
+    glGenBuffers(1, &meshIbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshIbo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint),
+                 indices.empty() ? NULL : &indices[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    meshIndexCount = indices.size();
 
-    FILE *f = fopen(filename, "wb");
-    png_init_io(png, f);
-    png_set_IHDR(png, info, WIDTH, HEIGHT, 8, PNG_COLOR_TYPE_RGBA,
-                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
-                 PNG_FILTER_TYPE_DEFAULT);
-    png_write_info(png, info);
-    png_write_image(png, &png_rows[0]);
-    png_write_end(png, NULL);
-    png_destroy_write_struct(&png, &info);
-    fclose(f);
+    // The GL has its own copy now.
+    gouraudMesh = GouraudMesh();
 }
 
-static void drawScene(void)
+#ifndef GW_HEADLESS
+// Replace the uploaded mesh's colours, where the shape's unchanged.
+static void uploadColours(GouraudMesh const &mesh)
 {
-    for (std::vector<Quad>::const_iterator iter = flatFaces.begin(),
-             end = flatFaces.end(); iter != end; ++iter) {
-        iter->render(vertices);
-    }
-    for (std::vector<GouraudQuad>::const_iterator iter = gouraudFaces.begin(),
-             end = gouraudFaces.end(); iter != end; ++iter) {
-        iter->render(vertices);
-    }
+    std::vector<GLubyte> colours;
+    packColours(mesh, colours);
+    glBindBuffer(GL_ARRAY_BUFFER, meshVbo);
+    glBufferSubData(GL_ARRAY_BUFFER, meshColourOffset, colours.size(),
+                    colours.empty() ? NULL : &colours[0]);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+#endif
+
+#ifdef GW_HEADLESS
+static void releaseMesh(void)
+{
+    glDeleteBuffers(1, &meshVbo);
+    glDeleteBuffers(1, &meshIbo);
+    meshVbo = meshIbo = 0;
+    meshIndexCount = 0;
 }
+#endif
 
 static void display(void)
 {
-    static bool first = true;
-
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    // Orbit the eye about the origin. With no orbit, this is the view
+    // the screenshot and software render use.
+    Vertex eye = Transform()
+        .rotate(Vertex(1.0, 0.0, 0.0), orbitPitch)
+        .rotate(Vertex(0.0, 1.0, 0.0), orbitYaw)(EYE_POS);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    gluLookAt(eye.x(), eye.y(), eye.z(),
+              0.0, 0.0,  0.0,  // Looking at origin
+              0.0, 1.0,  0.0); // Up is in positive Y direction
+
     drawScene();
-    if (first) {
+    if (needScreenshot) {
         screenshotPNG("png/scene.png");
-        first = false;
+        needScreenshot = false;
     }
+#ifndef GW_HEADLESS
     glutSwapBuffers();
+#endif
 }
 
 static void initGL(void)
@@ -109,11 +233,75 @@ static void initGL(void)
                    1.0,   // Z near
                    10.0); // Z far
     glMatrixMode(GL_MODELVIEW);
-    gluLookAt(EYE_POS.x(), EYE_POS.y(), EYE_POS.z(),
-              0.0, 0.0,  0.0,  // Looking at origin
-              0.0, 1.0,  0.0); // Up is in positive Y direction
+    // The view is set up in display(), so it can orbit.
+}
+
+#ifndef GW_HEADLESS
+// Dragging with any button orbits the camera around the scene.
+static void mouse(int button, int state, int x, int y)
+{
+    if (state == GLUT_DOWN) {
+        dragX = x;
+        dragY = y;
+    }
+}
+
+static void motion(int x, int y)
+{
+    orbitYaw += (x - dragX) * ORBIT_SPEED;
+    orbitPitch += (y - dragY) * ORBIT_SPEED;
+    orbitPitch = std::min(std::max(orbitPitch, -MAX_PITCH), MAX_PITCH);
+    dragX = x;
+    dragY = y;
+    glutPostRedisplay();
+}
+
+// Escape or 'q' quits, even mid-solve.
+static void keyboard(unsigned char key, int x, int y)
+{
+    if (key == 27 || key == 'q') {
+        exit(0);
+    }
 }
 
+// Show the latest snapshot of a watched solve, if there's a new one.
+static void idle(void)
+{
+    SnapshotBuffer<SolverSnapshot> &snapshots = watchedSolver->snapshots();
+    if (!snapshots.update()) {
+        // Don't spin while waiting.
+        std::this_thread::sleep_for(IDLE_WAIT);
+        return;
+    }
+    SolverSnapshot const &snapshot = snapshots.front();
+    std::vector<Quad> &qs = *watchedFaces;
+    for (int i = 0, n = qs.size(); i < n; ++i) {
+        qs[i].screenColour = snapshot.colours[i];
+    }
+
+    GouraudMesh mesh;
+    std::ostringstream title;
+    title << WINDOW_TITLE;
+    if (snapshot.finished) {
+        solveFinished(mesh);
+        glutIdleFunc(NULL);
+    } else {
+        normaliseBrightness(qs, *watchedVertices);
+        generateGouraudMesh(*watchedSubdivs, mesh,
+                            std::thread::hardware_concurrency());
+        if (snapshot.iterations == 0) {
+            title << ": transfers " << snapshot.rowsDone << "/"
+                  << snapshot.numRows;
+        } else {
+            title << ": iteration " << snapshot.iterations;
+        }
+    }
+    uploadColours(mesh);
+    glutSetWindowTitle(title.str().c_str());
+    glutPostRedisplay();
+}
+#endif
+
 static bool facesUs(Quad const &q, std::vector<Vertex> const &vs)
 {
     return dot(paraCentre(q, vs) - EYE_POS,
@@ -136,7 +324,8 @@ void normaliseBrightness(std::vector<Quad> &qs, std::vector<Vertex> const &vs)
         }
     }
 
-    double scale = max < TARGET ? TARGET / max : 1.0;
+    // Nothing may be lit yet, part-way through a solve.
+    double scale = max > 0.0 && max < TARGET ? TARGET / max : 1.0;
     for (std::vector<Quad>::iterator iter = qs.begin(), end = qs.end();
          iter != end; ++iter) {
         if (!iter->isEmitter) {
@@ -147,15 +336,33 @@ void normaliseBrightness(std::vector<Quad> &qs, std::vector<Vertex> const &vs)
 
 static void render()
 {
+#ifdef GW_HEADLESS
+    // Nowhere to display it, so just render offscreen once to save
+    // the image.
+    int ctx = gwContextSetup(WIDTH, HEIGHT);
+    initGL();
+    uploadMesh();
+    display();
+    releaseMesh();
+    gwContextTeardown(ctx);
+#else
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGBA | GLUT_DEPTH);
     glutInitWindowSize(WIDTH, HEIGHT);
-    glutCreateWindow("Radiosity demo");
+    glutCreateWindow(WINDOW_TITLE);
     glutDisplayFunc(display);
+    glutMouseFunc(mouse);
+    glutMotionFunc(motion);
+    glutKeyboardFunc(keyboard);
+    if (watchedSolver != NULL) {
+        glutIdleFunc(idle);
+    }
     initGL();
+    uploadMesh();
     // Render one-off first, so we can get it saved to disk without
     // getting it limited to screen size...
     display();
     glutMainLoop();
+#endif
 }
 
 void renderFlat(std::vector<Quad> f, std::vector<Vertex> v)
@@ -165,9 +372,65 @@ void renderFlat(std::vector<Quad> f, std::vector<Vertex> v)
     render();
 }
 
-void renderGouraud(std::vector<GouraudQuad> f, std::vector<Vertex> v)
+// The saved images are rendered in software, antialiased, using
+// every core, and with no display needed.
+static void setUpRaster(SoftwareRasteriser &raster)
 {
-    gouraudFaces = f;
-    vertices = v;
+    raster.setCamera(45.0, 1.0, 10.0,
+                     EYE_POS,
+                     Vertex(0.0, 0.0, 0.0),
+                     Vertex(0.0, 1.0, 0.0));
+}
+
+void saveGouraud(GouraudMesh const &mesh)
+{
+    int const numThreads = std::thread::hardware_concurrency();
+    SoftwareRasteriser raster(WIDTH, HEIGHT, SUPERSAMPLE, numThreads);
+    setUpRaster(raster);
+    std::vector<unsigned char> pixels;
+    raster.render(mesh, pixels);
+    writePNG("png/scene.png", WIDTH, HEIGHT, &pixels[0], numThreads);
+    needScreenshot = false;
+}
+
+void renderGouraud(GouraudMesh const &mesh)
+{
+    saveGouraud(mesh);
+#ifndef GW_HEADLESS
+    // And then show it.
+    gouraudMesh = mesh;
     render();
+#endif
+}
+
+#ifndef GW_HEADLESS
+void watchSolve(Solver &solver,
+                std::vector<Quad> &qs,
+                std::vector<Vertex> const &vs,
+                std::vector<SubdivInfo> const &subdivs,
+                std::function<void(GouraudMesh &)> const &finished)
+{
+    watchedSolver = &solver;
+    watchedFaces = &qs;
+    watchedVertices = &vs;
+    watchedSubdivs = &subdivs;
+    solveFinished = finished;
+    // The final image is saved by "finished".
+    needScreenshot = false;
+
+    // Start with the scene as it is, to get the mesh's shape.
+    generateGouraudMesh(subdivs, gouraudMesh,
+                        std::thread::hardware_concurrency());
+    render();
+}
+#endif
+
+void writeHDR(GouraudMesh const &mesh, char const *filename)
+{
+    SoftwareRasteriser raster(WIDTH, HEIGHT, SUPERSAMPLE,
+                              std::thread::hardware_concurrency());
+    setUpRaster(raster);
+    std::vector<float> rgb;
+    raster.renderHDR(mesh, rgb);
+    writePFM(filename, WIDTH, HEIGHT, &rgb[0]);
 }
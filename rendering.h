@@ -8,13 +8,38 @@
 #ifndef RADIOSITY_RENDERING_H
 #define RADIOSITY_RENDERING_H
 
+#include <functional>
+
 #include "geom.h"
 
+class Solver;
+
 // Render the scene in flat-shaded quads
 void renderFlat(std::vector<Quad> f, std::vector<Vertex> v);
 
-// Render the scene with Gouraud shading
-void renderGouraud(std::vector<GouraudQuad> f, std::vector<Vertex> v);
+// Save the scene with Gouraud shading to png/scene.png. It's drawn by
+// the software rasteriser, so headless builds need no GL for it.
+void saveGouraud(GouraudMesh const &mesh);
+
+// Save the scene as above, and then show it, if there's a display.
+void renderGouraud(GouraudMesh const &mesh);
+
+#ifndef GW_HEADLESS
+// Show a background solve as it goes. Each new snapshot from "solver"
+// is copied into "qs", normalised and drawn, with the progress in the
+// window title. The last is handed to "finished" instead, which
+// should save the results and fill in the mesh to keep showing.
+// Never returns.
+void watchSolve(Solver &solver,
+                std::vector<Quad> &qs,
+                std::vector<Vertex> const &vs,
+                std::vector<SubdivInfo> const &subdivs,
+                std::function<void(GouraudMesh &)> const &finished);
+#endif
+
+// Render the scene in software and save it as a PFM, with the light
+// levels as they are, for tools that do their own tone mapping.
+void writeHDR(GouraudMesh const &mesh, char const *filename);
 
 // Normalise the brightness of non-emitting components
 void normaliseBrightness(std::vector<Quad> &qs, std::vector<Vertex> const &vs);
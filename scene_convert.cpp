@@ -0,0 +1,42 @@
+////////////////////////////////////////////////////////////////////////
+//
+// scene_convert.cpp: Convert a text scene into a binary scene file.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include "geom.h"
+#include "scene_file.h"
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <text scene> <scene file>"
+                  << std::endl;
+        return 1;
+    }
+
+    try {
+        std::ifstream is(argv[1]);
+        if (!is) {
+            throw std::runtime_error(std::string("Couldn't open ") + argv[1]);
+        }
+        std::vector<Vertex> vertices;
+        std::vector<Quad> faces;
+        std::vector<SubdivRecord> subdivs;
+        readTextScene(is, vertices, faces, subdivs);
+        writeScene(argv[2], vertices, faces, subdivs);
+        std::cout << vertices.size() << " vertices, " << faces.size()
+                  << " quads, " << subdivs.size() << " subdivisions"
+                  << std::endl;
+    } catch (std::exception const &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
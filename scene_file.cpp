@@ -0,0 +1,332 @@
+////////////////////////////////////////////////////////////////////////
+//
+// scene_file.cpp: Binary scene files, laid out so that loading is a
+// straight read of each array into its vector, plus a simple text
+// format to build them from.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <type_traits>
+
+#include "scene_file.h"
+#include "trace.h"
+
+static char const SCENE_MAGIC[8] = {
+    'R', 'A', 'D', 'S', 'C', 'E', 'N', 'E'
+};
+
+// The records are read straight into memory, so must be plain data,
+// laid out the same way every time.
+static_assert(std::is_standard_layout<Vertex>::value, "Vertex layout");
+static_assert(std::is_standard_layout<Quad>::value, "Quad layout");
+static_assert(std::is_standard_layout<SubdivRecord>::value,
+              "SubdivRecord layout");
+
+static uint64_t align16(uint64_t offset)
+{
+    return (offset + 15) & ~static_cast<uint64_t>(15);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Writing and loading
+
+// Copy a record's fields into place in zeroed memory at "out". Going
+// field by field means the padding between them is left as zeros,
+// where copying the whole record could carry over whatever was in it.
+static void putRecord(char *out, Vertex const &v)
+{
+    memcpy(out + offsetof(Vertex, p), v.p, sizeof(v.p));
+}
+
+static void putRecord(char *out, Quad const &q)
+{
+    memcpy(out + offsetof(Quad, indices), q.indices, sizeof(q.indices));
+    memcpy(out + offsetof(Quad, isEmitter), &q.isEmitter,
+           sizeof(q.isEmitter));
+    memcpy(out + offsetof(Quad, materialColour), &q.materialColour,
+           sizeof(q.materialColour));
+    memcpy(out + offsetof(Quad, screenColour), &q.screenColour,
+           sizeof(q.screenColour));
+}
+
+static void putRecord(char *out, SubdivRecord const &r)
+{
+    putRecord(out + offsetof(SubdivRecord, baseQuad), r.baseQuad);
+    memcpy(out + offsetof(SubdivRecord, uCount), &r.uCount,
+           sizeof(r.uCount));
+    memcpy(out + offsetof(SubdivRecord, vCount), &r.vCount,
+           sizeof(r.vCount));
+    memcpy(out + offsetof(SubdivRecord, faceStart), &r.faceStart,
+           sizeof(r.faceStart));
+}
+
+// Write the records at "offset", with zeros for any padding.
+template<typename T>
+static void writeRecords(std::ofstream &os,
+                         uint64_t offset,
+                         std::vector<T> const &records)
+{
+    std::vector<char> buf(records.size() * sizeof(T), 0);
+    for (size_t i = 0, n = records.size(); i < n; ++i) {
+        putRecord(&buf[i * sizeof(T)], records[i]);
+    }
+    os.seekp(offset);
+    if (!buf.empty()) {
+        os.write(&buf[0], buf.size());
+    }
+}
+
+void writeScene(std::string const &path,
+                std::vector<Vertex> const &vs,
+                std::vector<Quad> const &qs,
+                std::vector<SubdivRecord> const &subdivs)
+{
+    SceneHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC));
+    h.version = SCENE_VERSION;
+    h.vertexSize = sizeof(Vertex);
+    h.quadSize = sizeof(Quad);
+    h.subdivSize = sizeof(SubdivRecord);
+    h.numVertices = vs.size();
+    h.numQuads = qs.size();
+    h.numSubdivs = subdivs.size();
+    h.vertexOffset = align16(sizeof(h));
+    h.quadOffset = align16(h.vertexOffset + h.numVertices * h.vertexSize);
+    h.subdivOffset = align16(h.quadOffset + h.numQuads * h.quadSize);
+
+    std::ofstream os(path.c_str(), std::ios::binary | std::ios::trunc);
+    os.write(reinterpret_cast<char const *>(&h), sizeof(h));
+    writeRecords(os, h.vertexOffset, vs);
+    writeRecords(os, h.quadOffset, qs);
+    writeRecords(os, h.subdivOffset, subdivs);
+    if (!os) {
+        throw std::runtime_error("Couldn't write scene file " + path);
+    }
+}
+
+// Check the "count" records of "size" bytes at "offset" fit in the
+// file.
+static bool inFile(uint64_t offset,
+                   uint64_t count,
+                   uint64_t size,
+                   uint64_t fileSize)
+{
+    return offset % 16 == 0 &&
+           offset <= fileSize &&
+           count <= (fileSize - offset) / size;
+}
+
+// Check the quad's vertex indices are in range.
+static bool validQuad(Quad const &q, int numVertices)
+{
+    for (int i = 0; i < 4; ++i) {
+        if (q.indices[i] < 0 || q.indices[i] >= numVertices) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Check the subdivision covers a range of the quads that exists.
+static bool validSubdiv(SubdivRecord const &r,
+                        int numVertices,
+                        int numQuads)
+{
+    return validQuad(r.baseQuad, numVertices) &&
+           r.uCount > 0 && r.vCount > 0 && r.faceStart >= 0 &&
+           r.faceStart + static_cast<int64_t>(r.uCount) * r.vCount <=
+               numQuads;
+}
+
+// Fill "records" with the "count" records at "offset", read a batch
+// at a time so there's never much more than the vector in memory.
+template<typename T>
+static void readRecords(std::ifstream &is,
+                        uint64_t offset,
+                        uint64_t count,
+                        std::vector<T> &records)
+{
+    uint64_t const BATCH = 4096;
+    std::vector<char> buf(std::min(count, BATCH) * sizeof(T));
+    records.clear();
+    records.reserve(count);
+    is.seekg(offset);
+    for (uint64_t done = 0; done < count && is; done += BATCH) {
+        size_t n = std::min(count - done, BATCH);
+        is.read(&buf[0], n * sizeof(T));
+        T const *first = reinterpret_cast<T const *>(&buf[0]);
+        records.insert(records.end(), first, first + n);
+    }
+}
+
+void readScene(std::string const &path,
+               std::vector<Vertex> &vs,
+               std::vector<Quad> &qs,
+               std::vector<SubdivRecord> &subdivs)
+{
+    std::ifstream is(path.c_str(), std::ios::binary);
+    if (!is) {
+        throw std::runtime_error("Couldn't open scene file " + path);
+    }
+    is.seekg(0, std::ios::end);
+    uint64_t const size = is.tellg();
+    is.seekg(0);
+    SceneHeader h;
+    if (!is.read(reinterpret_cast<char *>(&h), sizeof(h))) {
+        throw std::runtime_error("Scene file too short: " + path);
+    }
+
+    if (memcmp(h.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC)) != 0) {
+        throw std::runtime_error("Not a scene file: " + path);
+    }
+    if (h.version != SCENE_VERSION) {
+        throw std::runtime_error("Unsupported scene file version: " + path);
+    }
+    if (h.vertexSize != sizeof(Vertex) ||
+        h.quadSize != sizeof(Quad) ||
+        h.subdivSize != sizeof(SubdivRecord)) {
+        throw std::runtime_error(
+            "Scene file written by an incompatible build: " + path);
+    }
+    // Everything else indexes them with ints.
+    if (h.numVertices > INT_MAX ||
+        h.numQuads > INT_MAX ||
+        h.numSubdivs > INT_MAX) {
+        throw std::runtime_error("Scene file too big: " + path);
+    }
+    if (!inFile(h.vertexOffset, h.numVertices, h.vertexSize, size) ||
+        !inFile(h.quadOffset, h.numQuads, h.quadSize, size) ||
+        !inFile(h.subdivOffset, h.numSubdivs, h.subdivSize, size)) {
+        throw std::runtime_error("Corrupt scene file: " + path);
+    }
+
+    readRecords(is, h.vertexOffset, h.numVertices, vs);
+    readRecords(is, h.quadOffset, h.numQuads, qs);
+    readRecords(is, h.subdivOffset, h.numSubdivs, subdivs);
+    if (!is) {
+        throw std::runtime_error("Couldn't read scene file " + path);
+    }
+
+    // Nothing downstream checks the indices, so do it here.
+    int const numVertices = vs.size();
+    int const numQuads = qs.size();
+    for (int i = 0; i < numQuads; ++i) {
+        if (!validQuad(qs[i], numVertices)) {
+            throw std::runtime_error(
+                "Scene file quad has a bad vertex index: " + path);
+        }
+    }
+    for (int i = 0, n = subdivs.size(); i < n; ++i) {
+        if (!validSubdiv(subdivs[i], numVertices, numQuads)) {
+            throw std::runtime_error(
+                "Scene file has a bad subdivision: " + path);
+        }
+    }
+}
+
+void loadScene(std::string const &path,
+               std::vector<Vertex> &vs,
+               std::vector<Quad> &qs,
+               std::vector<SubdivInfo> &subdivs)
+{
+    TRACE_SCOPE("geometry");
+    std::vector<SubdivRecord> records;
+    readScene(path, vs, qs, records);
+    subdivs.clear();
+    for (int i = 0, n = records.size(); i < n; ++i) {
+        SubdivRecord const &r = records[i];
+        subdivs.push_back(SubdivInfo(r.baseQuad, r.uCount, r.vCount,
+                                     r.faceStart, vs, qs));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+// Text format
+
+static void parseError(int lineNum, std::string const &msg)
+{
+    std::ostringstream oss;
+    oss << "Scene line " << lineNum << ": " << msg;
+    throw std::runtime_error(oss.str());
+}
+
+void readTextScene(std::istream &is,
+                   std::vector<Vertex> &vs,
+                   std::vector<Quad> &qs,
+                   std::vector<SubdivRecord> &subdivs)
+{
+    // Everything goes through the welder, so that subdivided quads
+    // share their vertices along common edges. "v" lines are numbered
+    // separately, as the vertex vector also holds the grids.
+    VertexWelder welder(vs);
+    std::vector<int> vIndices;
+    std::string line;
+    for (int lineNum = 1; std::getline(is, line); ++lineNum) {
+        std::istringstream iss(line);
+        std::string type;
+        if (!(iss >> type) || type[0] == '#') {
+            continue;
+        }
+
+        if (type == "v") {
+            double x, y, z;
+            if (!(iss >> x >> y >> z)) {
+                parseError(lineNum, "bad vertex");
+            }
+            vIndices.push_back(welder.add(Vertex(x, y, z)));
+        } else if (type == "q") {
+            int idx[4];
+            double r, g, b;
+            if (!(iss >> idx[0] >> idx[1] >> idx[2] >> idx[3] >>
+                  r >> g >> b)) {
+                parseError(lineNum, "bad quad");
+            }
+            for (int i = 0; i < 4; ++i) {
+                if (idx[i] < 0 ||
+                    idx[i] >= static_cast<int>(vIndices.size())) {
+                    parseError(lineNum, "vertex index out of range");
+                }
+                idx[i] = vIndices[idx[i]];
+            }
+            Quad quad(idx[0], idx[1], idx[2], idx[3], Colour(r, g, b));
+            // Quads without "subdiv" are still given a record, so
+            // they get drawn.
+            int uCount = 1, vCount = 1;
+            std::string option;
+            while (iss >> option) {
+                if (option == "emit") {
+                    quad.isEmitter = true;
+                    quad.screenColour = quad.materialColour;
+                } else if (option == "subdiv") {
+                    if (!(iss >> uCount >> vCount) ||
+                        uCount <= 0 || vCount <= 0) {
+                        parseError(lineNum, "bad subdivision");
+                    }
+                } else {
+                    parseError(lineNum, "unknown option " + option);
+                }
+            }
+
+            SubdivRecord record = {
+                quad, uCount, vCount, static_cast<int32_t>(qs.size())
+            };
+            subdivide(quad, welder, qs, uCount, vCount);
+            // Subdivided quads don't pick up the screen colour.
+            for (int i = record.faceStart, n = qs.size(); i < n; ++i) {
+                qs[i].screenColour = quad.screenColour;
+            }
+            subdivs.push_back(record);
+        } else {
+            parseError(lineNum, "unknown line type " + type);
+        }
+    }
+}
@@ -0,0 +1,91 @@
+////////////////////////////////////////////////////////////////////////
+//
+// scene_file.h: Binary scene files, laid out so that loading is a
+// straight read of each array into its vector, plus a simple text
+// format to build them from.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#ifndef RADIOSITY_SCENE_FILE_H
+#define RADIOSITY_SCENE_FILE_H
+
+#include <cstdint>
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "geom.h"
+
+// Bump whenever the layout of the file, or of the records in it,
+// changes.
+static uint32_t const SCENE_VERSION = 3;
+
+// A subdivided quad, as for SubdivInfo.
+struct SubdivRecord
+{
+    Quad baseQuad;
+    int32_t uCount;
+    int32_t vCount;
+    int32_t faceStart;
+};
+
+// The file starts with this header. The arrays are the in-memory
+// Vertex, Quad and SubdivRecord layouts, at 16-byte-aligned offsets
+// from the start of the file, so they can be read in with no
+// parsing. The record sizes are stored to catch files written by
+// incompatible builds.
+struct SceneHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t vertexSize;
+    uint32_t quadSize;
+    uint32_t subdivSize;
+    uint64_t numVertices;
+    uint64_t numQuads;
+    uint64_t numSubdivs;
+    uint64_t vertexOffset;
+    uint64_t quadOffset;
+    uint64_t subdivOffset;
+};
+
+// Write out a scene file.
+void writeScene(std::string const &path,
+                std::vector<Vertex> const &vs,
+                std::vector<Quad> const &qs,
+                std::vector<SubdivRecord> const &subdivs);
+
+// Read a scene file into vectors. It's a copy, not a mapping: the
+// quads' screen colours get written as the lighting's solved, and
+// the rest of the code works on vectors anyway.
+// Throws std::runtime_error if the file can't be read, isn't a
+// scene file of this version, or has out-of-range indices.
+void readScene(std::string const &path,
+               std::vector<Vertex> &vs,
+               std::vector<Quad> &qs,
+               std::vector<SubdivRecord> &subdivs);
+
+// As above, but making SubdivInfos, which refer to "vs" and "qs".
+void loadScene(std::string const &path,
+               std::vector<Vertex> &vs,
+               std::vector<Quad> &qs,
+               std::vector<SubdivInfo> &subdivs);
+
+// Read the text format, a line at a time:
+//
+//   v <x> <y> <z>
+//   q <v0> <v1> <v2> <v3> <r> <g> <b> [emit] [subdiv <u> <v>]
+//
+// Vertex indices count from 0, in the order the "v" lines appear.
+// Quads with "subdiv" are split into u x v quads. Every quad gets a
+// SubdivRecord, 1 x 1 if it's not split, as only quads with one are
+// drawn in the final image. Coincident vertices are welded together.
+// Blank lines and lines starting "#" are skipped.
+// Throws std::runtime_error on bad input.
+void readTextScene(std::istream &is,
+                   std::vector<Vertex> &vs,
+                   std::vector<Quad> &qs,
+                   std::vector<SubdivRecord> &subdivs);
+
+#endif // RADIOSITY_SCENE_FILE_H
@@ -0,0 +1,343 @@
+////////////////////////////////////////////////////////////////////////
+//
+// scene_file_test.cpp: Tests for scene_file.cpp.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <cppunit/TestCase.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "geom.h"
+#include "scene_file.h"
+
+class SceneFileTestCase : public CppUnit::TestCase
+{
+private:
+    CPPUNIT_TEST_SUITE(SceneFileTestCase);
+    CPPUNIT_TEST(testRoundTrip);
+    CPPUNIT_TEST(testLargeRoundTrip);
+    CPPUNIT_TEST(testReadText);
+    CPPUNIT_TEST(testBadText);
+    CPPUNIT_TEST(testBadFiles);
+    CPPUNIT_TEST(testBadRecords);
+    CPPUNIT_TEST(testZeroPadding);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testRoundTrip();
+    void testLargeRoundTrip();
+    void testReadText();
+    void testBadText();
+    void testBadFiles();
+    void testBadRecords();
+    void testZeroPadding();
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(SceneFileTestCase, "SceneFileTestCase");
+
+// A scratch file, removed when we're done.
+class TempFile
+{
+public:
+    TempFile()
+    {
+        char name[] = "/tmp/scene_test_XXXXXX";
+        int fd = mkstemp(name);
+        CPPUNIT_ASSERT(fd >= 0);
+        close(fd);
+        m_path = name;
+    }
+
+    ~TempFile()
+    {
+        unlink(m_path.c_str());
+    }
+
+    std::string const &path() const { return m_path; }
+
+private:
+    std::string m_path;
+};
+
+static void assertVertexEqual(Vertex const &expected, Vertex const &actual)
+{
+    for (int i = 0; i < 3; ++i) {
+        CPPUNIT_ASSERT_EQUAL(expected.p[i], actual.p[i]);
+    }
+}
+
+static void assertQuadEqual(Quad const &expected, Quad const &actual)
+{
+    for (int i = 0; i < 4; ++i) {
+        CPPUNIT_ASSERT_EQUAL(expected.indices[i], actual.indices[i]);
+    }
+    CPPUNIT_ASSERT_EQUAL(expected.isEmitter, actual.isEmitter);
+    CPPUNIT_ASSERT_EQUAL(expected.materialColour.r, actual.materialColour.r);
+    CPPUNIT_ASSERT_EQUAL(expected.materialColour.g, actual.materialColour.g);
+    CPPUNIT_ASSERT_EQUAL(expected.materialColour.b, actual.materialColour.b);
+    CPPUNIT_ASSERT_EQUAL(expected.screenColour.r, actual.screenColour.r);
+}
+
+void SceneFileTestCase::testRoundTrip()
+{
+    std::vector<Vertex> vs(cubeVertices);
+    std::vector<Quad> qs;
+    std::vector<SubdivRecord> records;
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        Quad base = cubeFaces[i];
+        base.isEmitter = i == 2;
+        SubdivRecord r = { base, 3, 2, static_cast<int32_t>(qs.size()) };
+        subdivide(base, vs, qs, 3, 2);
+        records.push_back(r);
+    }
+
+    TempFile tmp;
+    writeScene(tmp.path(), vs, qs, records);
+    std::vector<Vertex> readVs;
+    std::vector<Quad> readQs;
+    std::vector<SubdivRecord> readRecords;
+    readScene(tmp.path(), readVs, readQs, readRecords);
+    CPPUNIT_ASSERT_EQUAL(vs.size(), readVs.size());
+    CPPUNIT_ASSERT_EQUAL(qs.size(), readQs.size());
+    CPPUNIT_ASSERT_EQUAL(records.size(), readRecords.size());
+    for (int i = 0, n = vs.size(); i < n; ++i) {
+        assertVertexEqual(vs[i], readVs[i]);
+    }
+    for (int i = 0, n = qs.size(); i < n; ++i) {
+        assertQuadEqual(qs[i], readQs[i]);
+    }
+
+    std::vector<Vertex> loadedVs;
+    std::vector<Quad> loadedQs;
+    std::vector<SubdivInfo> loadedSubdivs;
+    loadScene(tmp.path(), loadedVs, loadedQs, loadedSubdivs);
+    CPPUNIT_ASSERT_EQUAL(qs.size(), loadedQs.size());
+    CPPUNIT_ASSERT_EQUAL(records.size(), loadedSubdivs.size());
+    for (int i = 0, n = records.size(); i < n; ++i) {
+        CPPUNIT_ASSERT_EQUAL(records[i].faceStart,
+                             loadedSubdivs[i].faceStart());
+        CPPUNIT_ASSERT_EQUAL(6, loadedSubdivs[i].faceCount());
+    }
+
+    // Rendering the loaded subdivisions should match the originals.
+    std::vector<SubdivInfo> subdivs1(1, SubdivInfo(records[2].baseQuad, 3, 2,
+                                                   records[2].faceStart,
+                                                   vs, qs));
+    std::vector<SubdivInfo> subdivs2(1, loadedSubdivs[2]);
+    GouraudMesh mesh1, mesh2;
+    generateGouraudMesh(subdivs1, mesh1, 1);
+    generateGouraudMesh(subdivs2, mesh2, 1);
+    CPPUNIT_ASSERT_EQUAL(mesh1.positions.size(), mesh2.positions.size());
+    for (int i = 0, n = mesh1.positions.size(); i < n; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            CPPUNIT_ASSERT_EQUAL(mesh1.positions[i].p[j],
+                                 mesh2.positions[i].p[j]);
+        }
+    }
+}
+
+void SceneFileTestCase::testLargeRoundTrip()
+{
+    // Enough to be read in more than one batch.
+    std::vector<Vertex> vs(cubeVertices);
+    std::vector<Quad> qs;
+    std::vector<SubdivRecord> records;
+    subdivide(cubeFaces[0], vs, qs, 100, 50);
+
+    TempFile tmp;
+    writeScene(tmp.path(), vs, qs, records);
+    std::vector<Vertex> readVs;
+    std::vector<Quad> readQs;
+    std::vector<SubdivRecord> readRecords;
+    readScene(tmp.path(), readVs, readQs, readRecords);
+    CPPUNIT_ASSERT_EQUAL(vs.size(), readVs.size());
+    CPPUNIT_ASSERT_EQUAL(qs.size(), readQs.size());
+    CPPUNIT_ASSERT(readRecords.empty());
+    for (int i = 0, n = vs.size(); i < n; ++i) {
+        assertVertexEqual(vs[i], readVs[i]);
+    }
+    for (int i = 0, n = qs.size(); i < n; ++i) {
+        assertQuadEqual(qs[i], readQs[i]);
+    }
+}
+
+void SceneFileTestCase::testReadText()
+{
+    std::istringstream iss(
+        "# A comment, then a blank line\n"
+        "\n"
+        "v 0 0 0\n"
+        "v 1 0 0\n"
+        "v 1 1 0\n"
+        "v 0 1 0\n"
+        "q 0 1 2 3 0.5 0.25 1\n"
+        "q 3 2 1 0 2 2 2 emit subdiv 2 3\n");
+    std::vector<Vertex> vs;
+    std::vector<Quad> qs;
+    std::vector<SubdivRecord> records;
+    readTextScene(iss, vs, qs, records);
+
+    // The grid's corners are welded to the "v" vertices.
+    CPPUNIT_ASSERT_EQUAL(3 * 4, static_cast<int>(vs.size()));
+    CPPUNIT_ASSERT_EQUAL(1 + 2 * 3, static_cast<int>(qs.size()));
+    // The plain quad gets a 1x1 record, so it's drawn.
+    CPPUNIT_ASSERT_EQUAL(2, static_cast<int>(records.size()));
+    CPPUNIT_ASSERT_EQUAL(1, records[0].uCount);
+    CPPUNIT_ASSERT_EQUAL(1, records[0].vCount);
+    CPPUNIT_ASSERT_EQUAL(0, records[0].faceStart);
+    for (int i = 0; i < 4; ++i) {
+        CPPUNIT_ASSERT_EQUAL(i, qs[0].indices[i]);
+    }
+
+    CPPUNIT_ASSERT(!qs[0].isEmitter);
+    CPPUNIT_ASSERT_EQUAL(0.25, qs[0].materialColour.g);
+    for (int i = 1, n = qs.size(); i < n; ++i) {
+        CPPUNIT_ASSERT(qs[i].isEmitter);
+        CPPUNIT_ASSERT_EQUAL(2.0, qs[i].screenColour.r);
+    }
+
+    SubdivRecord const &r = records[1];
+    CPPUNIT_ASSERT_EQUAL(3, r.baseQuad.indices[0]);
+    CPPUNIT_ASSERT_EQUAL(2, r.uCount);
+    CPPUNIT_ASSERT_EQUAL(3, r.vCount);
+    CPPUNIT_ASSERT_EQUAL(1, r.faceStart);
+}
+
+void SceneFileTestCase::testBadText()
+{
+    char const *bad[] = {
+        "v 0 0\n",
+        "v 0 0 0\nq 0 0 0 1 1 1 1\n",
+        "x 1 2 3\n",
+        "v 0 0 0\nq 0 0 0 0 1 1 1 shiny\n",
+        "v 0 0 0\nq 0 0 0 0 1 1 1 subdiv 0 2\n",
+    };
+    for (int i = 0, n = sizeof(bad) / sizeof(*bad); i < n; ++i) {
+        std::istringstream iss(bad[i]);
+        std::vector<Vertex> vs;
+        std::vector<Quad> qs;
+        std::vector<SubdivRecord> records;
+        CPPUNIT_ASSERT_THROW(readTextScene(iss, vs, qs, records),
+                             std::runtime_error);
+    }
+}
+
+void SceneFileTestCase::testBadFiles()
+{
+    TempFile tmp;
+    std::vector<Vertex> vs(cubeVertices);
+    std::vector<Quad> qs(cubeFaces);
+    std::vector<SubdivRecord> records;
+    std::vector<Vertex> readVs;
+    std::vector<Quad> readQs;
+    std::vector<SubdivRecord> readRecords;
+    CPPUNIT_ASSERT_THROW(readScene(tmp.path(), readVs, readQs, readRecords),
+                         std::runtime_error);
+
+    writeScene(tmp.path(), vs, qs, records);
+
+    // Wrong version.
+    {
+        std::fstream fs(tmp.path().c_str(),
+                        std::ios::in | std::ios::out | std::ios::binary);
+        SceneHeader h;
+        fs.read(reinterpret_cast<char *>(&h), sizeof(h));
+        h.version = SCENE_VERSION + 1;
+        fs.seekp(0);
+        fs.write(reinterpret_cast<char const *>(&h), sizeof(h));
+    }
+    CPPUNIT_ASSERT_THROW(readScene(tmp.path(), readVs, readQs, readRecords),
+                         std::runtime_error);
+
+    // Truncated.
+    writeScene(tmp.path(), vs, qs, records);
+    CPPUNIT_ASSERT_EQUAL(0, truncate(tmp.path().c_str(),
+                                     sizeof(SceneHeader) + 100));
+    CPPUNIT_ASSERT_THROW(readScene(tmp.path(), readVs, readQs, readRecords),
+                         std::runtime_error);
+}
+
+void SceneFileTestCase::testBadRecords()
+{
+    TempFile tmp;
+    std::vector<Vertex> vs(cubeVertices);
+    std::vector<Quad> readQs;
+    std::vector<Vertex> readVs;
+    std::vector<SubdivRecord> readRecords;
+
+    // Vertex indices off either end.
+    int const badIndices[] = { -1, static_cast<int>(vs.size()) };
+    for (int i = 0; i < 2; ++i) {
+        std::vector<Quad> qs(cubeFaces);
+        qs[3].indices[2] = badIndices[i];
+        writeScene(tmp.path(), vs, qs, std::vector<SubdivRecord>());
+        CPPUNIT_ASSERT_THROW(
+            readScene(tmp.path(), readVs, readQs, readRecords),
+            std::runtime_error);
+    }
+
+    // Subdivisions that don't fit the quads. Each face is its own
+    // 1 x 1 subdivision, which is fine.
+    std::vector<Quad> qs(cubeFaces);
+    std::vector<SubdivRecord> good;
+    for (int i = 0, n = qs.size(); i < n; ++i) {
+        SubdivRecord r = { qs[i], 1, 1, i };
+        good.push_back(r);
+    }
+    writeScene(tmp.path(), vs, qs, good);
+    readScene(tmp.path(), readVs, readQs, readRecords);
+    CPPUNIT_ASSERT_EQUAL(good.size(), readRecords.size());
+
+    for (int i = 0; i < 5; ++i) {
+        std::vector<SubdivRecord> bad(good);
+        SubdivRecord &r = bad.back();
+        switch (i) {
+        case 0: r.uCount = 0; break;
+        case 1: r.vCount = -1; break;
+        case 2: r.faceStart = -1; break;
+        case 3: r.uCount = 2; break;
+        case 4: r.baseQuad.indices[0] = vs.size(); break;
+        }
+        writeScene(tmp.path(), vs, qs, bad);
+        CPPUNIT_ASSERT_THROW(
+            readScene(tmp.path(), readVs, readQs, readRecords),
+            std::runtime_error);
+    }
+}
+
+void SceneFileTestCase::testZeroPadding()
+{
+    // Build a quad over garbage, so its padding isn't zero to start
+    // with.
+    alignas(Quad) char raw[sizeof(Quad)];
+    memset(raw, 0xff, sizeof(raw));
+    Quad *garbage = new (raw) Quad(0, 1, 2, 3, Colour(1.0, 1.0, 1.0));
+    std::vector<Vertex> vs(cubeVertices);
+    std::vector<Quad> qs(1, *garbage);
+    std::vector<SubdivRecord> records;
+
+    TempFile tmp;
+    writeScene(tmp.path(), vs, qs, records);
+    std::ifstream is(tmp.path().c_str(), std::ios::binary);
+    SceneHeader h;
+    is.read(reinterpret_cast<char *>(&h), sizeof(h));
+    std::vector<char> quad(sizeof(Quad));
+    is.seekg(h.quadOffset);
+    is.read(&quad[0], quad.size());
+    CPPUNIT_ASSERT(is);
+    for (size_t i = offsetof(Quad, isEmitter) + sizeof(bool);
+         i < offsetof(Quad, materialColour); ++i) {
+        CPPUNIT_ASSERT_EQUAL(0, static_cast<int>(quad[i]));
+    }
+}
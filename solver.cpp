@@ -0,0 +1,230 @@
+////////////////////////////////////////////////////////////////////////
+//
+// solver.cpp: Work out the transfers and iterate the lighting, either
+// in one go or in the background, publishing progress as it goes.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+#include "glut_wrap.h"
+#include "solver.h"
+#include "trace.h"
+#include "transfers.h"
+
+// Relative change in total light in the scene by the point we stop
+// iterating.
+static double const CONVERGENCE_TARGET = 0.001;
+
+// Resolution of the hemicube faces used for the transfers.
+static int const TRANSFER_RESOLUTION = 256;
+
+// While the transfers are calculated in the background, light the
+// scene with the rows done so far this often, or less often if it
+// would take more than a tenth of the time.
+static std::chrono::milliseconds const PROGRESS_INTERVAL(1000);
+static int const PROGRESS_DUTY = 10;
+
+////////////////////////////////////////////////////////////////////////
+// Radiosity calculations
+
+void iterateLighting(std::vector<Quad> &qs,
+                     std::vector<double> const &transfers,
+                     std::vector<char> const *ready)
+{
+    TRACE_SCOPE("iterateLighting");
+    int const n = qs.size();
+    std::vector<Colour> updatedColours(n);
+
+    // Iterate over targets
+    for (int i = 0; i < n; ++i) {
+        if (ready != NULL && !(*ready)[i]) {
+            updatedColours[i] = qs[i].screenColour;
+            continue;
+        }
+        Colour incoming;
+        if (qs[i].isEmitter) {
+            // Emission is just like having 1.0 light arrive.
+            incoming = Colour(1.0, 1.0, 1.0);
+        } else {
+            // Iterate over sources
+            double const *row = &transfers[static_cast<size_t>(i) * n];
+            for (int j = 0; j < n; ++j) {
+                if (i == j) {
+                    continue;
+                }
+                incoming += qs[j].screenColour * row[j];
+            }
+        }
+        updatedColours[i] = incoming * qs[i].materialColour;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        qs[i].screenColour = updatedColours[i];
+    }
+}
+
+double calcLight(std::vector<Quad> const &qs, std::vector<Vertex> const &vs)
+{
+    double totalLight = 0.0;
+    for (std::vector<Quad>::const_iterator iter = qs.begin(),
+             end = qs.end(); iter != end; ++iter) {
+        totalLight += iter->screenColour.asGrey() * paraArea(*iter, vs);
+    }
+    return totalLight;
+}
+
+////////////////////////////////////////////////////////////////////////
+// The solver
+
+Solver::Solver(std::vector<Vertex> const &vs,
+               std::vector<Quad> const &qs,
+               std::vector<SubdivInfo> const &subdivs,
+               int numThreads)
+    : m_vertices(vs),
+      m_faces(qs),
+      m_lit(qs),
+      m_subdivs(subdivs),
+      m_numThreads(std::max(numThreads, 1)),
+      m_rowReady(new std::atomic<bool>[qs.size()]),
+      m_rowsDone(0),
+      m_iterations(0),
+      m_totalLight(0.0),
+      m_transfersDone(false)
+{
+    for (int i = 0, n = qs.size(); i < n; ++i) {
+        m_rowReady[i] = false;
+    }
+}
+
+Solver::~Solver()
+{
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+void Solver::run()
+{
+    calcTransfers();
+    converge();
+}
+
+void Solver::start()
+{
+    m_thread = std::thread([this]() { solveInBackground(); });
+}
+
+SnapshotBuffer<SolverSnapshot> &Solver::snapshots()
+{
+    return m_snapshots;
+}
+
+std::vector<Quad> const &Solver::faces() const
+{
+    return m_lit;
+}
+
+void Solver::calcTransfers()
+{
+    RenderTransferCalculator calc(m_vertices, m_faces,
+                                  TRANSFER_RESOLUTION, m_numThreads);
+    calc.setUseAtlas(true);
+    calc.setBlocks(m_subdivs);
+    calc.setRowCallback([this](int row) {
+        m_rowReady[row] = true;
+        ++m_rowsDone;
+    });
+    calc.calcAllLights(m_transfers);
+}
+
+void Solver::solveInBackground()
+{
+    std::thread calc([this]() {
+        calcTransfers();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_transfersDone = true;
+        m_transfersDoneCond.notify_all();
+    });
+
+    auto transfersDone = [this]() { return m_transfersDone; };
+    std::chrono::steady_clock::duration wait = PROGRESS_INTERVAL;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_transfersDoneCond.wait_for(lock, wait, transfersDone)) {
+        lock.unlock();
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
+        litFromReadyRows();
+        publish(false);
+        wait = std::max<std::chrono::steady_clock::duration>(
+            PROGRESS_INTERVAL,
+            (std::chrono::steady_clock::now() - start) * PROGRESS_DUTY);
+        lock.lock();
+    }
+    lock.unlock();
+    calc.join();
+
+    // Start again from the unlit faces, so that the result's the same
+    // as run()'s.
+    m_lit = m_faces;
+    converge();
+}
+
+void Solver::litFromReadyRows()
+{
+    int const n = m_lit.size();
+    std::vector<char> ready(n);
+    bool any = false;
+    for (int i = 0; i < n; ++i) {
+        ready[i] = m_rowReady[i];
+        any = any || ready[i];
+    }
+    // The transfers may not even be allocated until a row's ready.
+    if (any) {
+        iterateLighting(m_lit, m_transfers, &ready);
+        m_totalLight = calcLight(m_lit, m_vertices);
+    }
+}
+
+void Solver::converge()
+{
+    double light = 0.0;
+    double relChange;
+    do {
+        iterateLighting(m_lit, m_transfers);
+        double newLight = calcLight(m_lit, m_vertices);
+        relChange = fabs(light / newLight - 1.0);
+        light = newLight;
+        m_totalLight = light;
+        ++m_iterations;
+        TRACE_COUNTER("total light", light);
+        std::cout << "Total light: " << light << std::endl;
+        if (relChange > CONVERGENCE_TARGET) {
+            publish(false);
+        }
+    } while (relChange > CONVERGENCE_TARGET);
+
+    // Only the lit faces are needed from here on.
+    std::vector<double>().swap(m_transfers);
+    publish(true);
+}
+
+void Solver::publish(bool finished)
+{
+    SolverSnapshot &s = m_snapshots.back();
+    int const n = m_lit.size();
+    s.colours.resize(n);
+    for (int i = 0; i < n; ++i) {
+        s.colours[i] = m_lit[i].screenColour;
+    }
+    s.rowsDone = m_rowsDone;
+    s.numRows = n;
+    s.iterations = m_iterations;
+    s.totalLight = m_totalLight;
+    s.finished = finished;
+    m_snapshots.publish();
+}
@@ -0,0 +1,174 @@
+////////////////////////////////////////////////////////////////////////
+//
+// solver.h: Work out the transfers and iterate the lighting, either
+// in one go or in the background, publishing progress as it goes.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#ifndef RADIOSITY_SOLVER_H
+#define RADIOSITY_SOLVER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "geom.h"
+
+// Light each face with what the others gave off last time. If
+// "ready" is given, only faces with their row of transfers marked
+// ready are updated, so partly-calculated transfers can be used.
+void iterateLighting(std::vector<Quad> &qs,
+                     std::vector<double> const &transfers,
+                     std::vector<char> const *ready = NULL);
+
+// Calculate the total light in the scene, as area-weight sum of
+// screenColour.
+double calcLight(std::vector<Quad> const &qs, std::vector<Vertex> const &vs);
+
+////////////////////////////////////////////////////////////////////////
+// Handing snapshots between threads
+
+// Passes the latest value from one writer thread to one reader
+// thread, without either ever waiting on the other. There are three
+// buffers: the writer fills one, the reader reads another, and the
+// third holds the latest published value. Publishing and picking up
+// are each a single atomic swap with the third.
+template<typename T>
+class SnapshotBuffer
+{
+public:
+    SnapshotBuffer()
+        : m_back(0),
+          m_middle(1),
+          m_front(2)
+    {
+    }
+
+    // Writer side: fill in back(), then publish() it.
+    T &back()
+    {
+        return m_buffers[m_back];
+    }
+
+    void publish()
+    {
+        m_back = m_middle.exchange(m_back | FRESH) & INDEX;
+    }
+
+    // Reader side: pick up the latest published value, if there's a
+    // new one, into front(). Returns whether there was.
+    bool update()
+    {
+        if ((m_middle.load() & FRESH) == 0) {
+            return false;
+        }
+        m_front = m_middle.exchange(m_front) & INDEX;
+        return true;
+    }
+
+    T const &front() const
+    {
+        return m_buffers[m_front];
+    }
+
+private:
+    static int const INDEX = 3;
+    static int const FRESH = 4;
+
+    T m_buffers[3];
+    // Only touched by the writer.
+    int m_back;
+    // The buffer in the middle, plus FRESH if it's not been read.
+    std::atomic<int> m_middle;
+    // Only touched by the reader.
+    int m_front;
+};
+
+// How a solve is going.
+struct SolverSnapshot
+{
+    SolverSnapshot()
+        : rowsDone(0), numRows(0), iterations(0), totalLight(0.0),
+          finished(false)
+    {
+    }
+
+    // The unnormalised screen colour of each face.
+    std::vector<Colour> colours;
+    // Rows of transfers calculated so far, out of numRows.
+    int rowsDone;
+    int numRows;
+    // Iterations run once all the transfers were done.
+    int iterations;
+    double totalLight;
+    // Set on the last snapshot, holding the final colours.
+    bool finished;
+};
+
+////////////////////////////////////////////////////////////////////////
+// The solver
+
+class Solver
+{
+public:
+    // Works on its own copy of the faces. The vertices must live as
+    // long as the solver. The subdivisions are only used to speed up
+    // calculating the transfers.
+    Solver(std::vector<Vertex> const &vs,
+           std::vector<Quad> const &qs,
+           std::vector<SubdivInfo> const &subdivs,
+           int numThreads);
+    ~Solver();
+
+    // Solve on this thread.
+    void run();
+
+    // Solve in the background, publishing snapshots as it goes. The
+    // transfers are calculated on threads of their own, so this
+    // needs offscreen contexts.
+    void start();
+
+    // Where the snapshots go, for one reader.
+    SnapshotBuffer<SolverSnapshot> &snapshots();
+
+    // The lit faces, once finished.
+    std::vector<Quad> const &faces() const;
+
+private:
+    void calcTransfers();
+    void solveInBackground();
+    // While the transfers are being calculated, light what we can
+    // with the rows done so far.
+    void litFromReadyRows();
+    void converge();
+    void publish(bool finished);
+
+    std::vector<Vertex> const &m_vertices;
+    // The faces as given, for calculating transfers, and the copy we
+    // light.
+    std::vector<Quad> const m_faces;
+    std::vector<Quad> m_lit;
+    std::vector<SubdivInfo> const &m_subdivs;
+    int const m_numThreads;
+
+    std::vector<double> m_transfers;
+    // Set as each row of transfers is finished.
+    std::unique_ptr<std::atomic<bool>[]> m_rowReady;
+    std::atomic<int> m_rowsDone;
+    int m_iterations;
+    double m_totalLight;
+
+    // Signalled once all the transfers are done.
+    std::mutex m_mutex;
+    std::condition_variable m_transfersDoneCond;
+    bool m_transfersDone;
+
+    SnapshotBuffer<SolverSnapshot> m_snapshots;
+    std::thread m_thread;
+};
+
+#endif // RADIOSITY_SOLVER_H
@@ -0,0 +1,164 @@
+////////////////////////////////////////////////////////////////////////
+//
+// solver_test.cpp: Tests for solver.cpp.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#include <cppunit/TestCase.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "geom.h"
+#include "glut_wrap.h"
+#include "solver.h"
+
+class SolverTestCase : public CppUnit::TestCase
+{
+private:
+    CPPUNIT_TEST_SUITE(SolverTestCase);
+    CPPUNIT_TEST(testSnapshotLatest);
+    CPPUNIT_TEST(testSnapshotThreads);
+    CPPUNIT_TEST(testIterateReadyRows);
+    CPPUNIT_TEST(testBackgroundMatchesRun);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testSnapshotLatest();
+    void testSnapshotThreads();
+    void testIterateReadyRows();
+    void testBackgroundMatchesRun();
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(SolverTestCase, "SolverTestCase");
+
+void SolverTestCase::testSnapshotLatest()
+{
+    SnapshotBuffer<int> buffer;
+    CPPUNIT_ASSERT(!buffer.update());
+
+    buffer.back() = 1;
+    buffer.publish();
+    buffer.back() = 2;
+    buffer.publish();
+    // Only the latest is seen, once.
+    CPPUNIT_ASSERT(buffer.update());
+    CPPUNIT_ASSERT_EQUAL(2, buffer.front());
+    CPPUNIT_ASSERT(!buffer.update());
+    CPPUNIT_ASSERT_EQUAL(2, buffer.front());
+
+    buffer.back() = 3;
+    buffer.publish();
+    CPPUNIT_ASSERT(buffer.update());
+    CPPUNIT_ASSERT_EQUAL(3, buffer.front());
+}
+
+void SolverTestCase::testSnapshotThreads()
+{
+    // Each snapshot is filled with one number, so a torn read would
+    // show up as a mix.
+    int const COUNT = 10000;
+    size_t const SIZE = 64;
+    SnapshotBuffer<std::vector<int> > buffer;
+    std::thread writer([&]() {
+        for (int i = 1; i <= COUNT; ++i) {
+            buffer.back().assign(SIZE, i);
+            buffer.publish();
+        }
+    });
+
+    int last = 0;
+    bool consistent = true;
+    while (last < COUNT) {
+        if (!buffer.update()) {
+            std::this_thread::yield();
+            continue;
+        }
+        std::vector<int> const &v = buffer.front();
+        consistent = consistent && v.size() == SIZE && v[0] > last;
+        for (size_t i = 0; i < SIZE && consistent; ++i) {
+            consistent = v[i] == v[0];
+        }
+        if (!consistent) {
+            break;
+        }
+        last = v[0];
+    }
+    writer.join();
+    CPPUNIT_ASSERT(consistent);
+}
+
+void SolverTestCase::testIterateReadyRows()
+{
+    // Three faces, each seeing half of the others' light.
+    std::vector<Quad> qs;
+    for (int i = 0; i < 3; ++i) {
+        qs.push_back(Quad(0, 1, 2, 3, Colour(1.0, 1.0, 1.0)));
+        qs[i].screenColour = Colour(0.5, 0.5, 0.5);
+    }
+    qs[0].isEmitter = true;
+    std::vector<double> transfers(9, 0.5);
+
+    std::vector<char> ready(3, 0);
+    ready[0] = ready[1] = 1;
+    iterateLighting(qs, transfers, &ready);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(1.0, qs[0].screenColour.r, 1e-12);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.5, qs[1].screenColour.r, 1e-12);
+    // Not ready, so left alone.
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.5, qs[2].screenColour.r, 1e-12);
+
+    iterateLighting(qs, transfers);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(1.0, qs[0].screenColour.r, 1e-12);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.75, qs[1].screenColour.r, 1e-12);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.75, qs[2].screenColour.r, 1e-12);
+}
+
+void SolverTestCase::testBackgroundMatchesRun()
+{
+#ifdef GW_OFFSCREEN
+    std::vector<Vertex> vertices(cubeVertices);
+    std::vector<Quad> quads;
+    std::vector<SubdivInfo> subdivs;
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        subdivs.push_back(subdivide(cubeFaces[i], vertices, quads, 4, 4));
+    }
+    // Light the middle of the top.
+    for (int i = 0, n = quads.size(); i < n; ++i) {
+        Vertex c = paraCentre(quads[i], vertices);
+        if (c.y() > 0.9 && fabs(c.x()) < 0.5 && fabs(c.z()) < 0.5) {
+            quads[i].isEmitter = true;
+            quads[i].screenColour = quads[i].materialColour;
+        }
+    }
+
+    Solver serial(vertices, quads, subdivs, 1);
+    serial.run();
+
+    Solver background(vertices, quads, subdivs, 2);
+    background.start();
+    SnapshotBuffer<SolverSnapshot> &snapshots = background.snapshots();
+    int lastRows = 0;
+    bool monotonic = true;
+    while (!snapshots.update() || !snapshots.front().finished) {
+        if (snapshots.front().rowsDone < lastRows) {
+            monotonic = false;
+        }
+        lastRows = snapshots.front().rowsDone;
+        std::this_thread::yield();
+    }
+    CPPUNIT_ASSERT(monotonic);
+
+    SolverSnapshot const &last = snapshots.front();
+    CPPUNIT_ASSERT_EQUAL(static_cast<int>(quads.size()), last.rowsDone);
+    CPPUNIT_ASSERT_EQUAL(static_cast<int>(quads.size()), last.numRows);
+    CPPUNIT_ASSERT(last.iterations > 1);
+    std::vector<Quad> const &expected = serial.faces();
+    for (int i = 0, n = quads.size(); i < n; ++i) {
+        CPPUNIT_ASSERT_EQUAL(expected[i].screenColour.r, last.colours[i].r);
+        CPPUNIT_ASSERT_EQUAL(expected[i].screenColour.g, last.colours[i].g);
+        CPPUNIT_ASSERT_EQUAL(expected[i].screenColour.b, last.colours[i].b);
+    }
+#endif
+}
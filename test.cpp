@@ -19,13 +19,33 @@
 #include <cppunit/TestCase.h>
 #include <cppunit/extensions/HelperMacros.h>
 
+#include "glut_wrap.h"
+
 CppUnit::Test *suite()
 {
     CppUnit::TestFactoryRegistry &registry =
         CppUnit::TestFactoryRegistry::getRegistry();
 
+    registry.registerFactory(
+        &CppUnit::TestFactoryRegistry::getRegistry("AccumulatorTestCase"));
+    registry.registerFactory(
+        &CppUnit::TestFactoryRegistry::getRegistry("DepthPyramidTestCase"));
     registry.registerFactory(
         &CppUnit::TestFactoryRegistry::getRegistry("GeomTestCase"));
+    registry.registerFactory(
+        &CppUnit::TestFactoryRegistry::getRegistry("ImageIOTestCase"));
+    registry.registerFactory(
+        &CppUnit::TestFactoryRegistry::getRegistry("ItemBufferTestCase"));
+    registry.registerFactory(
+        &CppUnit::TestFactoryRegistry::getRegistry("RasterTestCase"));
+    registry.registerFactory(
+        &CppUnit::TestFactoryRegistry::getRegistry("SceneFileTestCase"));
+    registry.registerFactory(
+        &CppUnit::TestFactoryRegistry::getRegistry("SolverTestCase"));
+    registry.registerFactory(
+        &CppUnit::TestFactoryRegistry::getRegistry("TraceTestCase"));
+    registry.registerFactory(
+        &CppUnit::TestFactoryRegistry::getRegistry("VecMathTestCase"));
     registry.registerFactory(
         &CppUnit::TestFactoryRegistry::getRegistry("WeightingTestCase"));
     registry.registerFactory(
@@ -36,7 +56,7 @@ CppUnit::Test *suite()
 
 int main(int argc, char* argv[])
 {
-    glutInit(&argc, argv);
+    gwInit(&argc, argv);
 
     // if command line contains "-selftest" then this is the post build check
     // => the output must be in the compiler error format.
@@ -0,0 +1,240 @@
+////////////////////////////////////////////////////////////////////////
+//
+// trace.cpp: Timing where the time goes.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include "trace.h"
+
+#ifdef RADIOSITY_TRACE
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+// How often progress is printed, in ns.
+static uint64_t const PROGRESS_INTERVAL = 1000000000;
+
+// A complete timed span ('X'), or a counter value ('C'), as in the
+// Chrome trace format.
+struct TraceEvent
+{
+    char const *name;
+    char phase;
+    uint64_t start;
+    uint64_t duration;
+    double value;
+};
+
+// Each thread appends to its own log, so recording takes no locks.
+// The logs are kept after their threads finish.
+struct ThreadLog
+{
+    int tid;
+    std::vector<TraceEvent> events;
+};
+
+struct Progress
+{
+    int total;
+    int done;
+    char const *unit;
+    uint64_t start;
+    uint64_t lastReport;
+};
+
+static std::mutex logsMutex;
+static std::vector<std::unique_ptr<ThreadLog> > logs;
+static thread_local ThreadLog *threadLog = NULL;
+
+static std::mutex progressMutex;
+static std::map<std::string, Progress> progress;
+
+// Nanoseconds since the first event.
+static uint64_t now()
+{
+    static std::chrono::steady_clock::time_point const epoch =
+        std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - epoch).count();
+}
+
+static ThreadLog &getLog()
+{
+    if (threadLog == NULL) {
+        std::lock_guard<std::mutex> lock(logsMutex);
+        logs.push_back(std::unique_ptr<ThreadLog>(new ThreadLog));
+        threadLog = logs.back().get();
+        threadLog->tid = logs.size();
+    }
+    return *threadLog;
+}
+
+static void addEvent(char const *name, char phase,
+                     uint64_t start, uint64_t duration, double value)
+{
+    TraceEvent e = { name, phase, start, duration, value };
+    getLog().events.push_back(e);
+}
+
+TraceScope::TraceScope(char const *name)
+    : m_name(name),
+      m_start(now())
+{
+}
+
+TraceScope::~TraceScope()
+{
+    addEvent(m_name, 'X', m_start, now() - m_start, 0.0);
+}
+
+void traceCounter(char const *name, double value)
+{
+    addEvent(name, 'C', now(), 0, value);
+}
+
+void traceProgressStart(char const *name, int total, char const *unit)
+{
+    std::lock_guard<std::mutex> lock(progressMutex);
+    uint64_t t = now();
+    Progress p = { total, 0, unit, t, t };
+    progress[name] = p;
+}
+
+void traceProgressStep(char const *name)
+{
+    std::lock_guard<std::mutex> lock(progressMutex);
+    std::map<std::string, Progress>::iterator iter = progress.find(name);
+    if (iter == progress.end()) {
+        return;
+    }
+    Progress &p = iter->second;
+    ++p.done;
+    uint64_t t = now();
+    if (t - p.lastReport < PROGRESS_INTERVAL && p.done != p.total) {
+        return;
+    }
+    p.lastReport = t;
+    double seconds = (t - p.start) * 1e-9;
+    double rate = p.done / std::max(seconds, 1e-9);
+    fprintf(stderr, "%s: %d/%d %s, %.1f %s/s, ETA %.1fs\n",
+            name, p.done, p.total, p.unit, rate, p.unit,
+            (p.total - p.done) / rate);
+    addEvent(name, 'C', t, 0, p.done);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Output
+
+struct ScopeStats
+{
+    ScopeStats() : calls(0), total(0), longest(0) {}
+
+    long calls;
+    uint64_t total;
+    uint64_t longest;
+};
+
+static void writeChromeTrace(std::string const &path)
+{
+    FILE *f = fopen(path.c_str(), "w");
+    if (f == NULL) {
+        throw std::runtime_error("Couldn't open trace " + path);
+    }
+    // Times are in microseconds.
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    char const *sep = "\n";
+    for (int i = 0, n = logs.size(); i < n; ++i) {
+        ThreadLog const &log = *logs[i];
+        fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", "
+                "\"pid\": 1, \"tid\": %d, "
+                "\"args\": {\"name\": \"thread %d\"}}",
+                sep, log.tid, log.tid);
+        sep = ",\n";
+        for (int j = 0, m = log.events.size(); j < m; ++j) {
+            TraceEvent const &e = log.events[j];
+            if (e.phase == 'X') {
+                fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", "
+                        "\"pid\": 1, \"tid\": %d, "
+                        "\"ts\": %.3f, \"dur\": %.3f}",
+                        e.name, log.tid, e.start * 1e-3, e.duration * 1e-3);
+            } else {
+                fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"C\", "
+                        "\"pid\": 1, \"ts\": %.3f, "
+                        "\"args\": {\"value\": %g}}",
+                        e.name, e.start * 1e-3, e.value);
+            }
+        }
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0) {
+        throw std::runtime_error("Couldn't write trace " + path);
+    }
+}
+
+static void printSummary()
+{
+    std::map<std::string, ScopeStats> stats;
+    std::map<std::string, double> counters;
+    for (int i = 0, n = logs.size(); i < n; ++i) {
+        std::vector<TraceEvent> const &events = logs[i]->events;
+        for (int j = 0, m = events.size(); j < m; ++j) {
+            TraceEvent const &e = events[j];
+            if (e.phase == 'X') {
+                ScopeStats &s = stats[e.name];
+                ++s.calls;
+                s.total += e.duration;
+                s.longest = std::max(s.longest, e.duration);
+            } else {
+                counters[e.name] = e.value;
+            }
+        }
+    }
+
+    // Busiest first.
+    std::vector<std::pair<uint64_t, std::string> > order;
+    for (std::map<std::string, ScopeStats>::const_iterator iter =
+             stats.begin(); iter != stats.end(); ++iter) {
+        order.push_back(std::make_pair(iter->second.total, iter->first));
+    }
+    std::sort(order.rbegin(), order.rend());
+
+    fprintf(stderr, "\nTrace after %.3fs:\n", now() * 1e-9);
+    fprintf(stderr, "%-28s %9s %12s %12s %12s\n",
+            "scope", "calls", "total ms", "mean us", "max us");
+    for (int i = 0, n = order.size(); i < n; ++i) {
+        ScopeStats const &s = stats[order[i].second];
+        fprintf(stderr, "%-28s %9ld %12.3f %12.3f %12.3f\n",
+                order[i].second.c_str(), s.calls, s.total * 1e-6,
+                s.total * 1e-3 / s.calls, s.longest * 1e-3);
+    }
+    for (std::map<std::string, double>::const_iterator iter =
+             counters.begin(); iter != counters.end(); ++iter) {
+        fprintf(stderr, "%-28s %g (last)\n",
+                iter->first.c_str(), iter->second);
+    }
+    std::lock_guard<std::mutex> lock(progressMutex);
+    for (std::map<std::string, Progress>::const_iterator iter =
+             progress.begin(); iter != progress.end(); ++iter) {
+        Progress const &p = iter->second;
+        double seconds = (p.lastReport - p.start) * 1e-9;
+        fprintf(stderr, "%-28s %d/%d %s in %.3fs, %.1f %s/s\n",
+                iter->first.c_str(), p.done, p.total, p.unit, seconds,
+                p.done / std::max(seconds, 1e-9), p.unit);
+    }
+}
+
+void traceWrite(std::string const &path)
+{
+    std::lock_guard<std::mutex> lock(logsMutex);
+    writeChromeTrace(path);
+    printSummary();
+}
+
+#endif // RADIOSITY_TRACE
@@ -0,0 +1,69 @@
+////////////////////////////////////////////////////////////////////////
+//
+// trace.h: Timing where the time goes. Scoped timers, counters and
+// progress reports, saved as a Chrome trace (for chrome://tracing or
+// Perfetto) with a summary table. Everything compiles to nothing
+// unless RADIOSITY_TRACE is defined.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#ifndef RADIOSITY_TRACE_H
+#define RADIOSITY_TRACE_H
+
+#ifdef RADIOSITY_TRACE
+
+#include <cstdint>
+#include <string>
+
+// Records the time from construction to destruction as an event on
+// the current thread. The name must outlive the trace, so use a
+// literal.
+class TraceScope
+{
+public:
+    explicit TraceScope(char const *name);
+    ~TraceScope();
+
+private:
+    TraceScope(TraceScope const &);
+    TraceScope &operator=(TraceScope const &);
+
+    char const *m_name;
+    uint64_t m_start;
+};
+
+// Record the value of a counter at this point.
+void traceCounter(char const *name, double value);
+
+// Start a job of "total" steps, each one of "unit", then call
+// traceProgressStep after each, from any thread. Progress, rate and
+// ETA are printed about once a second.
+void traceProgressStart(char const *name, int total, char const *unit);
+void traceProgressStep(char const *name);
+
+// Save all the events so far as a Chrome trace, and print a summary
+// to stderr. Other threads shouldn't be recording at the time.
+void traceWrite(std::string const &path);
+
+#define TRACE_JOIN2(a, b) a ## b
+#define TRACE_JOIN(a, b) TRACE_JOIN2(a, b)
+
+#define TRACE_SCOPE(name) TraceScope TRACE_JOIN(traceScope, __LINE__)(name)
+#define TRACE_COUNTER(name, value) traceCounter(name, value)
+#define TRACE_PROGRESS_START(name, total, unit) \
+    traceProgressStart(name, total, unit)
+#define TRACE_PROGRESS_STEP(name) traceProgressStep(name)
+#define TRACE_WRITE(path) traceWrite(path)
+
+#else
+
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_COUNTER(name, value) ((void)0)
+#define TRACE_PROGRESS_START(name, total, unit) ((void)0)
+#define TRACE_PROGRESS_STEP(name) ((void)0)
+#define TRACE_WRITE(path) ((void)0)
+
+#endif // RADIOSITY_TRACE
+
+#endif // RADIOSITY_TRACE_H
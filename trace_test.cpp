@@ -0,0 +1,67 @@
+////////////////////////////////////////////////////////////////////////
+//
+// trace_test.cpp: Tests for trace.cpp. Only does anything when built
+// with RADIOSITY_TRACE.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+
+#include <cppunit/TestCase.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "trace.h"
+
+class TraceTestCase : public CppUnit::TestCase
+{
+private:
+    CPPUNIT_TEST_SUITE(TraceTestCase);
+    CPPUNIT_TEST(testChromeTrace);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testChromeTrace();
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TraceTestCase, "TraceTestCase");
+
+void TraceTestCase::testChromeTrace()
+{
+#ifdef RADIOSITY_TRACE
+    char const *const path = "/tmp/trace_test.json";
+    {
+        TRACE_SCOPE("trace test outer");
+        TRACE_SCOPE("trace test inner");
+        TRACE_COUNTER("trace test counter", 42);
+    }
+    // Another thread gets its own track.
+    std::thread other([]() { TRACE_SCOPE("trace test thread"); });
+    other.join();
+    TRACE_PROGRESS_START("trace test progress", 2, "steps");
+    TRACE_PROGRESS_STEP("trace test progress");
+    TRACE_PROGRESS_STEP("trace test progress");
+    TRACE_WRITE(path);
+
+    std::ifstream is(path);
+    std::string json((std::istreambuf_iterator<char>(is)),
+                     std::istreambuf_iterator<char>());
+    CPPUNIT_ASSERT_EQUAL(size_t(0), json.find("{\"displayTimeUnit\""));
+    CPPUNIT_ASSERT(json.find("\"trace test outer\", \"ph\": \"X\"") !=
+                   std::string::npos);
+    CPPUNIT_ASSERT(json.find("\"trace test inner\", \"ph\": \"X\"") !=
+                   std::string::npos);
+    CPPUNIT_ASSERT(json.find("\"trace test thread\", \"ph\": \"X\"") !=
+                   std::string::npos);
+    CPPUNIT_ASSERT(json.find("\"args\": {\"value\": 42}") !=
+                   std::string::npos);
+    // The finished progress is recorded as a counter.
+    CPPUNIT_ASSERT(json.find("\"trace test progress\", \"ph\": \"C\"") !=
+                   std::string::npos);
+    CPPUNIT_ASSERT(json.find("\n]}\n") != std::string::npos);
+    remove(path);
+#endif
+}
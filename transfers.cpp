@@ -11,16 +11,26 @@
 
 #ifdef __APPLE__
 #include <GLUT/glut.h>
+#include <OpenGL/glext.h>
 #else
+#define GL_GLEXT_PROTOTYPES
 #include <GL/glut.h>
 #endif
 
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <stdexcept>
+#include <utility>
 #include <vector>
 
+#include "accumulator.h"
 #include "geom.h"
 #include "glut_wrap.h"
+#include "parallel.h"
+#include "trace.h"
 #include "transfers.h"
 #include "weighting.h"
 
@@ -70,71 +80,950 @@ static void viewDown(void)
 // Use scene rendering to calculate the transfer functions.
 //
 
+// Can we keep the readback buffers mapped the whole time?
+static bool hasPersistentMapping()
+{
+#ifdef GL_MAP_PERSISTENT_BIT
+    char const *exts =
+        reinterpret_cast<char const *>(glGetString(GL_EXTENSIONS));
+    return exts != NULL && strstr(exts, "GL_ARB_buffer_storage") != NULL;
+#else
+    return false;
+#endif
+}
+
 RenderTransferCalculator::RenderTransferCalculator(
     std::vector<Vertex> const &vertices,
     std::vector<Quad> const &faces,
-    int resolution)
+    int resolution,
+    int threads)
     : m_vertices(vertices),
       m_faces(faces),
       m_resolution(resolution),
-      m_win(gwTransferSetup(resolution))
+      m_win(gwTransferSetup(resolution)),
+      m_sceneVbo(0),
+      m_occlusionCulling(false),
+      m_splatThreshold(0.0),
+      m_numSplatViews(0),
+      m_jitterRotate(false),
+      m_eyeJitter(0.0),
+      m_coherent(false),
+      m_progress(true),
+      m_multiResTile(0),
+      m_atlasFbo(0),
+      m_accumulator(faces.size()),
+      m_nextPbo(0),
+      m_numPending(0)
 {
+    uploadGeometry();
+    // Each buffer can hold a whole face.
+    createReadBuffers(resolution * resolution);
+
+#ifdef GW_OFFSCREEN
+    for (int i = 1; i < threads; ++i) {
+        m_helpers.push_back(
+            new RenderTransferCalculator(vertices, faces, resolution));
+    }
+    gwMakeCurrent(m_win);
+#else
+    (void)threads;
+#endif
 }
 
 RenderTransferCalculator::~RenderTransferCalculator()
 {
-    glutDestroyWindow(m_win);
+    gwMakeCurrent(m_win);
+    deleteReadBuffers();
+    glDeleteBuffers(1, &m_sceneVbo);
+    if (m_atlasFbo != 0) {
+        glDeleteRenderbuffers(2, m_atlasRenderbuffers);
+        glDeleteFramebuffers(1, &m_atlasFbo);
+    }
+    gwContextTeardown(m_win);
+
+    for (int i = 0, n = m_helpers.size(); i < n; ++i) {
+        delete m_helpers[i];
+    }
+}
+
+void RenderTransferCalculator::createReadBuffers(int pixels)
+{
+    GLsizeiptr const size = NUM_CHANS * pixels;
+    bool const persistent = hasPersistentMapping();
+
+    glGenBuffers(NUM_PBOS, m_pbos);
+    for (int i = 0; i < NUM_PBOS; ++i) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbos[i]);
+        m_maps[i] = NULL;
+#ifdef GL_MAP_PERSISTENT_BIT
+        m_fences[i] = NULL;
+        if (persistent) {
+            GLbitfield const flags =
+                GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_PIXEL_PACK_BUFFER, size, NULL, flags);
+            m_maps[i] = static_cast<GLubyte *>(
+                glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, flags));
+            continue;
+        }
+#endif
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+void RenderTransferCalculator::deleteReadBuffers()
+{
+    flushReads();
+#ifdef GL_MAP_PERSISTENT_BIT
+    for (int i = 0; i < NUM_PBOS; ++i) {
+        if (m_fences[i] != NULL) {
+            glDeleteSync(m_fences[i]);
+        }
+    }
+#endif
+    glDeleteBuffers(NUM_PBOS, m_pbos);
+}
+
+void RenderTransferCalculator::setUseAtlas(bool useAtlas)
+{
+    for (int i = 0, n = m_helpers.size(); i < n; ++i) {
+        gwMakeCurrent(m_helpers[i]->m_win);
+        m_helpers[i]->setUseAtlas(useAtlas);
+    }
+    gwMakeCurrent(m_win);
+
+    if (useAtlas == (m_atlasFbo != 0)) {
+        return;
+    }
+
+    // The atlas has the front face on the bottom, with the four
+    // half-faces stacked above it, so it's 3 faces' worth of pixels.
+    int const width = m_resolution;
+    int const height = 3 * m_resolution;
+
+    deleteReadBuffers();
+    if (useAtlas) {
+        GLint prevFbo;
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prevFbo);
+
+        glGenFramebuffers(1, &m_atlasFbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, m_atlasFbo);
+        glGenRenderbuffers(2, m_atlasRenderbuffers);
+        glBindRenderbuffer(GL_RENDERBUFFER, m_atlasRenderbuffers[0]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                  GL_RENDERBUFFER, m_atlasRenderbuffers[0]);
+        glBindRenderbuffer(GL_RENDERBUFFER, m_atlasRenderbuffers[1]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24,
+                              width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                                  GL_RENDERBUFFER, m_atlasRenderbuffers[1]);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+        glBindFramebuffer(GL_FRAMEBUFFER, prevFbo);
+        if (status != GL_FRAMEBUFFER_COMPLETE) {
+            throw std::runtime_error("Couldn't create atlas framebuffer");
+        }
+
+        createReadBuffers(width * height);
+    } else {
+        glDeleteRenderbuffers(2, m_atlasRenderbuffers);
+        glDeleteFramebuffers(1, &m_atlasFbo);
+        m_atlasFbo = 0;
+
+        createReadBuffers(m_resolution * m_resolution);
+    }
+}
+
+static bool byFaceStart(SubdivInfo const *a, SubdivInfo const *b)
+{
+    return a->faceStart() < b->faceStart();
+}
+
+void RenderTransferCalculator::setBlocks(
+    std::vector<SubdivInfo> const &blocks)
+{
+    // Split the blocks into tiles, so that there's a decent chance
+    // of culling some of each.
+    int const TILE_SIZE = 8;
+
+    for (int i = 0, n = m_helpers.size(); i < n; ++i) {
+        m_helpers[i]->setBlocks(blocks);
+    }
+
+    std::vector<SubdivInfo const *> sorted;
+    for (int i = 0, n = blocks.size(); i < n; ++i) {
+        sorted.push_back(&blocks[i]);
+    }
+    std::sort(sorted.begin(), sorted.end(), byFaceStart);
+
+    // Fill in the gaps with blocks that only get frustum-culled.
+    m_blocks.clear();
+    int next = 0;
+    for (int i = 0, n = sorted.size(); i < n; ++i) {
+        int const start = sorted[i]->faceStart();
+        int const uCount = sorted[i]->uCount();
+        int const vCount = sorted[i]->faceCount() / uCount;
+        if (start > next) {
+            addBlock(next, start - next, 1, 0, false);
+        }
+        for (int v = 0; v < vCount; v += TILE_SIZE) {
+            for (int u = 0; u < uCount; u += TILE_SIZE) {
+                addBlock(start + v * uCount + u,
+                         std::min(TILE_SIZE, uCount - u),
+                         std::min(TILE_SIZE, vCount - v),
+                         uCount,
+                         true);
+            }
+        }
+        next = start + uCount * vCount;
+    }
+    if (next < static_cast<int>(m_faces.size())) {
+        addBlock(next, m_faces.size() - next, 1, 0, false);
+    }
+}
+
+void RenderTransferCalculator::setOcclusionCulling(bool occlusionCulling)
+{
+    for (int i = 0, n = m_helpers.size(); i < n; ++i) {
+        m_helpers[i]->setOcclusionCulling(occlusionCulling);
+    }
+    m_occlusionCulling = occlusionCulling;
+}
+
+void RenderTransferCalculator::addBlock(int faceStart,
+                                        int runLength,
+                                        int runCount,
+                                        int runStride,
+                                        bool isPlanar)
+{
+    Block b;
+    b.faceStart = faceStart;
+    b.runLength = runLength;
+    b.runCount = runCount;
+    b.runStride = runStride;
+    b.isPlanar = isPlanar;
+
+    Vertex const &first = m_vertices[m_faces[faceStart].indices[0]];
+    for (int k = 0; k < 3; ++k) {
+        b.lo[k] = b.hi[k] = first.p[k];
+    }
+    for (int r = 0; r < runCount; ++r) {
+        int const runStart = faceStart + r * runStride;
+        for (int i = runStart; i < runStart + runLength; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                Vertex const &v = m_vertices[m_faces[i].indices[j]];
+                for (int k = 0; k < 3; ++k) {
+                    b.lo[k] = std::min(b.lo[k], v.p[k]);
+                    b.hi[k] = std::max(b.hi[k], v.p[k]);
+                }
+            }
+        }
+    }
+
+    b.maxSize = 0.0;
+    for (int r = 0; r < runCount; ++r) {
+        int const runStart = faceStart + r * runStride;
+        for (int i = runStart; i < runStart + runLength; ++i) {
+            b.maxSize = std::max(b.maxSize,
+                                 sqrt(paraArea(m_faces[i], m_vertices)));
+        }
+    }
+
+    if (isPlanar) {
+        // Cameras look along the negative of the cross product, so
+        // that's the front side.
+        Vertex n = paraCross(m_faces[faceStart], m_vertices).norm();
+        for (int k = 0; k < 3; ++k) {
+            b.normal[k] = n.p[k];
+        }
+        b.offset = dot(n, paraCentre(m_faces[faceStart], m_vertices));
+
+        // Faces from subdivide have their corners in order round the
+        // grid square, starting at the low u and v corner.
+        int const lastRun = faceStart + (runCount - 1) * runStride;
+        b.corners[0] = m_faces[faceStart].indices[0];
+        b.corners[1] = m_faces[faceStart + runLength - 1].indices[1];
+        b.corners[2] = m_faces[lastRun + runLength - 1].indices[2];
+        b.corners[3] = m_faces[lastRun].indices[3];
+    }
+
+    m_blocks.push_back(b);
+}
+
+void RenderTransferCalculator::setMultiResolution(int tileSize)
+{
+    if (tileSize > 0 && m_resolution % (2 * tileSize) != 0) {
+        throw std::runtime_error(
+            "Resolution must be a multiple of twice the tile size");
+    }
+    for (int i = 0, n = m_helpers.size(); i < n; ++i) {
+        m_helpers[i]->setMultiResolution(tileSize);
+    }
+    m_multiResTile = tileSize;
+    m_coarseAtlasLightWeights.clear();
+}
+
+void RenderTransferCalculator::setJitter(bool rotate, double eyeJitter)
+{
+    for (int i = 0, n = m_helpers.size(); i < n; ++i) {
+        m_helpers[i]->setJitter(rotate, eyeJitter);
+    }
+    m_jitterRotate = rotate;
+    m_eyeJitter = eyeJitter;
+}
+
+void RenderTransferCalculator::setCoherent(bool coherent)
+{
+    for (int i = 0, n = m_helpers.size(); i < n; ++i) {
+        m_helpers[i]->setCoherent(coherent);
+    }
+    m_coherent = coherent;
+}
+
+void RenderTransferCalculator::setRowCallback(
+    std::function<void(int)> const &callback)
+{
+    for (int i = 0, n = m_helpers.size(); i < n; ++i) {
+        m_helpers[i]->setRowCallback(callback);
+    }
+    m_rowCallback = callback;
+}
+
+void RenderTransferCalculator::setProgress(bool progress)
+{
+    for (int i = 0, n = m_helpers.size(); i < n; ++i) {
+        m_helpers[i]->setProgress(progress);
+    }
+    m_progress = progress;
 }
 
-// Extremely simple rendering of the scene.
+void RenderTransferCalculator::setSplatThreshold(double pixels)
+{
+    for (int i = 0, n = m_helpers.size(); i < n; ++i) {
+        m_helpers[i]->setSplatThreshold(pixels);
+    }
+    m_splatThreshold = pixels;
+}
+
+// Largest value of dot(v, p) over the points p in the block's box.
+static double maxDot(double const *lo, double const *hi, double const *v)
+{
+    double d = 0.0;
+    for (int k = 0; k < 3; ++k) {
+        d += v[k] * (v[k] > 0.0 ? hi[k] : lo[k]);
+    }
+    return d;
+}
+
+void RenderTransferCalculator::cullBlocks(Camera const &cam, bool hemisphere)
+{
+    // Anything this close to a block's plane sees it edge-on, which
+    // covers the receiver's own wall.
+    double const EPSILON = 1.0e-9;
+
+    Vertex const eye = cam.getEyePos();
+    Vertex const look = cam.getLookAt() - eye;
+    double const lookEye = dot(look, eye);
+
+    m_visibleBlocks.clear();
+    for (int i = 0, n = m_blocks.size(); i < n; ++i) {
+        Block const &b = m_blocks[i];
+        if (b.isPlanar) {
+            double const d = b.normal[0] * eye.x() +
+                             b.normal[1] * eye.y() +
+                             b.normal[2] * eye.z();
+            if (d - b.offset > -EPSILON) {
+                continue;
+            }
+        }
+        if (hemisphere && maxDot(b.lo, b.hi, look.p) <= lookEye) {
+            continue;
+        }
+        m_visibleBlocks.push_back(i);
+    }
+}
+
+// Copy the scene into a vertex buffer once, so that each view is a
+// single draw call. Each quad gets its own four vertices, coloured
+// with its index.
+void RenderTransferCalculator::uploadGeometry()
+{
+    int const n = m_faces.size();
+    std::vector<GLfloat> positions;
+    std::vector<GLubyte> colours;
+    positions.reserve(n * 4 * 3);
+    colours.reserve(n * 4 * NUM_CHANS);
+
+    for (int i = 0; i < n; ++i) {
+        // Index 0 is reserved for the background.
+        GLubyte rgba[NUM_CHANS];
+        encodePolyIndex(i + 1, rgba);
+        for (int j = 0; j < 4; ++j) {
+            Vertex const &v = m_vertices[m_faces[i].indices[j]];
+            positions.push_back(v.x());
+            positions.push_back(v.y());
+            positions.push_back(v.z());
+            colours.insert(colours.end(), rgba, rgba + NUM_CHANS);
+        }
+    }
+
+    GLsizeiptr const positionSize = positions.size() * sizeof(GLfloat);
+    GLsizeiptr const colourSize = colours.size() * sizeof(GLubyte);
+    glGenBuffers(1, &m_sceneVbo);
+    glBindBuffer(GL_ARRAY_BUFFER, m_sceneVbo);
+    glBufferData(GL_ARRAY_BUFFER, positionSize + colourSize, NULL,
+                 GL_STATIC_DRAW);
+    if (n > 0) {
+        glBufferSubData(GL_ARRAY_BUFFER, 0, positionSize, &positions[0]);
+        glBufferSubData(GL_ARRAY_BUFFER, positionSize, colourSize,
+                        &colours[0]);
+    }
+
+    // Nothing else draws in this context, so the arrays can stay
+    // enabled and bound.
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, 0);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glColorPointer(NUM_CHANS, GL_UNSIGNED_BYTE, 0,
+                   reinterpret_cast<GLvoid const *>(positionSize));
+}
+
+// Allow for depth buffer precision when comparing depths read back
+// with ones we've projected ourselves.
+static float const DEPTH_EPSILON = 1.0e-6f;
+
+// out = a * b, for GL-style column-major 4x4 matrices.
+static void multMatrix(double const *a, double const *b, double *out)
+{
+    for (int c = 0; c < 4; ++c) {
+        for (int r = 0; r < 4; ++r) {
+            double sum = 0.0;
+            for (int k = 0; k < 4; ++k) {
+                sum += a[k * 4 + r] * b[c * 4 + k];
+            }
+            out[c * 4 + r] = sum;
+        }
+    }
+}
+
+// Get the matrix taking world space to clip space, in GL's
+// column-major order.
+static void getClipMatrix(double *clip)
+{
+    GLdouble proj[16];
+    GLdouble model[16];
+    glGetDoublev(GL_PROJECTION_MATRIX, proj);
+    glGetDoublev(GL_MODELVIEW_MATRIX, model);
+    multMatrix(proj, model, clip);
+}
+
+// Transform a point to clip space.
+static void toClip(double const *clip, double const *p, double *out)
+{
+    for (int r = 0; r < 4; ++r) {
+        out[r] = clip[r] * p[0] + clip[4 + r] * p[1] +
+                 clip[8 + r] * p[2] + clip[12 + r];
+    }
+}
+
+// Transform a point to window coordinates for a face of the given
+// resolution, with x and y in pixels and z the depth. Returns false
+// if it's behind the eye.
+static bool toWindow(double const *clip,
+                     double const *p,
+                     int resolution,
+                     double *win)
+{
+    double out[4];
+    toClip(clip, p, out);
+    if (out[3] <= 0.0) {
+        return false;
+    }
+    win[0] = (out[0] / out[3] + 1.0) * 0.5 * resolution;
+    win[1] = (out[1] / out[3] + 1.0) * 0.5 * resolution;
+    win[2] = (out[2] / out[3] + 1.0) * 0.5;
+    return true;
+}
+
+// Extremely simple rendering of the scene. If we have blocks, only
+// draw the ones that passed cullBlocks and are in the view frustum.
 void RenderTransferCalculator::render(void)
 {
-    for (int i = 0, n = m_faces.size(); i < n; ++i) {
-        m_faces[i].renderIndex(i + 1, m_vertices);
+    if (m_blocks.empty()) {
+        glDrawArrays(GL_QUADS, 0, 4 * m_faces.size());
+        return;
+    }
+
+    // Get the clip-space matrix, and pull the frustum planes out of
+    // it. Everything inside has dot(plane, (x, y, z, 1)) >= 0.
+    double clip[16];
+    getClipMatrix(clip);
+    double planes[6][4];
+    for (int i = 0; i < 6; ++i) {
+        int const row = i / 2;
+        double const sign = i % 2 == 0 ? 1.0 : -1.0;
+        for (int c = 0; c < 4; ++c) {
+            planes[i][c] = clip[c * 4 + 3] + sign * clip[c * 4 + row];
+        }
+    }
+
+    m_frustumBlocks.clear();
+    for (int i = 0, n = m_visibleBlocks.size(); i < n; ++i) {
+        Block const &b = m_blocks[m_visibleBlocks[i]];
+        bool outside = false;
+        for (int j = 0; j < 6 && !outside; ++j) {
+            outside = maxDot(b.lo, b.hi, planes[j]) + planes[j][3] < 0.0;
+        }
+        if (!outside) {
+            m_frustumBlocks.push_back(m_visibleBlocks[i]);
+        }
+    }
+
+    if (m_occlusionCulling) {
+        drawUnoccluded(clip, m_frustumBlocks);
+    } else {
+        drawBlocks(m_frustumBlocks);
+    }
+    if (!m_splatBlocks.empty()) {
+        drawSplatProxies();
     }
 }
 
-static const int NUM_CHANS = 4;
+void RenderTransferCalculator::drawSplatProxies()
+{
+    // Index 0, the background.
+    glColor3ub(0, 0, 0);
+    glBegin(GL_QUADS);
+    for (int i = 0, n = m_splatBlocks.size(); i < n; ++i) {
+        Block const &b = m_blocks[m_splatBlocks[i]];
+        for (int j = 0; j < 4; ++j) {
+            glVertex3dv(m_vertices[b.corners[j]].p);
+        }
+    }
+    glEnd();
+}
 
-// Sum up value of the pixels, with the given weights.
-void RenderTransferCalculator::sumWeights(std::vector<double> const &weights)
+void RenderTransferCalculator::drawBlocks(std::vector<int> const &blocks)
 {
-    std::vector<GLubyte> pixels(NUM_CHANS * weights.size());
-    glReadPixels(0, 0, m_resolution, weights.size() / m_resolution,
-                 GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+    // Collect the runs of vertices, and merge the adjacent ones.
+    m_drawRuns.clear();
+    for (int i = 0, n = blocks.size(); i < n; ++i) {
+        Block const &b = m_blocks[blocks[i]];
+        for (int r = 0; r < b.runCount; ++r) {
+            m_drawRuns.push_back(std::make_pair(
+                4 * (b.faceStart + r * b.runStride), 4 * b.runLength));
+        }
+    }
+    std::sort(m_drawRuns.begin(), m_drawRuns.end());
 
-    for (int i = 0, n = pixels.size(); i < n; i += NUM_CHANS) {
-        // We're not using that many polys, so skip the low bits.
-        int index = (pixels[i] + (pixels[i+1] << 6) + (pixels[i+2] << 12)) >> 2;
-        if (index > 0) {
-            m_sums[index - 1] += weights[i/4];
+    m_drawFirsts.clear();
+    m_drawCounts.clear();
+    for (int i = 0, n = m_drawRuns.size(); i < n; ++i) {
+        GLint const first = m_drawRuns[i].first;
+        GLsizei const count = m_drawRuns[i].second;
+        if (!m_drawFirsts.empty() &&
+            m_drawFirsts.back() + m_drawCounts.back() == first) {
+            m_drawCounts.back() += count;
+        } else {
+            m_drawFirsts.push_back(first);
+            m_drawCounts.push_back(count);
         }
     }
+
+    if (!m_drawFirsts.empty()) {
+        glMultiDrawArrays(GL_QUADS, &m_drawFirsts[0], &m_drawCounts[0],
+                          m_drawFirsts.size());
+    }
 }
 
-// Work out contributions from the given face.
-void RenderTransferCalculator::calcFace(
-    Camera const &cam,
-    viewFn_t view,
-    std::vector<double> const &weights)
+// Hierarchical-Z culling: draw the blocks likely to hide things,
+// read back the depth, and only draw the rest if some part of their
+// bounding box might be in front of what's there.
+void RenderTransferCalculator::drawUnoccluded(double const *clip,
+                                              std::vector<int> const &blocks)
+{
+    // Blocks covering this fraction of the view are drawn up front.
+    double const OCCLUDER_FRACTION = 1.0 / 16.0;
+
+    // Only the scissored part of the viewport gets cleared and drawn.
+    GLint view[4];
+    glGetIntegerv(GL_VIEWPORT, view);
+    GLint box[4] = { view[0], view[1], view[0] + view[2], view[1] + view[3] };
+    if (glIsEnabled(GL_SCISSOR_TEST)) {
+        GLint scissor[4];
+        glGetIntegerv(GL_SCISSOR_BOX, scissor);
+        box[0] = std::max(box[0], scissor[0]);
+        box[1] = std::max(box[1], scissor[1]);
+        box[2] = std::min(box[2], scissor[0] + scissor[2]);
+        box[3] = std::min(box[3], scissor[1] + scissor[3]);
+    }
+    int const width = box[2] - box[0];
+    int const height = box[3] - box[1];
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+
+    // Work out the screen bounds and nearest depth of each block.
+    struct Bounds {
+        int x0, y0, x1, y1;
+        float depth;
+    };
+    std::vector<Bounds> bounds(blocks.size());
+    m_occluders.clear();
+    m_occludees.clear();
+    for (int i = 0, n = blocks.size(); i < n; ++i) {
+        Block const &b = m_blocks[blocks[i]];
+        double minX = 1.0e30, minY = 1.0e30, minZ = 1.0e30;
+        double maxX = -1.0e30, maxY = -1.0e30;
+        bool crossesEye = false;
+        for (int c = 0; c < 8 && !crossesEye; ++c) {
+            double const p[3] = { c & 1 ? b.hi[0] : b.lo[0],
+                                  c & 2 ? b.hi[1] : b.lo[1],
+                                  c & 4 ? b.hi[2] : b.lo[2] };
+            double out[4];
+            toClip(clip, p, out);
+            if (out[3] <= 1.0e-9) {
+                crossesEye = true;
+                break;
+            }
+            double const x = view[0] + (out[0] / out[3] + 1.0) * 0.5 * view[2];
+            double const y = view[1] + (out[1] / out[3] + 1.0) * 0.5 * view[3];
+            double const z = (out[2] / out[3] + 1.0) * 0.5;
+            minX = std::min(minX, x);
+            maxX = std::max(maxX, x);
+            minY = std::min(minY, y);
+            maxY = std::max(maxY, y);
+            minZ = std::min(minZ, z);
+        }
+
+        // Blocks that wrap round the eye can't be tested, so just
+        // draw them.
+        if (crossesEye) {
+            m_occluders.push_back(blocks[i]);
+            continue;
+        }
+
+        Bounds &bb = bounds[i];
+        bb.x0 = std::max(box[0], static_cast<int>(floor(minX))) - box[0];
+        bb.y0 = std::max(box[1], static_cast<int>(floor(minY))) - box[1];
+        bb.x1 = std::min(box[2], static_cast<int>(ceil(maxX))) - box[0];
+        bb.y1 = std::min(box[3], static_cast<int>(ceil(maxY))) - box[1];
+        bb.depth = minZ;
+        if (bb.x0 >= bb.x1 || bb.y0 >= bb.y1) {
+            // Outside the drawn area.
+            continue;
+        }
+        double const area =
+            static_cast<double>(bb.x1 - bb.x0) * (bb.y1 - bb.y0);
+        if (area >= OCCLUDER_FRACTION * width * height) {
+            m_occluders.push_back(blocks[i]);
+        } else {
+            m_occludees.push_back(i);
+        }
+    }
+
+    drawBlocks(m_occluders);
+    if (m_occludees.empty()) {
+        return;
+    }
+
+    m_depthPixels.resize(width * height);
+    glReadPixels(box[0], box[1], width, height,
+                 GL_DEPTH_COMPONENT, GL_FLOAT, &m_depthPixels[0]);
+    m_depthPyramid.build(&m_depthPixels[0], width, height);
+
+    m_unoccluded.clear();
+    for (int i = 0, n = m_occludees.size(); i < n; ++i) {
+        Bounds const &bb = bounds[m_occludees[i]];
+        float const maxDepth =
+            m_depthPyramid.maxDepth(bb.x0, bb.y0, bb.x1, bb.y1);
+        if (bb.depth <= maxDepth + DEPTH_EPSILON) {
+            m_unoccluded.push_back(blocks[m_occludees[i]]);
+        }
+    }
+    drawBlocks(m_unoccluded);
+}
+
+// Point the camera at the given face.
+void RenderTransferCalculator::setView(Camera const &cam, viewFn_t view)
 {
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
     view();
     cam.applyViewTransform();
+}
+
+// Work out contributions from the given face.
+void RenderTransferCalculator::calcFace(
+    Camera const &cam,
+    viewFn_t view,
+    std::vector<float> const &weights)
+{
+    TRACE_SCOPE("render face");
+    setView(cam, view);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     render();
-    sumWeights(weights);
+    startRead(weights);
     // glutSwapBuffers is unnecessary for offscreen calculation.
 }
 
+// Render the given face into the atlas, with the bottom of the face
+// at row "y", and only drawing the given number of rows. Faces are
+// "size" pixels square.
+void RenderTransferCalculator::calcAtlasFace(
+    Camera const &cam,
+    viewFn_t view,
+    int y,
+    int rows,
+    int size)
+{
+    glViewport(0, y, size, size);
+    glScissor(0, y, size, rows);
+    setView(cam, view);
+    render();
+    if (!m_splatBlocks.empty() && size == m_resolution) {
+        captureSplatView(y, rows, false);
+    }
+}
+
+// Render all the faces into the atlas, at the given face size.
+void RenderTransferCalculator::renderAtlasFaces(Camera const &cam, int size)
+{
+    int const half = size / 2;
+
+    glEnable(GL_SCISSOR_TEST);
+    calcAtlasFace(cam, viewFront, 0,            size, size);
+    calcAtlasFace(cam, viewRight, size,            half, size);
+    calcAtlasFace(cam, viewLeft,  size + half,     half, size);
+    calcAtlasFace(cam, viewUp,    size + 2 * half, half, size);
+    calcAtlasFace(cam, viewDown,  size + 3 * half, half, size);
+    glDisable(GL_SCISSOR_TEST);
+}
+
+// Like calcLight, but render the whole hemicube into the atlas, and
+// then read and sum it in one go.
+void RenderTransferCalculator::calcAtlasLight(Camera const &cam)
+{
+    TRACE_SCOPE("render atlas");
+    GLint prevFbo;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &prevFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_atlasFbo);
+
+    glViewport(0, 0, m_resolution, 3 * m_resolution);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    if (m_multiResTile > 0) {
+        calcCoarseAtlasLight(cam);
+    }
+    renderAtlasFaces(cam, m_resolution);
+
+    startRead(getAtlasLightWeights());
+    if (!m_splatBlocks.empty()) {
+        m_splatDepths.resize(3 * m_resolution * m_resolution);
+        glReadPixels(0, 0, m_resolution, 3 * m_resolution,
+                     GL_DEPTH_COMPONENT, GL_FLOAT, &m_splatDepths[0]);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, prevFbo);
+    glViewport(0, 0, m_resolution, m_resolution);
+}
+
+// Fill the depth buffer in at the near plane over the cells of a
+// "width" x "height" grid across the viewport that are set in
+// "cells", so that nothing more gets drawn there.
+static void fillNearDepth(char const *cells, int width, int height)
+{
+    // Work in normalised device coordinates.
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glDepthFunc(GL_ALWAYS);
+    glBegin(GL_QUADS);
+    for (int y = 0; y < height; ++y) {
+        double const y0 = 2.0 * y / height - 1.0;
+        double const y1 = 2.0 * (y + 1) / height - 1.0;
+        for (int x = 0; x < width; ++x) {
+            if (!cells[y * width + x]) {
+                continue;
+            }
+            int end = x + 1;
+            while (end < width && cells[y * width + end]) {
+                ++end;
+            }
+            double const x0 = 2.0 * x / width - 1.0;
+            double const x1 = 2.0 * end / width - 1.0;
+            glVertex3d(x0, y0, -1.0);
+            glVertex3d(x1, y0, -1.0);
+            glVertex3d(x1, y1, -1.0);
+            glVertex3d(x0, y1, -1.0);
+            x = end;
+        }
+    }
+    glEnd();
+    glDepthFunc(GL_LESS);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+}
+
+// Render the atlas at low resolution, with a pixel per tile. Tiles
+// with the same poly as all their neighbours are assumed to be all
+// that poly, and summed straight away with the coarse weights. The
+// rest are left to be rendered at full resolution.
+void RenderTransferCalculator::calcCoarseAtlasLight(Camera const &cam)
+{
+    int const tile = m_multiResTile;
+    int const size = m_resolution / tile;
+    int const half = size / 2;
+    int const height = 3 * size;
+
+    // The atlas is already clear, and we only use the bottom-left
+    // corner of it.
+    renderAtlasFaces(cam, size);
+
+    m_coarsePixels.resize(NUM_CHANS * size * height);
+    glReadPixels(0, 0, size, height, GL_RGBA, GL_UNSIGNED_BYTE,
+                 &m_coarsePixels[0]);
+
+    // Find the tiles with a different neighbour in the same face.
+    // Faces are "size" rows for the front, and "half" for the sides.
+    m_doneTiles.assign(size * height, 0);
+    for (int y = 0; y < height; ++y) {
+        int const faceBottom = y < size ? 0 : y - (y - size) % half;
+        int const faceTop = y < size ? size : faceBottom + half;
+        for (int x = 0; x < size; ++x) {
+            int const id = decodePolyIndex(&m_coarsePixels[
+                NUM_CHANS * (y * size + x)]);
+            bool isEdge = false;
+            for (int ny = std::max(y - 1, faceBottom);
+                 ny <= std::min(y + 1, faceTop - 1) && !isEdge;
+                 ++ny) {
+                for (int nx = std::max(x - 1, 0);
+                     nx <= std::min(x + 1, size - 1);
+                     ++nx) {
+                    if (decodePolyIndex(&m_coarsePixels[
+                            NUM_CHANS * (ny * size + nx)]) != id) {
+                        isEdge = true;
+                        break;
+                    }
+                }
+            }
+            m_doneTiles[y * size + x] = !isEdge;
+        }
+    }
+
+    // Sum the done tiles, by making the edge tiles background.
+    for (int i = 0, n = size * height; i < n; ++i) {
+        if (!m_doneTiles[i]) {
+            encodePolyIndex(0, &m_coarsePixels[NUM_CHANS * i]);
+        }
+    }
+    std::vector<float> const &ws = getCoarseAtlasLightWeights();
+    m_accumulator.add(&m_coarsePixels[0], &ws[0], ws.size());
+
+    // Clear the coarse render away, and stop anything being drawn
+    // over the done tiles at full resolution.
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(0, 0, size, height);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glDisable(GL_SCISSOR_TEST);
+    glViewport(0, 0, m_resolution, 3 * m_resolution);
+    fillNearDepth(&m_doneTiles[0], size, height);
+}
+
+// Queue up a read of the rendered face into the next pixel buffer
+// object. This doesn't wait for the rendering to complete, so we can
+// sum up the previous face while the GL works on this one.
+void RenderTransferCalculator::startRead(std::vector<float> const &weights)
+{
+    int const pbo = m_nextPbo;
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbos[pbo]);
+    // With a pack buffer bound, the data pointer is an offset into it.
+    glReadPixels(0, 0, m_resolution, weights.size() / m_resolution,
+                 GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+#ifdef GL_MAP_PERSISTENT_BIT
+    if (m_maps[pbo] != NULL) {
+        m_fences[pbo] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+#endif
+    glFlush();
+
+    m_pboWeights[pbo] = &weights;
+    m_nextPbo = (pbo + 1) % NUM_PBOS;
+    ++m_numPending;
+
+    // Make sure there's a free buffer for the next face.
+    if (m_numPending == NUM_PBOS) {
+        finishRead();
+    }
+}
+
+void RenderTransferCalculator::finishRead()
+{
+    int const pbo = (m_nextPbo + NUM_PBOS - m_numPending) % NUM_PBOS;
+    std::vector<float> const &weights = *m_pboWeights[pbo];
+
+    if (m_maps[pbo] != NULL) {
+#ifdef GL_MAP_PERSISTENT_BIT
+        {
+            TRACE_SCOPE("readback");
+            glClientWaitSync(m_fences[pbo], GL_SYNC_FLUSH_COMMANDS_BIT,
+                             GL_TIMEOUT_IGNORED);
+        }
+        glDeleteSync(m_fences[pbo]);
+        m_fences[pbo] = NULL;
+#endif
+        TRACE_SCOPE("sum");
+        m_accumulator.add(m_maps[pbo], &weights[0], weights.size());
+    } else {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pbos[pbo]);
+        GLubyte const *pixels;
+        {
+            TRACE_SCOPE("readback");
+            pixels = static_cast<GLubyte const *>(
+                glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY));
+        }
+        if (pixels == NULL) {
+            throw std::runtime_error("glMapBuffer failed");
+        }
+        {
+            TRACE_SCOPE("sum");
+            m_accumulator.add(pixels, &weights[0], weights.size());
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    --m_numPending;
+}
+
+void RenderTransferCalculator::flushReads()
+{
+    while (m_numPending > 0) {
+        finishRead();
+    }
+}
+
 // Calculate the area subtended by the faces, using a cube map.
 std::vector<double> RenderTransferCalculator::calcSubtended(Camera const &cam)
 {
-    m_sums.clear();
-    m_sums.resize(m_faces.size());
+    std::vector<double> sums(m_faces.size());
+    calcSubtended(cam, &sums[0]);
+    return sums;
+}
 
-    std::vector<double> const &ws = getSubtendWeights();
+void RenderTransferCalculator::calcSubtended(Camera const &cam, double *row)
+{
+    gwMakeCurrent(m_win);
+    std::vector<float> const &ws = getSubtendWeights();
+    cullBlocks(cam, false);
 
     calcFace(cam, viewFront, ws);
     calcFace(cam, viewBack,  ws);
@@ -142,81 +1031,703 @@ std::vector<double> RenderTransferCalculator::calcSubtended(Camera const &cam)
     calcFace(cam, viewLeft,  ws);
     calcFace(cam, viewUp,    ws);
     calcFace(cam, viewDown,  ws);
+    flushReads();
+    m_accumulator.take(row);
+}
+
+// Views for each of the item buffer faces.
+static void (*const itemViews[ItemBuffer::NUM_FACES])() = {
+    viewFront, viewBack, viewRight, viewLeft, viewUp, viewDown
+};
+
+// The faces calcLight uses.
+static int const NUM_LIGHT_FACES = 5;
+static int const lightFaces[NUM_LIGHT_FACES] = {
+    ItemBuffer::FRONT,
+    ItemBuffer::RIGHT,
+    ItemBuffer::LEFT,
+    ItemBuffer::UP,
+    ItemBuffer::DOWN
+};
+
+void RenderTransferCalculator::renderItems(Camera const &cam,
+                                           ItemBuffer &items,
+                                           bool keepDepths)
+{
+    gwMakeCurrent(m_win);
+    cullBlocks(cam, false);
+    // Splatting needs the hemicube views, so isn't done here.
+    m_splatBlocks.clear();
+    items.resize(m_resolution, keepDepths);
+
+    for (int i = 0; i < ItemBuffer::NUM_FACES; ++i) {
+        setView(cam, itemViews[i]);
+        getClipMatrix(items.clip(i));
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        render();
+        glReadPixels(0, 0, m_resolution, m_resolution,
+                     GL_RGBA, GL_UNSIGNED_BYTE, items.pixels(i));
+        if (keepDepths) {
+            glReadPixels(0, 0, m_resolution, m_resolution,
+                         GL_DEPTH_COMPONENT, GL_FLOAT, items.depths(i));
+        }
+    }
+}
+
+// Rows of the face that calcLight uses.
+static int lightRows(int face, int resolution)
+{
+    return face == ItemBuffer::FRONT ? resolution : resolution / 2;
+}
+
+// Invert a 4x4 matrix by Gauss-Jordan elimination. Returns false if
+// it's singular.
+static bool invertMatrix(double const *m, double *inv)
+{
+    double a[4][8];
+    for (int r = 0; r < 4; ++r) {
+        for (int c = 0; c < 4; ++c) {
+            a[r][c] = m[c * 4 + r];
+            a[r][c + 4] = r == c ? 1.0 : 0.0;
+        }
+    }
+    for (int c = 0; c < 4; ++c) {
+        int pivot = c;
+        for (int r = c + 1; r < 4; ++r) {
+            if (fabs(a[r][c]) > fabs(a[pivot][c])) {
+                pivot = r;
+            }
+        }
+        if (a[pivot][c] == 0.0) {
+            return false;
+        }
+        std::swap(a[c], a[pivot]);
+        double const scale = 1.0 / a[c][c];
+        for (int k = 0; k < 8; ++k) {
+            a[c][k] *= scale;
+        }
+        for (int r = 0; r < 4; ++r) {
+            if (r != c) {
+                double const f = a[r][c];
+                for (int k = 0; k < 8; ++k) {
+                    a[r][k] -= f * a[c][k];
+                }
+            }
+        }
+    }
+    for (int r = 0; r < 4; ++r) {
+        for (int c = 0; c < 4; ++c) {
+            inv[c * 4 + r] = a[r][c + 4];
+        }
+    }
+    return true;
+}
+
+void RenderTransferCalculator::renderLightItems(Camera const &cam,
+                                                ItemBuffer &items,
+                                                bool reuse)
+{
+    gwMakeCurrent(m_win);
+    cullBlocks(cam, true);
+    m_splatBlocks.clear();
+
+    int const res = m_resolution;
+    int const facePixels = res * res;
+    double clips[ItemBuffer::NUM_FACES][16];
+    for (int i = 0; i < NUM_LIGHT_FACES; ++i) {
+        int const face = lightFaces[i];
+        setView(cam, itemViews[face]);
+        getClipMatrix(clips[face]);
+    }
+
+    if (reuse && items.resolution() == res && items.hasDepths()) {
+        reprojectItems(items, clips);
+    } else {
+        items.resize(res, true);
+        m_reused.assign(ItemBuffer::NUM_FACES * facePixels, 0);
+    }
+
+    glEnable(GL_SCISSOR_TEST);
+    for (int i = 0; i < NUM_LIGHT_FACES; ++i) {
+        int const face = lightFaces[i];
+        int const rows = lightRows(face, res);
+        char const *reused = &m_reused[face * facePixels];
+        glScissor(0, 0, res, rows);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        fillNearDepth(reused, res, res);
+        setView(cam, itemViews[face]);
+        {
+            TRACE_SCOPE("render face");
+            render();
+        }
+
+        unsigned char *pixels = items.pixels(face);
+        float *depths = items.depths(face);
+        {
+            // Waits for the render too.
+            TRACE_SCOPE("readback");
+            glReadPixels(0, 0, res, rows, GL_RGBA, GL_UNSIGNED_BYTE,
+                         pixels);
+            glReadPixels(0, 0, res, rows, GL_DEPTH_COMPONENT, GL_FLOAT,
+                         depths);
+        }
+        for (int j = 0, n = rows * res; j < n; ++j) {
+            if (reused[j]) {
+                encodePolyIndex(m_warpIds[face * facePixels + j],
+                                pixels + NUM_CHANS * j);
+                depths[j] = m_warpDepths[face * facePixels + j];
+            }
+        }
+        std::copy(clips[face], clips[face] + 16, items.clip(face));
+    }
+    glDisable(GL_SCISSOR_TEST);
+}
+
+// Move each pixel "items" saw to where it would be seen with the new
+// clip matrices, and mark in m_reused the pixels that can be kept:
+// those where the pixel and all its neighbours got the same poly.
+void RenderTransferCalculator::reprojectItems(ItemBuffer const &items,
+                                              double const clips[][16])
+{
+    int const res = m_resolution;
+    int const facePixels = res * res;
+    m_warpIds.assign(ItemBuffer::NUM_FACES * facePixels, -1);
+    m_warpDepths.assign(ItemBuffer::NUM_FACES * facePixels, 1.0f);
+
+    for (int i = 0; i < NUM_LIGHT_FACES; ++i) {
+        int const face = lightFaces[i];
+        double inv[16];
+        if (!invertMatrix(items.clip(face), inv)) {
+            continue;
+        }
+        // Go straight from the old face's device coordinates to each
+        // new face's clip coordinates, trying the same face first,
+        // as most pixels stay on it.
+        double toFaces[NUM_LIGHT_FACES][16];
+        int targets[NUM_LIGHT_FACES];
+        for (int k = 0; k < NUM_LIGHT_FACES; ++k) {
+            targets[k] = lightFaces[(i + k) % NUM_LIGHT_FACES];
+            multMatrix(clips[targets[k]], inv, toFaces[k]);
+        }
+
+        unsigned char const *pixels = items.pixels(face);
+        float const *depths = items.depths(face);
+        for (int y = 0, rows = lightRows(face, res); y < rows; ++y) {
+            for (int x = 0; x < res; ++x) {
+                float const depth = depths[y * res + x];
+                // Re-render the background, as it has no position.
+                if (depth >= 1.0f) {
+                    continue;
+                }
+                double const ndc[4] = {
+                    (2.0 * x + 1.0) / res - 1.0,
+                    (2.0 * y + 1.0) / res - 1.0,
+                    2.0 * depth - 1.0,
+                    1.0
+                };
+                int const id =
+                    decodePolyIndex(pixels + NUM_CHANS * (y * res + x));
+                for (int k = 0; k < NUM_LIGHT_FACES; ++k) {
+                    double const *m = toFaces[k];
+                    double c[4];
+                    for (int r = 0; r < 4; ++r) {
+                        c[r] = m[r] * ndc[0] + m[4 + r] * ndc[1] +
+                               m[8 + r] * ndc[2] + m[12 + r] * ndc[3];
+                    }
+                    if (c[3] <= 0.0 ||
+                        fabs(c[0]) >= c[3] || fabs(c[1]) >= c[3]) {
+                        continue;
+                    }
+                    int const to = targets[k];
+                    int const px = (c[0] / c[3] + 1.0) * 0.5 * res;
+                    int const py = (c[1] / c[3] + 1.0) * 0.5 * res;
+                    // Faces don't overlap, so if it's in the half of
+                    // a side we don't use, it's behind us.
+                    if (py >= lightRows(to, res)) {
+                        break;
+                    }
+                    float const newDepth = (c[2] / c[3] + 1.0) * 0.5;
+                    int const j = to * facePixels + py * res + px;
+                    if (newDepth < m_warpDepths[j]) {
+                        m_warpDepths[j] = newDepth;
+                        m_warpIds[j] = id;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    m_reused.assign(ItemBuffer::NUM_FACES * facePixels, 0);
+    for (int i = 0; i < NUM_LIGHT_FACES; ++i) {
+        int const face = lightFaces[i];
+        int const rows = lightRows(face, res);
+        int const *ids = &m_warpIds[face * facePixels];
+        char *reused = &m_reused[face * facePixels];
+        for (int y = 0; y < rows; ++y) {
+            for (int x = 0; x < res; ++x) {
+                int const id = ids[y * res + x];
+                bool keep = id >= 0;
+                for (int ny = std::max(y - 1, 0);
+                     ny <= std::min(y + 1, rows - 1) && keep;
+                     ++ny) {
+                    for (int nx = std::max(x - 1, 0);
+                         nx <= std::min(x + 1, res - 1);
+                         ++nx) {
+                        if (ids[ny * res + nx] != id) {
+                            keep = false;
+                            break;
+                        }
+                    }
+                }
+                reused[y * res + x] = keep;
+            }
+        }
+    }
+}
 
-    return m_sums;
+void RenderTransferCalculator::sumSubtended(ItemBuffer const &items,
+                                            double *row)
+{
+    std::vector<float> const &ws = getSubtendWeights();
+    for (int i = 0; i < ItemBuffer::NUM_FACES; ++i) {
+        items.accumulate(i, ws, m_accumulator);
+    }
+    m_accumulator.take(row);
+}
+
+// The side weights only cover the bottom half of each side face,
+// which is the half in front of the camera.
+void RenderTransferCalculator::sumLight(ItemBuffer const &items, double *row)
+{
+    TRACE_SCOPE("sum");
+    items.accumulate(ItemBuffer::FRONT, getForwardLightWeights(),
+                     m_accumulator);
+    std::vector<float> const &sws = getSideLightWeights();
+    items.accumulate(ItemBuffer::RIGHT, sws, m_accumulator);
+    items.accumulate(ItemBuffer::LEFT,  sws, m_accumulator);
+    items.accumulate(ItemBuffer::UP,    sws, m_accumulator);
+    items.accumulate(ItemBuffer::DOWN,  sws, m_accumulator);
+    m_accumulator.take(row);
+}
+
+void RenderTransferCalculator::calcSubtendedAndLight(Camera const &cam,
+                                                     double *subtendedRow,
+                                                     double *lightRow)
+{
+    renderItems(cam, m_items);
+    sumSubtended(m_items, subtendedRow);
+    sumLight(m_items, lightRow);
 }
 
 // Calculate the light received, using half a cube map.
 std::vector<double> RenderTransferCalculator::calcLight(Camera const &cam)
 {
-    m_sums.clear();
-    m_sums.resize(m_faces.size());
+    std::vector<double> sums(m_faces.size());
+    calcLight(cam, &sums[0]);
+    return sums;
+}
+
+void RenderTransferCalculator::calcLight(Camera const &cam, double *row)
+{
+    TRACE_SCOPE("patch");
+    // Another calculator may have made its own context current.
+    gwMakeCurrent(m_win);
+    cullBlocks(cam, true);
+    findSplatBlocks(cam);
+    m_numSplatViews = 0;
+    if (m_atlasFbo != 0) {
+        calcAtlasLight(cam);
+        flushReads();
+        splatBlocks(cam);
+        m_accumulator.take(row);
+        return;
+    }
 
-    std::vector<double> const &fws = getForwardLightWeights();
-    std::vector<double> const &sws = getSideLightWeights();
+    std::vector<float> const &fws = getForwardLightWeights();
+    std::vector<float> const &sws = getSideLightWeights();
+    bool const splat = !m_splatBlocks.empty();
+    int const half = m_resolution / 2;
 
     calcFace(cam, viewFront, fws);
+    if (splat) {
+        captureSplatView(0, m_resolution, true);
+    }
     // Avoid rendering things we don't need to. Doesn't seem to
     // actually make rendering go faster! I also tried calling
     // glutReshapeWindow, similarly didn't affect performance. I only
     // care about rendering half the scene, but can't make it go much
     // faster by trying to convince the renderer of this...
     glEnable(GL_SCISSOR_TEST);
-    glScissor(0, 0, m_resolution, m_resolution / 2);
-    calcFace(cam, viewRight, sws);
-    calcFace(cam, viewLeft,  sws);
-    calcFace(cam, viewUp,    sws);
-    calcFace(cam, viewDown,  sws);
+    glScissor(0, 0, m_resolution, half);
+    viewFn_t const sides[] = { viewRight, viewLeft, viewUp, viewDown };
+    for (int i = 0; i < 4; ++i) {
+        calcFace(cam, sides[i], sws);
+        if (splat) {
+            captureSplatView(m_resolution + i * half, half, true);
+        }
+    }
     glDisable(GL_SCISSOR_TEST);
+    flushReads();
+    splatBlocks(cam);
+    m_accumulator.take(row);
+}
+
+void RenderTransferCalculator::findSplatBlocks(Camera const &cam)
+{
+    m_splatBlocks.clear();
+    // Most of the depth buffer is missing in multi-resolution mode,
+    // so we can't check splats against it.
+    if (m_splatThreshold <= 0.0 || (m_multiResTile > 0 && m_atlasFbo != 0)) {
+        return;
+    }
+
+    // With a 90 degree field of view, something of size s at
+    // distance d covers (s / d) * (resolution / 2) pixels.
+    double const pixelScale = 0.5 * m_resolution;
+    Vertex const eye = cam.getEyePos();
+
+    int kept = 0;
+    for (int i = 0, n = m_visibleBlocks.size(); i < n; ++i) {
+        Block const &b = m_blocks[m_visibleBlocks[i]];
+        // Distance from the eye to the nearest point of the box.
+        double dist2 = 0.0;
+        for (int k = 0; k < 3; ++k) {
+            double const d = std::max(0.0, std::max(b.lo[k] - eye.p[k],
+                                                    eye.p[k] - b.hi[k]));
+            dist2 += d * d;
+        }
+        if (b.isPlanar &&
+            b.maxSize * pixelScale < m_splatThreshold * sqrt(dist2)) {
+            m_splatBlocks.push_back(m_visibleBlocks[i]);
+        } else {
+            m_visibleBlocks[kept++] = m_visibleBlocks[i];
+        }
+    }
+    m_visibleBlocks.resize(kept);
+}
 
-    return m_sums;
+void RenderTransferCalculator::captureSplatView(int y, int rows, bool readDepth)
+{
+    FaceView &fv = m_splatViews[m_numSplatViews++];
+    getClipMatrix(fv.clip);
+    fv.y = y;
+    fv.rows = rows;
+
+    if (readDepth) {
+        m_splatDepths.resize(3 * m_resolution * m_resolution);
+        glReadPixels(0, 0, m_resolution, rows, GL_DEPTH_COMPONENT, GL_FLOAT,
+                     &m_splatDepths[y * m_resolution]);
+    }
+}
+
+// Find the hemicube face the centre of the quad lands in, and check
+// whether the depth buffer there shows the quad's plane or something
+// behind it.
+bool RenderTransferCalculator::isSplatVisible(Quad const &quad,
+                                              Vertex const &centre) const
+{
+    for (int v = 0; v < m_numSplatViews; ++v) {
+        FaceView const &fv = m_splatViews[v];
+        double win[3];
+        if (!toWindow(fv.clip, centre.p, m_resolution, win)) {
+            continue;
+        }
+        if (win[0] < 0.0 || win[0] >= m_resolution ||
+            win[1] < 0.0 || win[1] >= fv.rows) {
+            continue;
+        }
+
+        // The depth buffer is sampled at pixel centres, so compare
+        // with the quad's plane there, rather than the depth at its
+        // centre, or quads at a grazing angle go missing. Depth is
+        // affine in window coordinates, so find its gradient.
+        double gx = 0.0;
+        double gy = 0.0;
+        double a[3];
+        double b[3];
+        if (toWindow(fv.clip, m_vertices[quad.indices[0]].p,
+                     m_resolution, a) &&
+            toWindow(fv.clip, m_vertices[quad.indices[1]].p,
+                     m_resolution, b)) {
+            double const ax = a[0] - win[0];
+            double const ay = a[1] - win[1];
+            double const bx = b[0] - win[0];
+            double const by = b[1] - win[1];
+            double const det = ax * by - bx * ay;
+            if (fabs(det) > 1.0e-12) {
+                double const az = a[2] - win[2];
+                double const bz = b[2] - win[2];
+                gx = (az * by - bz * ay) / det;
+                gy = (ax * bz - bx * az) / det;
+            }
+        }
+
+        // Look at the four pixel centres round the quad's centre, as
+        // some may be round a corner and covered by the next wall.
+        int const x0 = static_cast<int>(floor(win[0] - 0.5));
+        int const y0 = static_cast<int>(floor(win[1] - 0.5));
+        for (int y = std::max(y0, 0); y <= std::min(y0 + 1, fv.rows - 1); ++y) {
+            for (int x = std::max(x0, 0);
+                 x <= std::min(x0 + 1, m_resolution - 1);
+                 ++x) {
+                double const depth = win[2] +
+                                     gx * (x + 0.5 - win[0]) +
+                                     gy * (y + 0.5 - win[1]);
+                float const stored =
+                    m_splatDepths[(fv.y + y) * m_resolution + x];
+                if (depth <= stored + DEPTH_EPSILON) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+    return false;
 }
 
-std::vector<double> const &RenderTransferCalculator::getSubtendWeights()
+// Like AnalyticTransferCalculator::calcSingleQuadLight, but only for
+// faces whose centre isn't hidden by something in the depth buffer.
+void RenderTransferCalculator::splatBlocks(Camera const &cam)
+{
+    Vertex const eye = cam.getEyePos();
+    Vertex const look = (cam.getLookAt() - eye).norm();
+
+    for (int i = 0, n = m_splatBlocks.size(); i < n; ++i) {
+        Block const &b = m_blocks[m_splatBlocks[i]];
+        for (int r = 0; r < b.runCount; ++r) {
+            int const runStart = b.faceStart + r * b.runStride;
+            for (int f = runStart; f < runStart + b.runLength; ++f) {
+                Quad const &quad = m_faces[f];
+                Vertex const centre = paraCentre(quad, m_vertices);
+                Vertex dir = centre - eye;
+                double const l = dir.len();
+                dir = dir.norm();
+                double const area =
+                    dot(paraCross(quad, m_vertices), dir);
+                double const cosCamAngle = dot(look, dir);
+                if (area <= 0.0 || cosCamAngle <= 0.0) {
+                    continue;
+                }
+
+                if (isSplatVisible(quad, centre)) {
+                    m_accumulator.addToPoly(
+                        f + 1, cosCamAngle * area / (l * l * M_PI));
+                }
+            }
+        }
+    }
+}
+
+// The weights are calculated as doubles, but the accumulator works
+// in floats, which are plenty for individual pixels.
+std::vector<float> const &RenderTransferCalculator::getSubtendWeights()
 {
     if (m_subtendWeights.empty()) {
-        calcSubtendWeights(m_resolution, m_subtendWeights);
+        std::vector<double> ws;
+        calcSubtendWeights(m_resolution, ws);
+        m_subtendWeights.assign(ws.begin(), ws.end());
     }
     return m_subtendWeights;
 }
 
-std::vector<double> const &RenderTransferCalculator::getForwardLightWeights()
+std::vector<float> const &RenderTransferCalculator::getForwardLightWeights()
 {
     if (m_forwardLightWeights.empty()) {
-        calcForwardLightWeights(m_resolution, m_forwardLightWeights);
+        std::vector<double> ws;
+        calcForwardLightWeights(m_resolution, ws);
+        m_forwardLightWeights.assign(ws.begin(), ws.end());
     }
     return m_forwardLightWeights;
 }
 
-std::vector<double> const &RenderTransferCalculator::getSideLightWeights()
+std::vector<float> const &RenderTransferCalculator::getSideLightWeights()
 {
     if (m_sideLightWeights.empty()) {
-        calcSideLightWeights(m_resolution, m_sideLightWeights);
+        std::vector<double> ws;
+        calcSideLightWeights(m_resolution, ws);
+        m_sideLightWeights.assign(ws.begin(), ws.end());
     }
     return m_sideLightWeights;
 }
 
+std::vector<float> const &RenderTransferCalculator::getAtlasLightWeights()
+{
+    if (m_atlasLightWeights.empty()) {
+        std::vector<double> ws;
+        calcAtlasLightWeights(m_resolution, ws);
+        m_atlasLightWeights.assign(ws.begin(), ws.end());
+    }
+    return m_atlasLightWeights;
+}
+
+// Atlas weights with each tile summed into one pixel.
+std::vector<float> const &RenderTransferCalculator::getCoarseAtlasLightWeights()
+{
+    if (m_coarseAtlasLightWeights.empty()) {
+        std::vector<float> const &fine = getAtlasLightWeights();
+        int const tile = m_multiResTile;
+        int const size = m_resolution / tile;
+        std::vector<double> ws(3 * size * size);
+        for (int y = 0; y < 3 * m_resolution; ++y) {
+            for (int x = 0; x < m_resolution; ++x) {
+                ws[(y / tile) * size + x / tile] += fine[y * m_resolution + x];
+            }
+        }
+        m_coarseAtlasLightWeights.assign(ws.begin(), ws.end());
+    }
+    return m_coarseAtlasLightWeights;
+}
+
 void RenderTransferCalculator::calcAllLights(std::vector<double> &weights)
 {
+    TRACE_SCOPE("calcAllLights");
     int const n = m_faces.size();
     weights.clear();
-    weights.reserve(n * n);
+    weights.resize(static_cast<size_t>(n) * n);
+    startProgress(n);
 
-    // Iterate over targets
-    for (int i = 0; i < n; ++i) {
-        Quad currQuad = m_faces[i];
-        Vertex eye(paraCentre(currQuad, m_vertices));
-        Vertex dir(paraCross(currQuad, m_vertices));
-        Vertex lookAt(eye - dir);
-        Vertex up(dir.perp());
-        Camera cam(eye, lookAt, up);
+    // We render on this thread with our own context, and each helper
+    // on a thread of its own with its context.
+    std::atomic<int> nextRow(0);
+    runThreads(m_helpers.size() + 1, [&](int t) {
+        if (t == 0) {
+            calcRows(weights, nextRow);
+            return;
+        }
+        RenderTransferCalculator *calc = m_helpers[t - 1];
+        gwMakeCurrent(calc->m_win);
+        try {
+            calc->calcRows(weights, nextRow);
+        } catch (...) {
+            gwReleaseCurrent();
+            throw;
+        }
+        gwReleaseCurrent();
+    });
+    endProgress();
+}
+
+// A repeatable random number in [0, 1), from hashing the patch and
+// which of its numbers we want.
+static double patchRandom(int patch, int which)
+{
+    uint64_t h = (static_cast<uint64_t>(patch) << 8) + which;
+    h += 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    h ^= h >> 31;
+    return (h >> 11) * (1.0 / (1ULL << 53));
+}
+
+Camera RenderTransferCalculator::patchCamera(int patch) const
+{
+    Quad const &quad = m_faces[patch];
+    Vertex eye(paraCentre(quad, m_vertices));
+    Vertex dir(paraCross(quad, m_vertices));
+    Vertex up(dir.perp());
+
+    if (m_jitterRotate) {
+        double const angle = 2.0 * M_PI * patchRandom(patch, 0);
+        Vertex side(cross(dir.norm(), up));
+        up = up.scale(cos(angle)) + side.scale(sin(angle));
+    }
+    if (m_eyeJitter != 0.0) {
+        Vertex const &v0 = m_vertices[quad.indices[0]];
+        Vertex const &v1 = m_vertices[quad.indices[1]];
+        Vertex const &v3 = m_vertices[quad.indices[3]];
+        double const a = m_eyeJitter * (patchRandom(patch, 1) - 0.5);
+        double const b = m_eyeJitter * (patchRandom(patch, 2) - 0.5);
+        eye = eye + (v1 - v0).scale(a) + (v3 - v0).scale(b);
+    }
 
-        std::vector<double> faceWeights = calcLight(cam);
-        weights.insert(weights.end(), faceWeights.begin(), faceWeights.end());
+    return Camera(eye, eye - dir, up);
+}
+
+void RenderTransferCalculator::calcRows(std::vector<double> &weights,
+                                        std::atomic<int> &nextRow)
+{
+    int const n = m_faces.size();
+
+    if (m_coherent) {
+        // Take runs of rows, so that neighbouring patches are done
+        // one after another, reusing each other's renders.
+        for (int start = nextRow.fetch_add(COHERENT_RUN);
+             start < n;
+             start = nextRow.fetch_add(COHERENT_RUN)) {
+            for (int i = start, end = std::min(start + COHERENT_RUN, n);
+                 i < end;
+                 ++i) {
+                TRACE_SCOPE("patch");
+                bool const reuse = i > start && isNeighbour(i - 1, i);
+                renderLightItems(patchCamera(i), m_items, reuse);
+                sumLight(m_items, &weights[static_cast<size_t>(i) * n]);
+                if (m_rowCallback) {
+                    m_rowCallback(i);
+                }
+                patchDone();
+            }
+        }
+        return;
+    }
+
+    // Iterate over targets
+    for (int i = nextRow++; i < n; i = nextRow++) {
+        calcLight(patchCamera(i), &weights[static_cast<size_t>(i) * n]);
+        if (m_rowCallback) {
+            m_rowCallback(i);
+        }
         // Somewhat slow, so print progress.
+        patchDone();
+    }
+}
+
+void RenderTransferCalculator::startProgress(int numPatches) const
+{
+#ifdef RADIOSITY_TRACE
+    if (m_progress) {
+        TRACE_PROGRESS_START("transfers", numPatches, "patches");
+    }
+#else
+    (void)numPatches;
+#endif
+}
+
+void RenderTransferCalculator::patchDone() const
+{
+    if (m_progress) {
+#ifdef RADIOSITY_TRACE
+        TRACE_PROGRESS_STEP("transfers");
+#else
         std::cerr << ".";
+#endif
+    }
+}
+
+void RenderTransferCalculator::endProgress() const
+{
+#ifndef RADIOSITY_TRACE
+    if (m_progress) {
+        std::cerr << std::endl;
+    }
+#endif
+}
+
+// Patches are neighbours if they face the same way and their centres
+// are no more than a couple of patch sizes apart, which is enough
+// for rows along a subdivided quad.
+bool RenderTransferCalculator::isNeighbour(int patch1, int patch2) const
+{
+    Quad const &q1 = m_faces[patch1];
+    Quad const &q2 = m_faces[patch2];
+    Vertex const n1(paraCross(q1, m_vertices));
+    Vertex const n2(paraCross(q2, m_vertices));
+    if (dot(n1.norm(), n2.norm()) < 1.0 - 1.0e-9) {
+        return false;
     }
-    std::cerr << std::endl;
+    double const dist =
+        (paraCentre(q1, m_vertices) - paraCentre(q2, m_vertices)).len();
+    return dist < 2.0 * (sqrt(n1.len()) + sqrt(n2.len()));
 }
 
 ////////////////////////////////////////////////////////////////////////
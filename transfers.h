@@ -9,15 +9,28 @@
 #ifndef RADIOSITY_TRANSFERS_H
 #define RADIOSITY_TRANSFERS_H
 
+#include <atomic>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "accumulator.h"
+#include "depth_pyramid.h"
+#include "item_buffer.h"
+
 // This class holds all the state that stays the same as we repeatedly
 // render the scene from different views to calculate the light
 // transfers.
 class RenderTransferCalculator
 {
 public:
+    // With offscreen contexts, calcAllLights can render on
+    // "threads" threads, each with its own context. GLUT-based builds
+    // only ever use one.
     RenderTransferCalculator(std::vector<Vertex> const &vertices,
                              std::vector<Quad> const &faces,
-                             int resolution);
+                             int resolution,
+                             int threads = 1);
 
     virtual ~RenderTransferCalculator();
 
@@ -25,39 +38,278 @@ public:
     // particular camera view.
     std::vector<double> calcSubtended(Camera const &cam);
     std::vector<double> calcLight(Camera const &cam);
+    // Versions that store the results for polys seen into "row",
+    // which has an entry per poly, and leave the rest untouched.
+    void calcSubtended(Camera const &cam, double *row);
+    void calcLight(Camera const &cam, double *row);
+    // Render the whole cube of views around the camera into "items",
+    // keeping the depths too if "keepDepths" is set. The sum
+    // functions then give the same results as calcSubtended and
+    // calcLight, without rendering again, and the buffer can be
+    // summed against other weights too.
+    void renderItems(Camera const &cam,
+                     ItemBuffer &items,
+                     bool keepDepths = false);
+    // Just render the faces calcLight uses into "items", ready for
+    // sumLight. If "reuse" is set and "items" already holds such a
+    // render from a nearby camera, reproject what it saw to the new
+    // eye, and only re-render holes and poly edges.
+    void renderLightItems(Camera const &cam, ItemBuffer &items, bool reuse);
+    void sumSubtended(ItemBuffer const &items, double *row);
+    void sumLight(ItemBuffer const &items, double *row);
+    // Both of the above, from one set of renders.
+    void calcSubtendedAndLight(Camera const &cam,
+                               double *subtendedRow,
+                               double *lightRow);
     // Calculate the light for all polys, as if we have a camera at
     // each poly.
     void calcAllLights(std::vector<double> &weights);
 
+    // Render all five faces of the light hemicube into one atlas,
+    // and read it back and sum it in one go, rather than face by
+    // face.
+    void setUseAtlas(bool useAtlas);
+
+    // Cull whole blocks of subdivided quads before rendering, when
+    // they face away from the camera or are outside the view. Faces
+    // not in any block are always drawn.
+    void setBlocks(std::vector<SubdivInfo> const &blocks);
+
+    // Also cull blocks hidden behind nearer ones. Large and near
+    // blocks are drawn first, and the rest tested against a depth
+    // pyramid built from them. Needs setBlocks.
+    void setOcclusionCulling(bool occlusionCulling);
+
+    // In calcLight, don't render blocks whose faces would all be
+    // smaller than "pixels" across. Instead, give each face the
+    // analytic form factor for a point source, if the depth buffer
+    // shows its centre is visible. 0 turns it off. Needs setBlocks.
+    void setSplatThreshold(double pixels);
+
+    // In atlas mode, render the light hemicube at a pixel per
+    // "tileSize" square tile first. Only tiles next to a change of
+    // poly are then rendered at full resolution, and the rest use
+    // the summed weights of their tile. 0 turns it off. Splatting is
+    // skipped in this mode.
+    void setMultiResolution(int tileSize);
+
+    // In calcAllLights, turn each patch's hemicube by a random angle
+    // about its normal and, if "eyeJitter" is non-zero, move the eye
+    // up to that fraction of the patch from its centre. The random
+    // numbers are fixed per patch, so results are repeatable.
+    // Aliasing errors then become noise, rather than lining up
+    // across a wall, so lower resolutions can be used.
+    void setJitter(bool rotate, double eyeJitter);
+
+    // In calcAllLights, go through patches in order, rendering with
+    // renderLightItems and reusing the last patch's render where it
+    // was a neighbour. Ignores the atlas and splatting settings.
+    void setCoherent(bool coherent);
+
+    // Have calcAllLights call "callback" with each row of weights as
+    // soon as it's finished, from whichever thread did it, so the
+    // rows can be used before the rest are done.
+    void setRowCallback(std::function<void(int)> const &callback);
+
+    // Whether calcAllLights prints a dot per patch to stderr. On by
+    // default.
+    void setProgress(bool progress);
+
 private:
     typedef void (*viewFn_t)();
 
+    // Rows taken at a time by each thread in coherent mode.
+    static int const COHERENT_RUN = 16;
+
+    // Number of pixel buffer objects we rotate through when reading
+    // back rendered faces.
+    static int const NUM_PBOS = 2;
+
+    // A rectangle of faces that can be culled as one, with a
+    // bounding box and, if all the faces share a plane, the plane.
+    // It's made of "runCount" runs of "runLength" faces, each
+    // "runStride" faces after the last.
+    struct Block {
+        int faceStart;
+        int runLength;
+        int runCount;
+        int runStride;
+        bool isPlanar;
+        // Front side is where dot(normal, p) < offset.
+        double normal[3];
+        double offset;
+        double lo[3];
+        double hi[3];
+        // Largest face size, as the square root of its area.
+        double maxSize;
+        // For planar blocks, the vertices at the corners.
+        int corners[4];
+    };
+
+    // Where a hemicube face went, for looking up splatted faces. Its
+    // depths are in rows [y, y + rows) of the atlas-shaped buffer.
+    struct FaceView {
+        double clip[16];
+        int y;
+        int rows;
+    };
+
+    // Calculate rows of the transfer matrix, taking the next row to
+    // do from "nextRow", until there are none left.
+    void calcRows(std::vector<double> &weights, std::atomic<int> &nextRow);
+    // The camera calcAllLights uses for the given patch.
+    Camera patchCamera(int patch) const;
+    bool isNeighbour(int patch1, int patch2) const;
+    // Report progress on calcAllLights. A dot per patch, or through
+    // trace.h when tracing.
+    void startProgress(int numPatches) const;
+    void patchDone() const;
+    void endProgress() const;
+
+    void uploadGeometry();
+    void addBlock(int faceStart,
+                  int runLength,
+                  int runCount,
+                  int runStride,
+                  bool isPlanar);
+    // Find the blocks that might be visible from the camera. If
+    // "hemisphere" is set, only look in front of it.
+    void cullBlocks(Camera const &cam, bool hemisphere);
     void render(void);
-    void sumWeights(std::vector<double> const &weights);
+    // Draw the given blocks.
+    void drawBlocks(std::vector<int> const &blocks);
+    // Draw the given blocks, skipping the ones that are hidden.
+    void drawUnoccluded(double const *clip, std::vector<int> const &blocks);
+    void setView(Camera const &cam, viewFn_t view);
     void calcFace(Camera const &cam,
                   viewFn_t view,
-                  std::vector<double> const &weights);
+                  std::vector<float> const &weights);
+    void calcAtlasFace(Camera const &cam,
+                       viewFn_t view,
+                       int y,
+                       int rows,
+                       int size);
+    void renderAtlasFaces(Camera const &cam, int size);
+    void calcAtlasLight(Camera const &cam);
+    void calcCoarseAtlasLight(Camera const &cam);
+    // Reproject "items" for renderLightItems, given the new clip
+    // matrices for each face.
+    void reprojectItems(ItemBuffer const &items, double const clips[][16]);
+    // Move the blocks too small to render into m_splatBlocks.
+    void findSplatBlocks(Camera const &cam);
+    // Remember the current face's view for splatting, and, if
+    // "readDepth" is set, read its depth buffer.
+    void captureSplatView(int y, int rows, bool readDepth);
+    // Draw the outlines of the splatted blocks as background, so
+    // they still hide what's behind them.
+    void drawSplatProxies();
+    // Add the analytic weights for the splatted faces.
+    void splatBlocks(Camera const &cam);
+    bool isSplatVisible(Quad const &quad, Vertex const &centre) const;
+    void createReadBuffers(int pixels);
+    void deleteReadBuffers();
+    // Kick off an asynchronous read of the current framebuffer.
+    void startRead(std::vector<float> const &weights);
+    // Wait for the oldest outstanding read and accumulate it.
+    void finishRead();
+    // Finish all outstanding reads.
+    void flushReads();
 
     // Caches of weights.
-    std::vector<double> const &getSubtendWeights();
-    std::vector<double> const &getForwardLightWeights();
-    std::vector<double> const &getSideLightWeights();
+    std::vector<float> const &getSubtendWeights();
+    std::vector<float> const &getForwardLightWeights();
+    std::vector<float> const &getSideLightWeights();
+    std::vector<float> const &getAtlasLightWeights();
+    std::vector<float> const &getCoarseAtlasLightWeights();
 
     // Geometry.
     std::vector<Vertex> const &m_vertices;
     std::vector<Quad> const &m_faces;
     // Rendering resolution.
     int const m_resolution;
-    // Window id.
+    // Context id.
     int const m_win;
+    // Calculators for the other threads, each with its own context.
+    std::vector<RenderTransferCalculator *> m_helpers;
+    // Vertex buffer holding the scene: positions followed by ID
+    // colours, four vertices per quad.
+    GLuint m_sceneVbo;
+    // Blocks to cull, or empty to draw everything.
+    std::vector<Block> m_blocks;
+    // Blocks that passed cullBlocks, and scratch space for the draw
+    // ranges after frustum culling.
+    std::vector<int> m_visibleBlocks;
+    std::vector<int> m_frustumBlocks;
+    std::vector<std::pair<GLint, GLsizei> > m_drawRuns;
+    std::vector<GLint> m_drawFirsts;
+    std::vector<GLsizei> m_drawCounts;
+
+    // Occlusion culling state and scratch space.
+    bool m_occlusionCulling;
+    DepthPyramid m_depthPyramid;
+    std::vector<float> m_depthPixels;
+    std::vector<int> m_occluders;
+    std::vector<int> m_occludees;
+    std::vector<int> m_unoccluded;
+
+    // Splatting state. m_splatDepths is shaped like the atlas.
+    double m_splatThreshold;
+    std::vector<int> m_splatBlocks;
+    std::vector<float> m_splatDepths;
+    FaceView m_splatViews[5];
+    int m_numSplatViews;
+
+    // Per-patch camera jitter.
+    bool m_jitterRotate;
+    double m_eyeJitter;
+
+    bool m_coherent;
+
+    std::function<void(int)> m_rowCallback;
+    bool m_progress;
+
+    // Scratch item buffer for calcSubtendedAndLight.
+    ItemBuffer m_items;
+    // Reprojected poly IDs (or -1) and depths for each item buffer
+    // pixel, and which of them can be kept.
+    std::vector<int> m_warpIds;
+    std::vector<float> m_warpDepths;
+    std::vector<char> m_reused;
+
+    // Multi-resolution tile size, or 0, and scratch space.
+    int m_multiResTile;
+    std::vector<GLubyte> m_coarsePixels;
+    // Tiles done at low resolution.
+    std::vector<char> m_doneTiles;
 
     // Weighting tables.
-    std::vector<double> m_subtendWeights;
-    std::vector<double> m_forwardLightWeights;
-    std::vector<double> m_sideLightWeights;
+    std::vector<float> m_subtendWeights;
+    std::vector<float> m_forwardLightWeights;
+    std::vector<float> m_sideLightWeights;
+    std::vector<float> m_atlasLightWeights;
+    std::vector<float> m_coarseAtlasLightWeights;
+
+    // Render target for the atlas, or 0 if not in use.
+    GLuint m_atlasFbo;
+    GLuint m_atlasRenderbuffers[2];
+
+    // Sums for the current view.
+    WeightAccumulator m_accumulator;
 
-    // Sums being calculated.
-    std::vector<double> m_sums;
+    // Readback buffers. If persistent mapping is available, m_maps
+    // holds the permanent mappings, otherwise it is all NULL and we
+    // map on demand.
+    GLuint m_pbos[NUM_PBOS];
+    GLubyte *m_maps[NUM_PBOS];
+#ifdef GL_MAP_PERSISTENT_BIT
+    GLsync m_fences[NUM_PBOS];
+#endif
+    // Weights to apply to each buffer's contents, once read.
+    std::vector<float> const *m_pboWeights[NUM_PBOS];
+    // Next buffer to read into, and the number of reads in flight
+    // in the buffers before it.
+    int m_nextPbo;
+    int m_numPending;
 };
 
 // Calculate an analytic approximation. Assume nothing obscuring the
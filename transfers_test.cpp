@@ -35,6 +35,17 @@ private:
     CPPUNIT_TEST(baseCameraFacesRightWay);
     CPPUNIT_TEST(backCameraFacesRightWay);
     CPPUNIT_TEST(calcAllLightsWorks);
+    CPPUNIT_TEST(repeatedCalcsMatch);
+    CPPUNIT_TEST(atlasMatchesPerFace);
+    CPPUNIT_TEST(threadedCalcAllLightsMatches);
+    CPPUNIT_TEST(culledMatchesUnculled);
+    CPPUNIT_TEST(occlusionCulledMatchesUnculled);
+    CPPUNIT_TEST(splattingImprovesLowResolution);
+    CPPUNIT_TEST(multiResMatchesAtlas);
+    CPPUNIT_TEST(itemBufferMatchesSeparateCalcs);
+    CPPUNIT_TEST(rotationReducesLowResolutionError);
+    CPPUNIT_TEST(jitterIsRepeatable);
+    CPPUNIT_TEST(coherentMatchesPlain);
     CPPUNIT_TEST_SUITE_END();
 
     void renderEachFaceIsAreaOne();
@@ -50,6 +61,17 @@ private:
     void baseCameraFacesRightWay();
     void backCameraFacesRightWay();
     void calcAllLightsWorks();
+    void repeatedCalcsMatch();
+    void atlasMatchesPerFace();
+    void threadedCalcAllLightsMatches();
+    void culledMatchesUnculled();
+    void occlusionCulledMatchesUnculled();
+    void splattingImprovesLowResolution();
+    void multiResMatchesAtlas();
+    void itemBufferMatchesSeparateCalcs();
+    void rotationReducesLowResolutionError();
+    void jitterIsRepeatable();
+    void coherentMatchesPlain();
 };
 
 CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(TransfersTestCase, "TransfersTestCase");
@@ -318,10 +340,10 @@ void TransfersTestCase::calcAllLightsWorks()
     AnalyticTransferCalculator atc(vertices, quads);
     std::vector<double> analyticLight;
     atc.calcAllLights(analyticLight);
-    CPPUNIT_ASSERT(isnan(analyticLight[0]));
+    CPPUNIT_ASSERT(std::isnan(analyticLight[0]));
     CPPUNIT_ASSERT(analyticLight[1] > 0.0);
     CPPUNIT_ASSERT(analyticLight[2] > 0.0);
-    CPPUNIT_ASSERT(isnan(analyticLight[3]));
+    CPPUNIT_ASSERT(std::isnan(analyticLight[3]));
 
     RenderTransferCalculator rtc(vertices, quads, 512);
     std::vector<double> renderLight;
@@ -331,3 +353,409 @@ void TransfersTestCase::calcAllLightsWorks()
     CPPUNIT_ASSERT(renderLight[2] >  0.0);
     CPPUNIT_ASSERT(renderLight[3] == 0.0);
 }
+
+// Readbacks are pipelined, so check nothing leaks from one
+// calculation into the next.
+void TransfersTestCase::repeatedCalcsMatch()
+{
+    std::vector<Vertex> vertices(cubeVertices);
+    std::vector<Quad> quads;
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        subdivide(cubeFaces[i], vertices, quads, 8, 8);
+    }
+
+    Camera cam(Vertex(0.1, -0.1, 0.05),
+               Vertex(1.0, 1.0, 1.0),
+               Vertex(1.0, 0.0, 0.0));
+
+    RenderTransferCalculator rtc(vertices, quads, 128);
+    std::vector<double> light1 = rtc.calcLight(cam);
+    std::vector<double> subtended1 = rtc.calcSubtended(cam);
+    std::vector<double> light2 = rtc.calcLight(cam);
+    std::vector<double> subtended2 = rtc.calcSubtended(cam);
+
+    for (int i = 0; i < quads.size(); ++i) {
+        CPPUNIT_ASSERT_EQUAL(light1[i], light2[i]);
+        CPPUNIT_ASSERT_EQUAL(subtended1[i], subtended2[i]);
+    }
+}
+
+void TransfersTestCase::atlasMatchesPerFace()
+{
+    std::vector<Vertex> vertices(cubeVertices);
+    std::vector<Quad> quads;
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        subdivide(cubeFaces[i], vertices, quads, SUBDIVISION, SUBDIVISION);
+    }
+
+    Camera cam(Vertex(0.1, -0.1, 0.05),
+               Vertex(1.0, 1.0, 1.0),
+               Vertex(1.0, 0.0, 0.0));
+
+    RenderTransferCalculator rtc(vertices, quads, RESOLUTION);
+    std::vector<double> perFaceLight = rtc.calcLight(cam);
+    rtc.setUseAtlas(true);
+    std::vector<double> atlasLight = rtc.calcLight(cam);
+
+    CPPUNIT_ASSERT_EQUAL(perFaceLight.size(), atlasLight.size());
+    // Rasterisation at an offset in the atlas may move the odd edge
+    // pixel, so allow a couple of pixels' worth of weight.
+    for (int i = 0; i < perFaceLight.size(); ++i) {
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(perFaceLight[i], atlasLight[i], 1.0e-5);
+    }
+}
+
+// Extra threads are ignored if the build can't support them, so this
+// should pass either way.
+void TransfersTestCase::threadedCalcAllLightsMatches()
+{
+    std::vector<Vertex> vertices(cubeVertices);
+    std::vector<Quad> quads;
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        subdivide(cubeFaces[i], vertices, quads, 4, 4);
+    }
+
+    std::vector<double> serialLight;
+    RenderTransferCalculator(vertices, quads, 128).calcAllLights(serialLight);
+
+    std::vector<double> threadedLight;
+    RenderTransferCalculator(vertices, quads, 128, 3)
+        .calcAllLights(threadedLight);
+
+    CPPUNIT_ASSERT_EQUAL(serialLight.size(), threadedLight.size());
+    for (int i = 0; i < serialLight.size(); ++i) {
+        CPPUNIT_ASSERT_EQUAL(serialLight[i], threadedLight[i]);
+    }
+}
+
+// Block culling should only skip things that can't be seen.
+void TransfersTestCase::culledMatchesUnculled()
+{
+    std::vector<Vertex> vertices(cubeVertices);
+    std::vector<Quad> quads;
+    std::vector<SubdivInfo> blocks;
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        blocks.push_back(subdivide(cubeFaces[i], vertices, quads, 8, 8));
+    }
+    // Inner cube, with one side left out of the blocks to check the
+    // gaps get drawn.
+    std::vector<Quad> innerFaces(cubeFaces);
+    scale(0.4, innerFaces, vertices);
+    flip(innerFaces, vertices);
+    rotate(Vertex(1.0, 0.0, 0.0), M_PI / 3.0, innerFaces, vertices);
+    for (int i = 0, n = innerFaces.size(); i < n; ++i) {
+        SubdivInfo info = subdivide(innerFaces[i], vertices, quads, 4, 4);
+        if (i != 2) {
+            blocks.push_back(info);
+        }
+    }
+
+    RenderTransferCalculator plain(vertices, quads, 128);
+    RenderTransferCalculator culled(vertices, quads, 128);
+    culled.setBlocks(blocks);
+
+    for (int i = 0, n = quads.size(); i < n; i += 37) {
+        Vertex eye(paraCentre(quads[i], vertices));
+        Vertex dir(paraCross(quads[i], vertices));
+        Camera cam(eye, eye - dir, dir.perp());
+
+        std::vector<double> plainLight = plain.calcLight(cam);
+        std::vector<double> culledLight = culled.calcLight(cam);
+        std::vector<double> plainSubtended = plain.calcSubtended(cam);
+        std::vector<double> culledSubtended = culled.calcSubtended(cam);
+        for (int j = 0; j < n; ++j) {
+            CPPUNIT_ASSERT_EQUAL(plainLight[j], culledLight[j]);
+            CPPUNIT_ASSERT_EQUAL(plainSubtended[j], culledSubtended[j]);
+        }
+    }
+
+    Camera cam(Vertex(0.1, 0.6, 0.05),
+               Vertex(1.0, 1.0, 1.0),
+               Vertex(1.0, 0.0, 0.0));
+    plain.setUseAtlas(true);
+    culled.setUseAtlas(true);
+    std::vector<double> plainLight = plain.calcLight(cam);
+    std::vector<double> culledLight = culled.calcLight(cam);
+    for (int j = 0, n = quads.size(); j < n; ++j) {
+        CPPUNIT_ASSERT_EQUAL(plainLight[j], culledLight[j]);
+    }
+}
+
+// Occlusion culling should also only skip things that can't be seen.
+void TransfersTestCase::occlusionCulledMatchesUnculled()
+{
+    std::vector<Vertex> vertices(cubeVertices);
+    std::vector<Quad> quads;
+    std::vector<SubdivInfo> blocks;
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        blocks.push_back(subdivide(cubeFaces[i], vertices, quads, 16, 16));
+    }
+    // A big inner cube to hide things behind.
+    std::vector<Quad> innerFaces(cubeFaces);
+    scale(0.6, innerFaces, vertices);
+    flip(innerFaces, vertices);
+    rotate(Vertex(0.0, 1.0, 0.0), M_PI / 5.0, innerFaces, vertices);
+    for (int i = 0, n = innerFaces.size(); i < n; ++i) {
+        blocks.push_back(subdivide(innerFaces[i], vertices, quads, 8, 8));
+    }
+
+    RenderTransferCalculator plain(vertices, quads, 128);
+    plain.setBlocks(blocks);
+    RenderTransferCalculator culled(vertices, quads, 128);
+    culled.setBlocks(blocks);
+    culled.setOcclusionCulling(true);
+
+    for (int atlas = 0; atlas < 2; ++atlas) {
+        plain.setUseAtlas(atlas);
+        culled.setUseAtlas(atlas);
+        for (int i = 0, n = quads.size(); i < n; i += 53) {
+            Vertex eye(paraCentre(quads[i], vertices));
+            Vertex dir(paraCross(quads[i], vertices));
+            Camera cam(eye, eye - dir, dir.perp());
+
+            std::vector<double> plainLight = plain.calcLight(cam);
+            std::vector<double> culledLight = culled.calcLight(cam);
+            for (int j = 0; j < n; ++j) {
+                CPPUNIT_ASSERT_EQUAL(plainLight[j], culledLight[j]);
+            }
+        }
+    }
+}
+
+// At low resolution, splatting the small, far-away patches should get
+// us closer to a high-resolution render.
+void TransfersTestCase::splattingImprovesLowResolution()
+{
+    std::vector<Vertex> vertices(cubeVertices);
+    std::vector<Quad> quads;
+    std::vector<SubdivInfo> blocks;
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        blocks.push_back(subdivide(cubeFaces[i], vertices, quads,
+                                   SUBDIVISION, SUBDIVISION));
+    }
+
+    RenderTransferCalculator reference(vertices, quads, RESOLUTION);
+    RenderTransferCalculator plain(vertices, quads, 64);
+    plain.setBlocks(blocks);
+    RenderTransferCalculator splatted(vertices, quads, 64);
+    splatted.setBlocks(blocks);
+    splatted.setSplatThreshold(4.0);
+
+    double plainError = 0.0;
+    double splattedError = 0.0;
+    for (int i = 0, n = quads.size(); i < n; i += 499) {
+        Vertex eye(paraCentre(quads[i], vertices));
+        Vertex dir(paraCross(quads[i], vertices));
+        Camera cam(eye, eye - dir, dir.perp());
+
+        std::vector<double> refLight = reference.calcLight(cam);
+        std::vector<double> plainLight = plain.calcLight(cam);
+        std::vector<double> splattedLight = splatted.calcLight(cam);
+        double total = 0.0;
+        for (int j = 0; j < n; ++j) {
+            double const pe = plainLight[j] - refLight[j];
+            double const se = splattedLight[j] - refLight[j];
+            plainError += pe * pe;
+            splattedError += se * se;
+            total += splattedLight[j];
+        }
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(1.0, total, 0.02);
+    }
+    CPPUNIT_ASSERT(splattedError < 0.5 * plainError);
+}
+
+// Multi-resolution rendering should only lose polys smaller than a
+// tile, and there are none here. A corner poking into a tile between
+// the coarse samples can still move a few pixels.
+void TransfersTestCase::multiResMatchesAtlas()
+{
+    std::vector<Vertex> vertices(cubeVertices);
+    std::vector<Quad> quads;
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        subdivide(cubeFaces[i], vertices, quads, 8, 8);
+    }
+    std::vector<Quad> innerFaces(cubeFaces);
+    scale(0.4, innerFaces, vertices);
+    flip(innerFaces, vertices);
+    rotate(Vertex(1.0, 0.0, 0.0), M_PI / 3.0, innerFaces, vertices);
+    for (int i = 0, n = innerFaces.size(); i < n; ++i) {
+        subdivide(innerFaces[i], vertices, quads, 2, 2);
+    }
+
+    RenderTransferCalculator plain(vertices, quads, 128);
+    RenderTransferCalculator multiRes(vertices, quads, 128);
+    plain.setUseAtlas(true);
+    multiRes.setUseAtlas(true);
+    multiRes.setMultiResolution(4);
+
+    for (int i = 0, n = quads.size(); i < n; i += 29) {
+        Vertex eye(paraCentre(quads[i], vertices));
+        Vertex dir(paraCross(quads[i], vertices));
+        Camera cam(eye, eye - dir, dir.perp());
+
+        std::vector<double> plainLight = plain.calcLight(cam);
+        std::vector<double> multiResLight = multiRes.calcLight(cam);
+        double total = 0.0;
+        for (int j = 0; j < n; ++j) {
+            CPPUNIT_ASSERT_DOUBLES_EQUAL(plainLight[j], multiResLight[j],
+                                         1.0e-4);
+            total += multiResLight[j];
+        }
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(1.0, total, 1.0e-3);
+    }
+}
+
+void TransfersTestCase::itemBufferMatchesSeparateCalcs()
+{
+    std::vector<Vertex> vertices(cubeVertices);
+    std::vector<Quad> quads;
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        subdivide(cubeFaces[i], vertices, quads, SUBDIVISION, SUBDIVISION);
+    }
+
+    RenderTransferCalculator rtc(vertices, quads, RESOLUTION);
+    int const n = quads.size();
+    for (int i = 0; i < n; i += 41) {
+        Vertex eye(paraCentre(quads[i], vertices));
+        Vertex dir(paraCross(quads[i], vertices));
+        Camera cam(eye, eye - dir, dir.perp());
+
+        std::vector<double> subtended = rtc.calcSubtended(cam);
+        std::vector<double> light = rtc.calcLight(cam);
+        std::vector<double> bothSubtended(n);
+        std::vector<double> bothLight(n);
+        rtc.calcSubtendedAndLight(cam, &bothSubtended[0], &bothLight[0]);
+        for (int j = 0; j < n; ++j) {
+            CPPUNIT_ASSERT_DOUBLES_EQUAL(subtended[j], bothSubtended[j],
+                                         1.0e-9);
+            CPPUNIT_ASSERT_DOUBLES_EQUAL(light[j], bothLight[j], 1.0e-9);
+        }
+    }
+
+    // The kept buffer can be summed again, and has depths if asked.
+    Camera cam(Vertex(0.1, -0.1, 0.05),
+               Vertex(1.0, 1.0, 1.0),
+               Vertex(1.0, 0.0, 0.0));
+    ItemBuffer items;
+    rtc.renderItems(cam, items, true);
+    CPPUNIT_ASSERT(items.hasDepths());
+    std::vector<double> light1(n), light2(n);
+    rtc.sumLight(items, &light1[0]);
+    rtc.sumLight(items, &light2[0]);
+    for (int j = 0; j < n; ++j) {
+        CPPUNIT_ASSERT_EQUAL(light1[j], light2[j]);
+    }
+}
+
+// RMS error, against "expected", of the light each wall of the
+// subdivided cube gets from each poly. Aligned hemicubes make the
+// errors on a wall line up, rather than cancel out.
+static double wallError(std::vector<double> const &expected,
+                        std::vector<double> const &actual,
+                        int perWall)
+{
+    int const n = sqrt(expected.size());
+    double sumSq = 0.0;
+    for (int wall = 0; wall < n / perWall; ++wall) {
+        for (int j = 0; j < n; ++j) {
+            double err = 0.0;
+            for (int i = wall * perWall; i < (wall + 1) * perWall; ++i) {
+                err += actual[i * n + j] - expected[i * n + j];
+            }
+            sumSq += err * err;
+        }
+    }
+    return sqrt(sumSq * perWall / expected.size());
+}
+
+void TransfersTestCase::rotationReducesLowResolutionError()
+{
+    std::vector<Vertex> vertices(cubeVertices);
+    std::vector<Quad> quads;
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        subdivide(cubeFaces[i], vertices, quads, 4, 4);
+    }
+
+    std::vector<double> expected;
+    RenderTransferCalculator highRes(vertices, quads, 256);
+    highRes.calcAllLights(expected);
+
+    // The gain shrinks as the resolution goes up and the aligned
+    // errors get smaller anyway.
+    struct { int resolution; double maxRatio; } const cases[] = {
+        { 8, 0.5 },
+        { 16, 0.8 },
+    };
+    for (auto const &c : cases) {
+        RenderTransferCalculator lowRes(vertices, quads, c.resolution);
+        std::vector<double> aligned;
+        lowRes.calcAllLights(aligned);
+        lowRes.setJitter(true, 0.0);
+        std::vector<double> rotated;
+        lowRes.calcAllLights(rotated);
+
+        double const alignedError = wallError(expected, aligned, 16);
+        double const rotatedError = wallError(expected, rotated, 16);
+        CPPUNIT_ASSERT(rotatedError < c.maxRatio * alignedError);
+    }
+}
+
+void TransfersTestCase::jitterIsRepeatable()
+{
+    std::vector<Vertex> vertices(cubeVertices);
+    std::vector<Quad> quads;
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        subdivide(cubeFaces[i], vertices, quads, 4, 4);
+    }
+
+    RenderTransferCalculator rtc(vertices, quads, RESOLUTION);
+    rtc.setJitter(true, 0.5);
+    std::vector<double> weights1;
+    rtc.calcAllLights(weights1);
+    std::vector<double> weights2;
+    rtc.calcAllLights(weights2);
+
+    int const n = quads.size();
+    for (int i = 0; i < n; ++i) {
+        double total = 0.0;
+        for (int j = 0; j < n; ++j) {
+            CPPUNIT_ASSERT_EQUAL(weights1[i * n + j], weights2[i * n + j]);
+            total += weights1[i * n + j];
+        }
+        // Still inside the cube, so sees all the light.
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(1.0, total, 1.0e-3);
+    }
+}
+
+// Reprojected pixels should nearly always get the same poly as a
+// fresh render would.
+void TransfersTestCase::coherentMatchesPlain()
+{
+    std::vector<Vertex> vertices(cubeVertices);
+    std::vector<Quad> quads;
+    for (int i = 0, n = cubeFaces.size(); i < n; ++i) {
+        subdivide(cubeFaces[i], vertices, quads, 8, 8);
+    }
+    std::vector<Quad> innerFaces(cubeFaces);
+    scale(0.4, innerFaces, vertices);
+    flip(innerFaces, vertices);
+    rotate(Vertex(1.0, 0.0, 0.0), M_PI / 3.0, innerFaces, vertices);
+    for (int i = 0, n = innerFaces.size(); i < n; ++i) {
+        subdivide(innerFaces[i], vertices, quads, 2, 2);
+    }
+
+    RenderTransferCalculator rtc(vertices, quads, 64);
+    std::vector<double> plain;
+    rtc.calcAllLights(plain);
+    rtc.setCoherent(true);
+    std::vector<double> coherent;
+    rtc.calcAllLights(coherent);
+
+    double sumSq = 0.0;
+    for (int i = 0, n = plain.size(); i < n; ++i) {
+        double const err = coherent[i] - plain[i];
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(0.0, err, 1.0e-3);
+        sumSq += err * err;
+    }
+    CPPUNIT_ASSERT(sqrt(sumSq / plain.size()) < 1.0e-5);
+}
@@ -0,0 +1,202 @@
+////////////////////////////////////////////////////////////////////////
+//
+// vecmath.h: Header-only 3d point and colour maths, underneath
+// Vertex and Colour, so that it all inlines.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#ifndef RADIOSITY_VECMATH_H
+#define RADIOSITY_VECMATH_H
+
+#include <cmath>
+#include <iostream>
+#include <type_traits>
+
+// Both types are stored four wide, with the last lane kept at zero,
+// so that a whole value can be loaded and operated on as one SIMD
+// vector. They're only aligned to 16 bytes, not the full width for
+// doubles, as that's all std::vector promises before C++17.
+//
+// The operators are single expressions, so they're constexpr in
+// C++11, and simple enough for the compiler to vectorise and fuse.
+
+////////////////////////////////////////////////////////////////////////
+// Yet another 3d point class
+
+template<typename T>
+class alignas(16) BasicVertex
+{
+public:
+    constexpr BasicVertex()
+        : p { 0, 0, 0, 0 }
+    {
+    }
+
+    constexpr BasicVertex(T ix, T iy, T iz)
+        : p { ix, iy, iz, 0 }
+    {
+    }
+
+    T len() const
+    {
+        return std::sqrt(x() * x() + y() * y() + z() * z());
+    }
+
+    BasicVertex norm() const
+    {
+        T l = len();
+        return BasicVertex(x() / l, y() / l, z() / l);
+    }
+
+    // Get an arbitrary perpendicular vector.
+    BasicVertex perp() const
+    {
+        // Choose the axis-aligned vector most orthogonal, and then
+        // properly orthogonalise it.
+        T ax = std::fabs(x()), ay = std::fabs(y()), az = std::fabs(z());
+        if (ax < ay && ax < az) {
+            return orthog(BasicVertex(1, 0, 0), *this);
+        }
+        if (ay < az) {
+            return orthog(BasicVertex(0, 1, 0), *this);
+        } else {
+            return orthog(BasicVertex(0, 0, 1), *this);
+        }
+    }
+
+    constexpr BasicVertex scale(T s) const
+    {
+        return BasicVertex(x() * s, y() * s, z() * s);
+    }
+
+    constexpr BasicVertex operator+(BasicVertex const &rhs) const
+    {
+        return BasicVertex(x() + rhs.x(), y() + rhs.y(), z() + rhs.z());
+    }
+
+    constexpr BasicVertex operator-(BasicVertex const &rhs) const
+    {
+        return BasicVertex(x() - rhs.x(), y() - rhs.y(), z() - rhs.z());
+    }
+
+    constexpr T x() const { return p[0]; }
+    constexpr T y() const { return p[1]; }
+    constexpr T z() const { return p[2]; }
+
+    // x, y and z, then a zero.
+    T p[4];
+};
+
+template<typename T>
+std::ostream &operator<<(std::ostream &os, BasicVertex<T> const &v)
+{
+    return os << "(" << v.x() << ", " << v.y() << ", " << v.z() << ")";
+}
+
+// Cross product.
+template<typename T>
+constexpr BasicVertex<T> cross(BasicVertex<T> const &v1,
+                               BasicVertex<T> const &v2)
+{
+    return BasicVertex<T>(v1.y() * v2.z() - v1.z() * v2.y(),
+                          v1.z() * v2.x() - v1.x() * v2.z(),
+                          v1.x() * v2.y() - v1.y() * v2.x());
+}
+
+// Dot product.
+template<typename T>
+constexpr T dot(BasicVertex<T> const &v1, BasicVertex<T> const &v2)
+{
+    return v1.x() * v2.x()
+         + v1.y() * v2.y()
+         + v1.z() * v2.z();
+}
+
+// Orthogonalise v1, taking away the v2 component.
+template<typename T>
+constexpr BasicVertex<T> orthog(BasicVertex<T> const &v1,
+                                BasicVertex<T> const &v2)
+{
+    return v1 - v2.scale(dot(v1, v2) / dot(v2, v2));
+}
+
+// Linear interpolation. 0 returns v1, 1 returns v2. (common_type
+// stops "i" taking part in deducing T, so it can be any number.)
+template<typename T>
+constexpr BasicVertex<T> lerp(BasicVertex<T> const &v1,
+                              BasicVertex<T> const &v2,
+                              typename std::common_type<T>::type i)
+{
+    return BasicVertex<T>(v1.x() * (1 - i) + v2.x() * i,
+                          v1.y() * (1 - i) + v2.y() * i,
+                          v1.z() * (1 - i) + v2.z() * i);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Colours
+
+// Simple red, green and blue components aren't particularly
+// realistic, physically, but they'll do for us.
+template<typename T>
+class alignas(16) BasicColour
+{
+public:
+    constexpr BasicColour()
+        : r(0), g(0), b(0), pad(0)
+    {
+    }
+
+    constexpr BasicColour(T red, T green, T blue)
+        : r(red), g(green), b(blue), pad(0)
+    {
+    }
+
+    constexpr BasicColour operator*(T x) const
+    {
+        return BasicColour(r * x, g * x, b * x);
+    }
+
+    constexpr BasicColour operator*(BasicColour const &c) const
+    {
+        return BasicColour(r * c.r, g * c.g, b * c.b);
+    }
+
+    constexpr BasicColour operator+(BasicColour const &c) const
+    {
+        return BasicColour(r + c.r, g + c.g, b + c.b);
+    }
+
+    BasicColour &operator+=(BasicColour const &c)
+    {
+        r += c.r; g += c.g; b += c.b;
+        return *this;
+    }
+
+    constexpr T asGrey() const
+    {
+        return T(0.2126) * r + T(0.7152) * g + T(0.0722) * b;
+    }
+
+    T r, g, b;
+    // Always zero, to make it four wide.
+    T pad;
+};
+
+////////////////////////////////////////////////////////////////////////
+// The instantiations used.
+
+typedef BasicVertex<double> Vertex;
+typedef BasicVertex<float> VertexF;
+typedef BasicColour<double> Colour;
+typedef BasicColour<float> ColourF;
+
+// So they can be memcpy'd, read straight from files, etc.
+static_assert(std::is_trivially_copyable<Vertex>::value, "Vertex copy");
+static_assert(std::is_trivially_copyable<Colour>::value, "Colour copy");
+static_assert(sizeof(Vertex) == 4 * sizeof(double), "Vertex size");
+static_assert(sizeof(VertexF) == 4 * sizeof(float), "VertexF size");
+static_assert(sizeof(Colour) == 4 * sizeof(double), "Colour size");
+static_assert(sizeof(ColourF) == 4 * sizeof(float), "ColourF size");
+
+#endif // RADIOSITY_VECMATH_H
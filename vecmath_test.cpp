@@ -0,0 +1,79 @@
+////////////////////////////////////////////////////////////////////////
+//
+// vecmath_test.cpp: Tests for vecmath.h. Most of the Vertex and Colour
+// behaviour is covered by geom_test.cpp, so this is the rest.
+//
+// Copyright (c) Simon Frankau 2018
+//
+
+#include <cstdint>
+#include <cstring>
+
+#include <cppunit/TestCase.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "vecmath.h"
+
+class VecMathTestCase : public CppUnit::TestCase
+{
+private:
+    CPPUNIT_TEST_SUITE(VecMathTestCase);
+    CPPUNIT_TEST(testConstexpr);
+    CPPUNIT_TEST(testPaddingStaysZero);
+    CPPUNIT_TEST(testMemcpy);
+    CPPUNIT_TEST(testFloat);
+    CPPUNIT_TEST_SUITE_END();
+
+    void testConstexpr();
+    void testPaddingStaysZero();
+    void testMemcpy();
+    void testFloat();
+};
+
+CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(VecMathTestCase, "VecMathTestCase");
+
+void VecMathTestCase::testConstexpr()
+{
+    // All checked at compile time.
+    constexpr Vertex x(1.0, 0.0, 0.0);
+    constexpr Vertex y(0.0, 1.0, 0.0);
+    static_assert(cross(x, y).z() == 1.0, "cross");
+    static_assert(dot(x + y, y.scale(2.0)) == 2.0, "dot");
+    static_assert(lerp(x, y, 0.5).x() == 0.5, "lerp");
+    static_assert(orthog(x + y, x).x() == 0.0, "orthog");
+    constexpr Colour c = Colour(1.0, 0.5, 0.25) * 2.0 + Colour();
+    static_assert(c.g == 1.0, "colour");
+}
+
+void VecMathTestCase::testPaddingStaysZero()
+{
+    Vertex v = lerp(Vertex(1.0, 2.0, 3.0), Vertex(-4.0, 5.0, 6.0), 0.3);
+    v = cross(v, Vertex(7.0, 8.0, 9.0)).norm().perp() - v.scale(3.0);
+    CPPUNIT_ASSERT_EQUAL(0.0, v.p[3]);
+
+    Colour c = Colour(1.0, 2.0, 3.0) * Colour(4.0, 5.0, 6.0) * 0.5;
+    c += Colour(1.0, 1.0, 1.0);
+    CPPUNIT_ASSERT_EQUAL(0.0, c.pad);
+}
+
+void VecMathTestCase::testMemcpy()
+{
+    // Trivially copyable, so a byte copy is a real copy.
+    Vertex vs[2] = { Vertex(1.0, 2.0, 3.0), Vertex() };
+    memcpy(&vs[1], &vs[0], sizeof(Vertex));
+    CPPUNIT_ASSERT_EQUAL(2.0, vs[1].y());
+    CPPUNIT_ASSERT_EQUAL(0u, reinterpret_cast<uintptr_t>(&vs[1]) % 16u);
+}
+
+void VecMathTestCase::testFloat()
+{
+    VertexF v1(3.0f, 0.0f, 4.0f);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(5.0f, v1.len(), 1e-6);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(1.0f, v1.norm().len(), 1e-6);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.0f, dot(v1.perp(), v1), 1e-6);
+    VertexF v2 = lerp(v1, VertexF(), 0.25);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(3.0f, v2.z(), 1e-6);
+
+    ColourF c(0.5f, 0.5f, 0.5f);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.5f, c.asGrey(), 1e-6);
+}
@@ -105,3 +105,17 @@ void calcSideLightWeights(int resolution, std::vector<double> &weights)
         }
     }
 }
+
+// Calculate weights for a whole hemicube rendered into a single
+// atlas: the forward-facing weights, followed by four copies of the
+// sideways-facing weights.
+void calcAtlasLightWeights(int resolution, std::vector<double> &weights)
+{
+    calcForwardLightWeights(resolution, weights);
+
+    std::vector<double> sideWeights;
+    calcSideLightWeights(resolution, sideWeights);
+    for (int i = 0; i < 4; ++i) {
+        weights.insert(weights.end(), sideWeights.begin(), sideWeights.end());
+    }
+}
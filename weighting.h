@@ -27,4 +27,9 @@ void calcForwardLightWeights(int resolution, std::vector<double> &weights);
 // but for the sideways-facing cube maps.
 void calcSideLightWeights(int resolution, std::vector<double> &weights);
 
+// Calculate weights for a whole hemicube rendered into a single
+// atlas: the forward-facing weights, followed by four copies of the
+// sideways-facing weights.
+void calcAtlasLightWeights(int resolution, std::vector<double> &weights);
+
 #endif // RADIOSITY_WEIGHTING_H
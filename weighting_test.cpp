@@ -22,12 +22,14 @@ private:
     CPPUNIT_TEST(testCalcSubtendWeightsSumToOne);
     CPPUNIT_TEST(testWeightsMatch);
     CPPUNIT_TEST(testCalcLightWeightsSumToOne);
+    CPPUNIT_TEST(testAtlasLightWeightsSumToOne);
     CPPUNIT_TEST_SUITE_END();
 
     void testProjSubtendWeightsSumToOne();
     void testCalcSubtendWeightsSumToOne();
     void testWeightsMatch();
     void testCalcLightWeightsSumToOne();
+    void testAtlasLightWeightsSumToOne();
 };
 
 CPPUNIT_TEST_SUITE_NAMED_REGISTRATION(WeightingTestCase, "WeightingTestCase");
@@ -84,3 +86,15 @@ void WeightingTestCase::testCalcLightWeightsSumToOne()
     double totalWeight = totalFrontWeight + 4 * totalSideWeight;
     CPPUNIT_ASSERT_DOUBLES_EQUAL(1.0, totalWeight, 1e-5);
 }
+
+void WeightingTestCase::testAtlasLightWeightsSumToOne()
+{
+    std::vector<double> weights;
+    calcAtlasLightWeights(RESOLUTION, weights);
+    CPPUNIT_ASSERT_EQUAL(3ul * RESOLUTION * RESOLUTION, weights.size());
+    double total = 0.0;
+    for (int i = 0, n = weights.size(); i < n; ++i) {
+        total += weights[i];
+    }
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(1.0, total, 1e-5);
+}